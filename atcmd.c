@@ -0,0 +1,598 @@
+
+/*
+ *	atcmd.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	AT command engine: a queue of commands for each module, with
+ *	per-command timeouts and completion callbacks, and a single place
+ *	where unsolicited result codes are split out of the input.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "atcmd.h"
+#include "device.h"
+#include "hmalloc.h"
+#include "log.h"
+
+#define AT_SETTLE	500	/* ms of quiet after a result to the resync probe */
+
+int at_pipeline = 1;		/* max number of commands in flight */
+
+struct at_rtt at_rtts[AT_RTT_CMDS];
+int at_rtt_count = 0;
+
+/* URCs which are followed by a PDU line */
+static char *pdu_urcs[] = { "+CMT:", "+CBM:", "+CDS:", NULL };
+
+static void at_readable(int fd, void *arg);
+static void at_timeout(struct ev_timer *t, void *arg);
+
+/*
+ *	Open a channel on a connected fd
+ */
+
+struct at_chan *at_open(int fd, char *name, at_urc_cb urc_cb, at_fail_cb fail_cb, void *arg)
+{
+	struct at_chan *ch;
+
+	ch = hmalloc(sizeof(*ch));
+	memset(ch, 0, sizeof(*ch));
+	ch->fd = fd;
+	ch->name = hstrdup(name);
+	ch->arg = arg;
+	ch->unsent = ch->tail = &ch->queue;
+	ch->urc_cb = urc_cb;
+	ch->fail_cb = fail_cb;
+	ch->timer = ev_timer_new(at_timeout, ch);
+
+	if (ev_add_fd(fd, at_readable, ch))
+		ch->failed = 1;
+
+	return ch;
+}
+
+/*
+ *	Free a command
+ */
+
+static void at_free_cmd(struct at_cmd *c)
+{
+	hfree(c->cmd);
+	if (c->data)
+		hfree(c->data);
+	if (c->resp)
+		hfree(c->resp);
+	hfree(c);
+}
+
+/* Count the round trip of a command which got a result */
+
+static void at_rtt_add(struct at_cmd *c)
+{
+	struct timespec now;
+	struct at_rtt *r;
+	int i, l;
+
+	l = strcspn(c->cmd, "=?");
+	if (l >= sizeof(r->cmd))
+		l = sizeof(r->cmd) - 1;
+
+	for (i = 0; i < at_rtt_count; i++)
+		if (!strncmp(at_rtts[i].cmd, c->cmd, l) && at_rtts[i].cmd[l] == 0)
+			break;
+	if (i == at_rtt_count) {
+		if (at_rtt_count < AT_RTT_CMDS - 1) {
+			memcpy(at_rtts[i].cmd, c->cmd, l);
+			at_rtts[i].cmd[l] = 0;
+			at_rtt_count++;
+		} else {
+			/* the last one is for the rest */
+			i = AT_RTT_CMDS - 1;
+			strcpy(at_rtts[i].cmd, "other");
+			at_rtt_count = AT_RTT_CMDS;
+		}
+	}
+	r = &at_rtts[i];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tl_hist_add(&r->h, (now.tv_sec - c->sent.tv_sec) * 1e3 + (now.tv_nsec - c->sent.tv_nsec) / 1e6);
+}
+
+/*
+ *	Take the oldest command off the queue and run its callback
+ */
+
+static void at_finish(struct at_chan *ch, int result)
+{
+	struct at_cmd *c = ch->queue;
+
+	ch->queue = c->next;
+	if (ch->unsent == &c->next)
+		ch->unsent = &ch->queue;
+	if (ch->tail == &c->next)
+		ch->tail = &ch->queue;
+	if (c->state != AT_QUEUED)
+		ch->inflight--;
+	if (c->state != AT_QUEUED && result != AT_IO)
+		at_rtt_add(c);
+
+	c->result = result;
+	if (c->cb)
+		c->cb(ch, c, c->arg);
+
+	at_free_cmd(c);
+}
+
+/*
+ *	Complete everything in the queue with an I/O error. The queue is
+ *	taken off the channel first: a callback may submit a new command,
+ *	which then waits on the channel instead of being aborted in turn.
+ */
+
+static void at_abort_all(struct at_chan *ch)
+{
+	struct at_cmd *c, *next;
+
+	ev_timer_stop(ch->timer);
+	c = ch->queue;
+	ch->queue = NULL;
+	ch->unsent = ch->tail = &ch->queue;
+	ch->inflight = 0;
+
+	for (; (c); c = next) {
+		next = c->next;
+		c->result = AT_IO;
+		if (c->cb)
+			c->cb(ch, c, c->arg);
+		at_free_cmd(c);
+	}
+}
+
+/*
+ *	The connection failed: nothing more will be written
+ */
+
+static void at_fail(struct at_chan *ch)
+{
+	if (ch->failed)
+		return;
+
+	ch->failed = 1;
+	if (ch->fail_cb)
+		ch->fail_cb(ch);
+	at_abort_all(ch);
+}
+
+/*
+ *	Write out commands while the pipeline has room. A command which
+ *	is answered with a prompt is written only when nothing else is
+ *	in flight, and nothing is written after it until it completes.
+ */
+
+static void at_kick(struct at_chan *ch)
+{
+	struct at_cmd *c;
+
+	if (ch->failed || ch->resync)
+		return;
+
+	while ((c = *ch->unsent) && ch->inflight < at_pipeline) {
+		if (ch->inflight && (c->data || ch->queue->data))
+			break;
+
+		if (fdprintf(ch->fd, "%s\r\n", c->cmd) != strlen(c->cmd) + 2) {
+			at_fail(ch);
+			return;
+		}
+		c->state = AT_SENT;
+		clock_gettime(CLOCK_MONOTONIC, &c->sent);
+		ch->inflight++;
+		ch->unsent = &c->next;
+	}
+
+	/* the oldest command in flight is timed */
+	if (ch->inflight && !ch->timer->armed)
+		ev_timer_set(ch->timer, (ch->queue->state == AT_DATA_SENT) ? ch->queue->data_timeout : ch->queue->timeout);
+}
+
+/*
+ *	Back in step with the module after a timeout
+ */
+
+static void at_resync_done(struct at_chan *ch)
+{
+	hlog(LOG_INFO, "%s: Module answered AT, continuing", ch->name);
+	ch->resync = 0;
+	at_kick(ch);
+}
+
+/*
+ *	Complete the oldest command in flight
+ */
+
+static void at_complete(struct at_chan *ch, int result)
+{
+	ev_timer_stop(ch->timer);
+	at_finish(ch, result);
+	at_kick(ch);
+}
+
+/*
+ *	Allocate a command
+ */
+
+static struct at_cmd *at_new_cmd(char *cmd, int timeout, at_cmd_cb cb, void *arg)
+{
+	struct at_cmd *c;
+
+	c = hmalloc(sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->cmd = hstrdup(cmd);
+	c->timeout = timeout;
+	c->cb = cb;
+	c->arg = arg;
+
+	return c;
+}
+
+/*
+ *	Queue commands
+ */
+
+static struct at_cmd *at_append(struct at_chan *ch, struct at_cmd *c)
+{
+	*ch->tail = c;
+	ch->tail = &c->next;
+	at_kick(ch);
+
+	return c;
+}
+
+struct at_cmd *at_send(struct at_chan *ch, char *cmd, int timeout, at_cmd_cb cb, void *arg)
+{
+	return at_append(ch, at_new_cmd(cmd, timeout, cb, arg));
+}
+
+struct at_cmd *at_send_data(struct at_chan *ch, char *cmd, char *data,
+	int timeout, int data_timeout, at_cmd_cb cb, void *arg)
+{
+	struct at_cmd *c;
+
+	c = at_new_cmd(cmd, timeout, cb, arg);
+	c->data = hstrdup(data);
+	c->data_timeout = data_timeout;
+
+	return at_append(ch, c);
+}
+
+struct at_cmd *at_send_urgent(struct at_chan *ch, char *cmd, int timeout, at_cmd_cb cb, void *arg)
+{
+	struct at_cmd *c;
+
+	c = at_new_cmd(cmd, timeout, cb, arg);
+	c->next = *ch->unsent;
+	*ch->unsent = c;
+	if (ch->tail == ch->unsent)
+		ch->tail = &c->next;
+	at_kick(ch);
+
+	return c;
+}
+
+int at_pending(struct at_chan *ch)
+{
+	struct at_cmd *c;
+	int n = 0;
+
+	for (c = ch->queue; (c); c = c->next)
+		n++;
+
+	return n;
+}
+
+/*
+ *	Close a channel
+ */
+
+void at_close(struct at_chan *ch)
+{
+	struct at_cmd *c;
+
+	ev_del_fd(ch->fd);
+	ev_timer_free(ch->timer);
+	ch->failed = 1;
+	at_abort_all(ch);
+	while ((c = ch->queue)) {
+		hlog(LOG_ERR, "%s: Dropping %s submitted to a closed channel", ch->name, c->cmd);
+		ch->queue = c->next;
+		at_free_cmd(c);
+	}
+
+	if (ch->urc)
+		hfree(ch->urc);
+	hfree(ch->name);
+	hfree(ch);
+}
+
+/*
+ *	Check if a line is a given word, possibly followed by spaces
+ */
+
+static int line_is(char *line, char *word)
+{
+	int l = strlen(word);
+
+	if (strncmp(line, word, l))
+		return 0;
+
+	for (line += l; (*line); line++)
+		if (*line != ' ')
+			return 0;
+
+	return 1;
+}
+
+/*
+ *	Check if a +XXX: line is a response to a command: AT+XXX...
+ */
+
+static int response_to(char *line, struct at_cmd *c)
+{
+	char *name = c->cmd + 2;
+	int l;
+
+	if (strncasecmp(c->cmd, "AT", 2))
+		return 0;
+
+	l = strcspn(name, "=?");
+
+	return (l && !strncmp(line, name, l) && line[l] == ':');
+}
+
+/*
+ *	Add a line to the response of a command
+ */
+
+static void resp_add(struct at_cmd *c, char *line)
+{
+	int l = strlen(line);
+
+	if (c->resp_len + l + 2 > c->resp_size) {
+		c->resp_size = (c->resp_len + l + 2) * 2;
+		c->resp = hrealloc(c->resp, c->resp_size);
+	}
+	memcpy(c->resp + c->resp_len, line, l);
+	c->resp_len += l;
+	c->resp[c->resp_len++] = '\n';
+	c->resp[c->resp_len] = '\0';
+}
+
+/*
+ *	Check if a line is a final result code
+ */
+
+static int line_is_final(char *line)
+{
+	return (line_is(line, "OK") || line_is(line, "ERROR")
+		|| !strncmp(line, "+CME ERROR", 10) || !strncmp(line, "+CMS ERROR", 10));
+}
+
+/*
+ *	A line while resynchronising. The module answers in order, so the
+ *	probe's result is the last of the ones which may still come; if
+ *	fewer come, the channel is taken to be in step when the module
+ *	stays quiet for a while after one.
+ */
+
+static void at_resync_line(struct at_chan *ch, char *line)
+{
+	if (line_is_final(line)) {
+		ch->resync_seen = 1;
+		if (--ch->resync_left > 0) {
+			ev_timer_set(ch->timer, AT_SETTLE);
+			return;
+		}
+		ev_timer_stop(ch->timer);
+		at_resync_done(ch);
+		return;
+	}
+
+	if (line[0] == '+' || line[0] == '^')
+		ch->urc_cb(ch, line, NULL);
+	else
+		hlog(LOG_DEBUG, "%s: Discarding late response: %s", ch->name, line);
+}
+
+/*
+ *	Handle a complete line of input from the module
+ */
+
+static void at_line(struct at_chan *ch, char *line)
+{
+	struct at_cmd *c = (ch->inflight) ? ch->queue : NULL;
+	char **u;
+	char *p;
+
+	for (p = line; (*p == ' '); p++)
+		;
+	if (!*p)
+		return;	/* empty line */
+
+	if (ch->urc) {
+		/* the PDU of a +CMT, +CBM or +CDS */
+		p = ch->urc;
+		ch->urc = NULL;
+		ch->urc_cb(ch, p, line);
+		hfree(p);
+		return;
+	}
+
+	for (u = pdu_urcs; (*u); u++) {
+		if (!strncmp(line, *u, strlen(*u))) {
+			ch->urc = hstrdup(line);
+			return;
+		}
+	}
+
+	if (ch->resync) {
+		at_resync_line(ch, line);
+		return;
+	}
+
+	if (line_is_final(line)) {
+		if (line_is(line, "OK")) {
+			if (c) {
+				resp_add(c, line);
+				at_complete(ch, AT_OK);
+			} else
+				hlog(LOG_DEBUG, "%s: Unexpected OK", ch->name);
+		} else if (c) {
+			hlog(LOG_ERR, "%s: Error response to %s: %s", ch->name, c->cmd, line);
+			resp_add(c, line);
+			at_complete(ch, AT_ERROR);
+		} else
+			hlog(LOG_ERR, "%s: Unexpected error: %s", ch->name, line);
+		return;
+	}
+
+	if (!strncasecmp(line, "AT", 2))
+		return;	/* echo */
+
+	if (line[0] == '+' || line[0] == '^') {
+		/* +XXX: lines are responses only to AT+XXX commands */
+		if (c && response_to(line, c))
+			resp_add(c, line);
+		else
+			ch->urc_cb(ch, line, NULL);
+		return;
+	}
+
+	if (c)
+		resp_add(c, line);
+	else
+		ch->urc_cb(ch, line, NULL);
+}
+
+/*
+ *	Split input to lines, and write out the data of a command
+ *	when its prompt appears
+ */
+
+static void at_input(struct at_chan *ch, char *buf, int len)
+{
+	struct at_cmd *c;
+	char ch_c;
+	int i;
+
+	for (i = 0; i < len && !ch->failed; i++) {
+		ch_c = buf[i];
+
+		if (ch_c == '\r')
+			continue;
+
+		if (ch_c == '\n') {
+			ch->line[ch->line_len] = '\0';
+			ch->line_len = 0;
+			at_line(ch, ch->line);
+			continue;
+		}
+
+		c = ch->queue;
+		if (ch_c == '>' && ch->line_len == 0 && ch->inflight
+		    && c->data && c->state == AT_SENT) {
+			/* the prompt has no line feed after it */
+			if (fdprintf(ch->fd, "%s\x1A", c->data) != strlen(c->data) + 1) {
+				at_fail(ch);
+				return;
+			}
+			c->state = AT_DATA_SENT;
+			clock_gettime(CLOCK_MONOTONIC, &c->prompted);
+			ev_timer_set(ch->timer, c->data_timeout);
+			continue;
+		}
+
+		if (ch->line_len < sizeof(ch->line) - 1)
+			ch->line[ch->line_len++] = ch_c;
+	}
+}
+
+/*
+ *	Event callbacks
+ */
+
+static void at_readable(int fd, void *arg)
+{
+	struct at_chan *ch = arg;
+	char buf[4096];
+	int l;
+
+	if ((l = device_read(fd, buf, sizeof(buf))) < 0) {
+		at_fail(ch);
+		return;
+	}
+
+	at_input(ch, buf, l);
+}
+
+static void at_timeout(struct ev_timer *t, void *arg)
+{
+	struct at_chan *ch = arg;
+	struct at_cmd *c = ch->queue;
+	int n, timeout;
+
+	if (ch->resync) {
+		if (!ch->resync_seen) {
+			hlog(LOG_ERR, "%s: No response to AT after a timeout", ch->name);
+			at_fail(ch);
+			return;
+		}
+		at_resync_done(ch);
+		return;
+	}
+
+	if (!ch->inflight)
+		return;
+
+	hlog(LOG_ERR, "%s: Timeout for %s !", ch->name, c->cmd);
+
+	/* a late answer would be taken for the one of the next command:
+	 * give up on everything in flight, and write nothing more until
+	 * the module has answered an AT of our own
+	 */
+	timeout = (c->state == AT_DATA_SENT) ? c->data_timeout : c->timeout;
+	n = ch->inflight;
+	ch->resync = 1;
+	ch->resync_left = n + 1;
+	ch->resync_seen = 0;
+	while (ch->inflight)
+		at_finish(ch, AT_TIMEOUT);
+
+	if (ch->failed)
+		return;
+	if (fdprintf(ch->fd, "AT\r\n") != 4) {
+		at_fail(ch);
+		return;
+	}
+	ev_timer_set(ch->timer, timeout);
+}
+
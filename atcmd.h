@@ -0,0 +1,118 @@
+
+#ifndef ATCMD_H
+#define ATCMD_H
+
+#include <time.h>
+
+#include "event.h"
+#include "device.h"
+#include "timeline.h"
+
+/*
+ *	AT command engine. A channel owns the connection to one module:
+ *	it keeps a queue of commands, writes them out (several at a time
+ *	if pipelining is enabled), matches the response lines and final
+ *	result codes to them in order, and gives unsolicited result codes
+ *	to a single dispatcher callback, whenever they arrive.
+ */
+
+/* command results, same as what issue_cmd() used to return */
+#define AT_OK		0	/* OK */
+#define AT_IO		-1	/* I/O error, or the channel was closed */
+#define AT_ERROR	-2	/* ERROR, +CME ERROR or +CMS ERROR */
+#define AT_TIMEOUT	-3	/* no final result in time */
+
+/* command states */
+#define AT_QUEUED	0	/* waiting in the queue */
+#define AT_SENT		1	/* written, waiting for a result (or a prompt) */
+#define AT_DATA_SENT	2	/* data written after the prompt */
+
+struct at_chan;
+struct at_cmd;
+
+typedef void (*at_cmd_cb)(struct at_chan *ch, struct at_cmd *c, void *arg);
+typedef void (*at_urc_cb)(struct at_chan *ch, char *urc, char *pdu);
+typedef void (*at_fail_cb)(struct at_chan *ch);
+
+struct at_cmd {
+	char *cmd;		/* command line, without CR LF */
+	char *data;		/* written after the "> " prompt with a ^Z, or NULL */
+	int timeout;		/* ms, for the final result (or the prompt) */
+	int data_timeout;	/* ms, for the final result after the data */
+	int state;		/* AT_QUEUED ... */
+	int result;		/* AT_OK ... */
+	char *resp;		/* response lines, each terminated by \n, final result included */
+	int resp_len;
+	int resp_size;
+	struct timespec sent;	/* when the command was written */
+	struct timespec prompted; /* when the prompt came and the data was written */
+	at_cmd_cb cb;		/* called when the command completes, may be NULL */
+	void *arg;
+	struct at_cmd *next;
+};
+
+struct at_chan {
+	int fd;
+	char *name;		/* device name, for logging */
+	void *arg;		/* owner of the channel */
+	int failed;		/* I/O error, nothing more will be written */
+
+	struct at_cmd *queue;	/* oldest first, the ones in flight at the head */
+	struct at_cmd **unsent;	/* link to the first command not written yet */
+	struct at_cmd **tail;	/* link to append to */
+	int inflight;		/* commands written, waiting for results */
+	struct ev_timer *timer;	/* timeout of the oldest command in flight */
+	int resync;		/* after a timeout: nothing is written until the AT probe is answered */
+	int resync_left;	/* final results which may still come before the probe's */
+	int resync_seen;	/* a final result came after the probe was written */
+
+	char line[IBLEN];	/* the line being received */
+	int line_len;
+	char *urc;		/* +CMT style URC waiting for its PDU line */
+
+	at_urc_cb urc_cb;	/* unsolicited result codes go here */
+	at_fail_cb fail_cb;	/* called once on an I/O error */
+};
+
+extern int at_pipeline;		/* max number of commands in flight */
+
+/* round trip times of the commands, from written to the final result,
+ * by the command up to the = or ?, the ones which don't fit as "other"
+ */
+#define AT_RTT_CMDS	24
+
+struct at_rtt {
+	char cmd[16];
+	struct tl_hist h;
+};
+
+extern struct at_rtt at_rtts[AT_RTT_CMDS];
+extern int at_rtt_count;		/* entries used */
+
+/* Take over a connected fd. Does not close the fd when the channel
+ * is closed.
+ */
+extern struct at_chan *at_open(int fd, char *name, at_urc_cb urc_cb, at_fail_cb fail_cb, void *arg);
+
+/* Stop using the channel: every command still queued completes with
+ * AT_IO. The channel may not be closed from its own callbacks.
+ */
+extern void at_close(struct at_chan *ch);
+
+/* Queue a command */
+extern struct at_cmd *at_send(struct at_chan *ch, char *cmd, int timeout, at_cmd_cb cb, void *arg);
+
+/* Queue a command which is answered with a "> " prompt, after which
+ * data is written
+ */
+extern struct at_cmd *at_send_data(struct at_chan *ch, char *cmd, char *data,
+	int timeout, int data_timeout, at_cmd_cb cb, void *arg);
+
+/* Queue a command in front of the ones not written yet */
+extern struct at_cmd *at_send_urgent(struct at_chan *ch, char *cmd, int timeout, at_cmd_cb cb, void *arg);
+
+/* Number of commands queued or in flight */
+extern int at_pending(struct at_chan *ch);
+
+#endif
+
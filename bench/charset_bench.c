@@ -0,0 +1,154 @@
+
+/*
+ *	charset_bench.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Character set conversion: checks the generated lookup tables against
+ *	the table scan m20d used before, for every character and every pair
+ *	of character sets, and then measures both.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "charset.h"
+#include "charset_table.h"
+
+#define DEF_ROUNDS	200000	/* messages per timing run */
+#define MSG_LEN		160
+
+/*
+ *	The old convert() and ext_convert()
+ */
+
+static char old_convert(char c, int from, int to)
+{
+	int table = 0;
+
+	while (charset[table*4]) {
+		if (charset[table*4+from] == c)
+			return charset[table*4+to];
+		table++;
+	}
+	return ' ';
+}
+
+static char old_ext_convert(char c, int from, int to)
+{
+	int table = 0;
+
+	while (ext_charset[table*4]) {
+		if (ext_charset[table*4+from] == c)
+			return ext_charset[table*4+to];
+		table++;
+	}
+	return ' ';
+}
+
+/*
+ *	Compare every character of every conversion
+ */
+
+static int verify(void)
+{
+	int from, to, c;
+	int cases = 0;
+
+	for (from = CS_ISO; from <= CS_MT; from++) {
+		for (to = CS_ISO; to <= CS_MT; to++) {
+			for (c = 0; c < 256; c++) {
+				if (convert(c, from, to) != old_convert(c, from, to)) {
+					fprintf(stderr, "convert mismatch: %d => %d char 0x%02X\n", from, to, c);
+					return -1;
+				}
+				if (ext_convert(c, from, to) != old_ext_convert(c, from, to)) {
+					fprintf(stderr, "ext_convert mismatch: %d => %d char 0x%02X\n", from, to, c);
+					return -1;
+				}
+				cases += 2;
+			}
+		}
+	}
+
+	printf("charset: %d conversions compared with the table scan: OK\n", cases);
+
+	return 0;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *	Time converting 160-character messages from ISO to SMS and back,
+ *	like mo_encode_ascii() and binary2ascii() do
+ */
+
+static double run(const char *name, char (*conv)(char, int, int), int rounds)
+{
+	char s[MSG_LEN], t[MSG_LEN];
+	double start, elapsed;
+	unsigned sum = 0;
+	int i, j;
+
+	for (j = 0; j < MSG_LEN; j++)
+		s[j] = 32 + rand() % 95;
+
+	start = now_sec();
+	for (i = 0; i < rounds; i++) {
+		s[i % MSG_LEN] = 32 + i % 95;
+		for (j = 0; j < MSG_LEN; j++)
+			t[j] = conv(s[j], CS_ISO, CS_SMS);
+		for (j = 0; j < MSG_LEN; j++)
+			s[j] = conv(t[j], CS_SMS, CS_ISO);
+		sum += (unsigned char)s[i % MSG_LEN];
+	}
+	elapsed = now_sec() - start;
+
+	printf("%-12s %7d messages %8.3f s %8.1f ns/message (to SMS + back) [%u]\n",
+		name, rounds, elapsed, elapsed * 1e9 / rounds, sum & 1);
+
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = DEF_ROUNDS;
+	double old_t, new_t;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	srand(1);
+	if (verify())
+		return 1;
+
+	old_t = run("table-scan", old_convert, rounds / 10);
+	new_t = run("lookup", convert, rounds);
+	printf("speedup: %.1fx\n", (old_t * 10) / new_t);
+
+	return 0;
+}
+
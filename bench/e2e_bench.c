@@ -0,0 +1,346 @@
+
+/*
+ *	e2e_bench.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	End-to-end throughput and latency: runs bench/modemsim and ./m20d
+ *	talking to it, puts MO messages in the spool while the simulator
+ *	gives MT messages, and reports messages per second and the p50 and
+ *	p99 latencies. A MO message is timed from the spool file appearing
+ *	to the PDU reaching the module, a MT message from the +CMT to the
+ *	AT+CNMA which acknowledges it. With -c, bench/statemap_check reads
+ *	the state map of the daemon all the while, and the run fails if it
+ *	finds a bad copy.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <errno.h>
+
+#define SIM		"bench/modemsim"
+#define CHECK		"bench/statemap_check"
+#define M20D		"./m20d"
+#define DST_BASE	358400000000LL	/* MO n goes to +DST_BASE+n */
+
+static int mo_n = 200;		/* MO messages */
+static int mt_n = 50;		/* MT messages */
+static char *baud = "115200";
+static char *latency = "2";
+static char *net_delay = "0";
+static int use_pty = 0;
+static int timeout = 60;	/* s, for the whole run */
+static int check_map = 0;	/* run statemap_check alongside */
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int dcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double pct(double *v, int n, int p)
+{
+	int i = (n * p + 99) / 100 - 1;
+
+	if (i < 0)
+		i = 0;
+	return v[i];
+}
+
+static void report(const char *name, double *lat, int n, double first, double last)
+{
+	if (!n) {
+		printf("%s: none done\n", name);
+		return;
+	}
+
+	qsort(lat, n, sizeof(double), dcmp);
+	printf("%s: %d messages in %.3f s, %.1f messages/s, latency p50 %.1f ms p99 %.1f ms max %.1f ms\n",
+		name, n, (last - first) / 1e3, (last > first) ? n * 1e3 / (last - first) : 0.0,
+		pct(lat, n, 50), pct(lat, n, 99), lat[n - 1]);
+}
+
+/*
+ *	Start a program with its stdout in a pipe, or to /dev/null
+ */
+
+static pid_t run(char *const argv[], int *out)
+{
+	int p[2];
+	pid_t pid;
+
+	if (out && pipe(p))
+		return -1;
+
+	if ((pid = fork()) == 0) {
+		if (out) {
+			dup2(p[1], 1);
+			close(p[0]);
+			close(p[1]);
+		} else {
+			close(1);
+			open("/dev/null", O_WRONLY);
+		}
+		close(2);
+		open("/dev/null", O_WRONLY);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	if (out) {
+		close(p[1]);
+		*out = p[0];
+	}
+
+	return pid;
+}
+
+static int read_line(FILE *f, char *buf, int size)
+{
+	if (!fgets(buf, size, f))
+		return -1;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+static void rm_dir(const char *dir)
+{
+	char fn[512];
+	struct dirent *de;
+	DIR *d;
+
+	if (!(d = opendir(dir)))
+		return;
+	while ((de = readdir(d)))
+		if (de->d_name[0] != '.') {
+			snprintf(fn, sizeof(fn), "%s/%s", dir, de->d_name);
+			unlink(fn);
+		}
+	closedir(d);
+	rmdir(dir);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: e2e_bench [-n <MO messages>] [-m <MT messages>] [-b <baud, 0: no limit>]\n"
+		"\t[-l <module latency, ms>] [-x <MO network delay, ms>] [-P (pty instead of TCP)]\n"
+		"\t[-t <timeout, s>] [-c (check the state map meanwhile)]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char spool[] = "/tmp/m20d_bench.XXXXXX";
+	char line[256], dev[sizeof(line) + 16], fn[512], tmp[512];
+	char *sim_argv[16];
+	char *m20d_argv[16];
+	char *check_argv[8];
+	char map[sizeof(spool) + 32];
+	double *mo_start, *mo_lat, *mt_start, *mt_lat;
+	double t, mo_begin = 0, mo_last = 0, mt_first = 0, mt_last = 0, deadline;
+	int mo_done = 0, mt_done = 0;
+	int sim_fd, s, i, n;
+	long long dst;
+	pid_t sim_pid, m20d_pid, check_pid = -1;
+	struct pollfd pfd;
+	FILE *sim, *f, *check = NULL;
+	int check_fd, ok = 1;
+
+	while ((s = getopt(argc, argv, "n:m:b:l:x:Pt:ch?")) != -1) {
+		switch (s) {
+		case 'n': mo_n = atoi(optarg); break;
+		case 'm': mt_n = atoi(optarg); break;
+		case 'b': baud = optarg; break;
+		case 'l': latency = optarg; break;
+		case 'x': net_delay = optarg; break;
+		case 'P': use_pty = 1; break;
+		case 't': timeout = atoi(optarg); break;
+		case 'c': check_map = 1; break;
+		default: usage();
+		}
+	}
+
+	if (access(SIM, X_OK) || access(M20D, X_OK) || (check_map && access(CHECK, X_OK))) {
+		fprintf(stderr, "e2e_bench: run in the source directory after building m20d and %s\n", SIM);
+		return 1;
+	}
+	if (!mkdtemp(spool)) {
+		perror("e2e_bench: mkdtemp");
+		return 1;
+	}
+
+	mo_start = calloc(mo_n + 1, sizeof(double));
+	mo_lat = calloc(mo_n + 1, sizeof(double));
+	mt_start = calloc(mt_n + 1, sizeof(double));
+	mt_lat = calloc(mt_n + 1, sizeof(double));
+	snprintf(tmp, sizeof(tmp), "%d", mt_n);
+
+	/* the simulator tells where to find it */
+	n = 0;
+	sim_argv[n++] = SIM;
+	sim_argv[n++] = (use_pty) ? "-P" : "-t0";
+	sim_argv[n++] = "-b";
+	sim_argv[n++] = baud;
+	sim_argv[n++] = "-l";
+	sim_argv[n++] = latency;
+	sim_argv[n++] = "-x";
+	sim_argv[n++] = net_delay;
+	sim_argv[n++] = "-m";
+	sim_argv[n++] = tmp;
+	sim_argv[n] = NULL;
+	if ((sim_pid = run(sim_argv, &sim_fd)) < 0) {
+		perror("e2e_bench: starting the simulator");
+		return 1;
+	}
+	/* unbuffered, so that poll() sees every line which is waiting */
+	sim = fdopen(sim_fd, "r");
+	setvbuf(sim, NULL, _IONBF, 0);
+	if (read_line(sim, line, sizeof(line))) {
+		fprintf(stderr, "e2e_bench: the simulator did not start\n");
+		return 1;
+	}
+	if (!strncmp(line, "LISTEN ", 7))
+		snprintf(dev, sizeof(dev), "127.0.0.1:%s", line + 7);
+	else
+		snprintf(dev, sizeof(dev), "%s", line + 4);
+
+	n = 0;
+	m20d_argv[n++] = M20D;
+	m20d_argv[n++] = "-d";
+	m20d_argv[n++] = dev;
+	m20d_argv[n++] = "-s";
+	m20d_argv[n++] = spool;
+	m20d_argv[n++] = "-a";
+	m20d_argv[n++] = "/bin/true";
+	m20d_argv[n++] = "-e";
+	m20d_argv[n++] = "warning";
+	m20d_argv[n] = NULL;
+	if ((m20d_pid = run(m20d_argv, NULL)) < 0) {
+		perror("e2e_bench: starting m20d");
+		return 1;
+	}
+
+	printf("e2e: %d MO, %d MT over %s, %s baud, module latency %s ms, network delay %s ms\n",
+		mo_n, mt_n, (use_pty) ? "pty" : "TCP", baud, latency, net_delay);
+
+	deadline = now_ms() + timeout * 1e3;
+	pfd.fd = sim_fd;
+	pfd.events = POLLIN;
+
+	/* wait for m20d to have the module up, then fill the spool */
+	do {
+		if (poll(&pfd, 1, 1000) > 0 && read_line(sim, line, sizeof(line)))
+			break;
+	} while (strncmp(line, "UP ", 3) && now_ms() < deadline);
+
+	if (check_map) {
+		snprintf(map, sizeof(map), "%s/state.m20d.map", spool);
+		snprintf(fn, sizeof(fn), "%d", timeout);
+		n = 0;
+		check_argv[n++] = CHECK;
+		check_argv[n++] = "-t";
+		check_argv[n++] = fn;
+		check_argv[n++] = map;
+		check_argv[n] = NULL;
+		if ((check_pid = run(check_argv, &check_fd)) < 0) {
+			perror("e2e_bench: starting the state map check");
+			return 1;
+		}
+		check = fdopen(check_fd, "r");
+	}
+
+	mo_begin = now_ms();
+	for (i = 1; i <= mo_n; i++) {
+		snprintf(tmp, sizeof(tmp), "%s/.b%d", spool, i);
+		snprintf(fn, sizeof(fn), "%s/b%d.sms", spool, i);
+		if (!(f = fopen(tmp, "w"))) {
+			perror("e2e_bench: writing the spool");
+			break;
+		}
+		fprintf(f, "To: +%lld\n\nbench message %d\n", DST_BASE + i, i);
+		fclose(f);
+		mo_start[i] = now_ms();
+		rename(tmp, fn);
+	}
+
+	while ((mo_done < mo_n || mt_done < mt_n) && (t = now_ms()) < deadline) {
+		if (poll(&pfd, 1, (int)(deadline - t)) <= 0)
+			continue;
+		if (read_line(sim, line, sizeof(line)))
+			break;
+
+		if (sscanf(line, "MO %lf +%lld", &t, &dst) == 2) {
+			i = dst - DST_BASE;
+			if (i < 1 || i > mo_n || !mo_start[i])
+				continue;
+			mo_lat[mo_done++] = t - mo_start[i];
+			mo_start[i] = 0;	/* a retry is not counted again */
+			mo_last = t;
+		} else if (sscanf(line, "MT %lf %d", &t, &i) == 2) {
+			if (i >= 1 && i <= mt_n)
+				mt_start[i] = t;
+			if (!mt_first)
+				mt_first = t;
+		} else if (sscanf(line, "ACK %lf %d", &t, &i) == 2) {
+			if (i < 1 || i > mt_n || !mt_start[i])
+				continue;
+			mt_lat[mt_done++] = t - mt_start[i];
+			mt_start[i] = 0;
+			mt_last = t;
+		}
+	}
+
+	kill(m20d_pid, SIGTERM);
+	waitpid(m20d_pid, &s, 0);
+	kill(sim_pid, SIGTERM);
+	waitpid(sim_pid, &s, 0);
+
+	/* the check stops when it sees the daemon gone */
+	if (check_pid > 0) {
+		while (!read_line(check, line, sizeof(line)))
+			printf("%s\n", line);
+		waitpid(check_pid, &s, 0);
+		ok = (WIFEXITED(s) && WEXITSTATUS(s) == 0);
+	}
+	rm_dir(spool);
+
+	/* MO throughput from the first spool file on */
+	report("MO", mo_lat, mo_done, mo_begin, mo_last);
+	report("MT", mt_lat, mt_done, mt_first, mt_last);
+
+	return (ok && mo_done == mo_n && mt_done == mt_n) ? 0 : 1;
+}
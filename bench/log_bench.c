@@ -0,0 +1,155 @@
+
+/*
+ *	log_bench.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Log lines at a level which is not written out: the CPU a message
+ *	costs when its content is escaped for the log line and hlog()
+ *	then throws the line away, as m20d used to do, against checking
+ *	the level first with the hlog_on() and hlog() macros. A line which
+ *	is written out is timed too, for comparison.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "log.h"
+#include "message.h"
+#include "device.h"
+
+#define DEF_ROUNDS	200000	/* messages per timing run */
+
+static char text[161];
+static char bin[140];
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *	The MT log lines of mt_split_pdu_deliver() and mt_handle_pdu(),
+ *	the way they used to be: content escaped, then the level checked
+ */
+
+static void old_debug(int i)
+{
+	char buf[IBLEN];
+
+	ascii2escaped(text, 160, buf, IBLEN);
+	hlog_emit(LOG_DEBUG, "[%d] Text %d bytes: \"%s\"", i, 160, buf);
+}
+
+static void new_debug(int i)
+{
+	char buf[IBLEN];
+
+	if (hlog_on(LOG_DEBUG)) {
+		ascii2escaped(text, 160, buf, IBLEN);
+		hlog(LOG_DEBUG, "[%d] Text %d bytes: \"%s\"", i, 160, buf);
+	}
+}
+
+static void old_notice(int i)
+{
+	char buf[IBLEN];
+
+	ascii2escaped(text, 160, buf, IBLEN);
+	hlog_emit(LOG_NOTICE, "[%d] MESSAGE MT RESULT:OK from %s type text length %d content \"%s\"",
+		i, "+358401234567", 160, buf);
+	bin2hexstring(bin, sizeof(bin), buf);
+	hlog_emit(LOG_NOTICE, "[%d] MESSAGE MT RESULT:OK from %s type binary length %d content %s",
+		i, "+358401234567", (int)sizeof(bin), buf);
+}
+
+static void new_notice(int i)
+{
+	char buf[IBLEN];
+
+	if (hlog_on(LOG_NOTICE)) {
+		ascii2escaped(text, 160, buf, IBLEN);
+		hlog(LOG_NOTICE, "[%d] MESSAGE MT RESULT:OK from %s type text length %d content \"%s\"",
+			i, "+358401234567", 160, buf);
+		bin2hexstring(bin, sizeof(bin), buf);
+		hlog(LOG_NOTICE, "[%d] MESSAGE MT RESULT:OK from %s type binary length %d content %s",
+			i, "+358401234567", (int)sizeof(bin), buf);
+	}
+}
+
+static double run(const char *name, void (*lines)(int), int level, int rounds)
+{
+	double start, elapsed;
+	int i;
+
+	log_level = level;
+	start = now_sec();
+	for (i = 0; i < rounds; i++) {
+		text[i % 160] = 'a' + i % 26;
+		lines(i);
+	}
+	elapsed = now_sec() - start;
+
+	printf("%-6s level %-7s %7d messages %8.3f s %8.1f ns/message\n",
+		name, log_levelnames[level], rounds, elapsed, elapsed * 1e9 / rounds);
+
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = DEF_ROUNDS;
+	double old_t, new_t;
+	int i;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	for (i = 0; i < 160; i++)
+		text[i] = (i % 40 == 39) ? '\n' : ' ' + i % 95;
+	for (i = 0; i < (int)sizeof(bin); i++)
+		bin[i] = i * 7;
+
+	/* the lines which are written out go nowhere */
+	if (!freopen("/dev/null", "w", stderr))
+		return 1;
+	log_dest = L_STDERR;
+	open_log("log_bench");
+
+	old_t = run("old", old_debug, LOG_INFO, rounds);
+	new_t = run("gated", new_debug, LOG_INFO, rounds);
+	printf("debug line, DEBUG filtered: %.0fx\n", old_t / new_t);
+
+	old_t = run("old", old_notice, LOG_WARNING, rounds);
+	new_t = run("gated", new_notice, LOG_WARNING, rounds);
+	printf("content lines, NOTICE filtered: %.0fx\n", old_t / new_t);
+
+	/* written out, the same work is done either way */
+	rounds /= 10;
+	old_t = run("old", old_notice, LOG_NOTICE, rounds);
+	new_t = run("gated", new_notice, LOG_NOTICE, rounds);
+	printf("content lines, written out: %.1fx\n", old_t / new_t);
+
+	return 0;
+}
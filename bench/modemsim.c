@@ -0,0 +1,385 @@
+
+/*
+ *	modemsim.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	A GSM module simulator for benchmarking m20d without a module.
+ *	It answers the AT commands m20d uses, on a TCP port (give m20d
+ *	-d 127.0.0.1:<port>) or on a pseudo-terminal (-d <pty>), with an
+ *	emulated line speed and response latency. MO messages are taken
+ *	with AT+CMGS, MT messages are given as +CMT URCs one at a time,
+ *	each after the previous one has been acknowledged with AT+CNMA,
+ *	and a SIM full of stored messages can be given to AT+CMGL.
+ *
+ *	Events are printed on stdout, one per line, with CLOCK_MONOTONIC
+ *	milliseconds:
+ *
+ *		LISTEN <port>		TCP port listened on
+ *		PTY <path>		pseudo-terminal to give to m20d
+ *		UP <ms>			m20d polled the module the first time
+ *		MO <ms> <dst>		MO message received
+ *		MT <ms> <n>		MT message n given
+ *		ACK <ms> <n>		MT message n acknowledged
+ *		DEL <ms> <args>		AT+CMGD
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* for posix_openpt() and cfmakeraw() */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <errno.h>
+
+/* an SMS-DELIVER from +358401234567, 7-bit text "bench" */
+#define MT_PDU		"00040C9153481032547600006210213100000005E2B27B8C06"
+
+#define OUT_MAX		64	/* responses waiting to be written */
+#define LINE_MAX	1024
+
+struct out {
+	char *data;
+	int len;
+	double due;		/* ms, when it may be written */
+};
+
+static int baud = 0;		/* line speed to emulate, 0: as fast as possible */
+static int latency = 0;		/* ms, before each response */
+static int net_delay = 0;	/* ms, sending a MO to the network */
+static int mt_count = 0;	/* MT messages to give */
+static int sim_count = 0;	/* messages stored on the SIM */
+
+static struct out outq[OUT_MAX];
+static int outq_len = 0;
+static double line_free = 0;	/* ms, when the emulated line is idle again */
+
+static int fd = -1;		/* connection to m20d */
+static int up = 0;		/* m20d has polled once */
+static int mt_sent = 0;		/* MT messages given */
+static int mt_waiting = 0;	/* a MT is waiting for AT+CNMA */
+static int mo_count = 0;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ *	Queue a response, to go out after the latency and when the
+ *	emulated line has sent out what was before it
+ */
+
+static void respond(int delay, const char *fmt, ...)
+{
+	va_list args;
+	char buf[8192];
+	struct out *o;
+	double due;
+
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (outq_len == OUT_MAX) {
+		fprintf(stderr, "modemsim: output queue full, dropping a response\n");
+		return;
+	}
+
+	due = now_ms() + delay;
+	if (outq_len && outq[outq_len - 1].due > due)
+		due = outq[outq_len - 1].due;
+
+	o = &outq[outq_len++];
+	o->data = strdup(buf);
+	o->len = strlen(buf);
+	o->due = due;
+}
+
+/*
+ *	Write out the responses which are due, returns ms to the next one
+ *	or -1 if there are none
+ */
+
+static int flush_out(void)
+{
+	double now = now_ms();
+	double start;
+	int i;
+
+	while (outq_len) {
+		start = (outq[0].due > line_free) ? outq[0].due : line_free;
+		if (start > now)
+			return (int)(start - now) + 1;
+
+		if (fd >= 0 && write(fd, outq[0].data, outq[0].len) < 0 && errno != EAGAIN)
+			fprintf(stderr, "modemsim: write: %s\n", strerror(errno));
+		if (baud)
+			line_free = start + outq[0].len * 10000.0 / baud;
+
+		free(outq[0].data);
+		for (i = 1; i < outq_len; i++)
+			outq[i - 1] = outq[i];
+		outq_len--;
+	}
+
+	return -1;
+}
+
+static void give_mt(void)
+{
+	if (!up || mt_waiting || mt_sent >= mt_count)
+		return;
+
+	mt_sent++;
+	mt_waiting = 1;
+	printf("MT %.3f %d\n", now_ms(), mt_sent);
+	respond(0, "\r\n+CMT: ,%d\r\n%s\r\n", (int)strlen(MT_PDU) / 2 - 1, MT_PDU);
+}
+
+/*
+ *	Destination number of a MO PDU as m20d builds them:
+ *	00 <flags> 00 <length> <toa> <digits, swapped> ...
+ */
+
+static void mo_dst(const char *pdu, char *dst, int size)
+{
+	unsigned int len, i;
+	int n = 0;
+
+	if (strlen(pdu) < 10 || sscanf(pdu + 6, "%2x", &len) != 1 || strlen(pdu) < 10 + len + 1) {
+		snprintf(dst, size, "?");
+		return;
+	}
+
+	if (!strncmp(pdu + 8, "91", 2))
+		dst[n++] = '+';
+	for (i = 0; i < len && n < size - 1; i++)
+		dst[n++] = pdu[10 + (i ^ 1)];
+	dst[n] = 0;
+}
+
+static void command(char *cmd)
+{
+	if (!strcmp(cmd, "AT+CPIN?")) {
+		respond(latency, "\r\n+CPIN: READY\r\n\r\nOK\r\n");
+	} else if (!strcmp(cmd, "AT+CREG?")) {
+		respond(latency, "\r\n+CREG: 1,1\r\n\r\nOK\r\n");
+	} else if (!strcmp(cmd, "AT+COPS?")) {
+		respond(latency, "\r\n+COPS: 0,0,\"SIMULATOR\"\r\n\r\nOK\r\n");
+	} else if (!strcmp(cmd, "AT^MONI")) {
+		respond(latency, "\r\nchann rs  dBm  PLMN  LAC cell NCC BCC PWR RXLev  C1 \r\n"
+			"  514 21  -82 24405 00C1 3E21   7   7  33   -105  29\r\n\r\nOK\r\n");
+	} else if (!strncmp(cmd, "AT+CMGL", 7)) {
+		char buf[8192];
+		int i, l = 0;
+
+		buf[0] = 0;
+		for (i = 1; i <= sim_count && l < (int)sizeof(buf) - 200; i++)
+			l += snprintf(buf + l, sizeof(buf) - l, "\r\n+CMGL: %d,1,,%d\r\n%s",
+				i, (int)strlen(MT_PDU) / 2 - 1, MT_PDU);
+		sim_count = 0;
+		respond(latency, "%s\r\n\r\nOK\r\n", buf);
+		if (!up) {
+			up = 1;
+			printf("UP %.3f\n", now_ms());
+			give_mt();
+		}
+	} else if (!strncmp(cmd, "AT+CMGD=", 8)) {
+		printf("DEL %.3f %s\n", now_ms(), cmd + 8);
+		respond(latency, "\r\nOK\r\n");
+	} else if (!strncmp(cmd, "AT+CNMA", 7)) {
+		respond(latency, "\r\nOK\r\n");
+		if (mt_waiting && !cmd[7]) {
+			printf("ACK %.3f %d\n", now_ms(), mt_sent);
+			mt_waiting = 0;
+			give_mt();
+		}
+	} else if (!strncmp(cmd, "AT+CMGS=", 8)) {
+		respond(latency, "\r\n> ");
+		return;
+	} else {
+		respond(latency, "\r\nOK\r\n");
+	}
+}
+
+/*
+ *	Input from m20d: command lines, and the PDU after the prompt
+ *	up to a ^Z
+ */
+
+static void input(char *buf, int len)
+{
+	static char line[LINE_MAX];
+	static int line_len = 0;
+	static int data = 0;
+	char dst[32];
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (data && (buf[i] == 0x1a || buf[i] == 0x1b)) {
+			line[line_len] = 0;
+			line_len = 0;
+			data = 0;
+			if (buf[i] == 0x1b) {
+				respond(latency, "\r\nOK\r\n");
+				continue;
+			}
+			mo_dst(line, dst, sizeof(dst));
+			mo_count++;
+			printf("MO %.3f %s\n", now_ms(), dst);
+			respond(latency + net_delay, "\r\n+CMGS: %d\r\n\r\nOK\r\n", mo_count % 256);
+			continue;
+		}
+		if (!data && (buf[i] == '\r' || buf[i] == '\n')) {
+			line[line_len] = 0;
+			if (line_len)
+				command(line);
+			data = (!strncmp(line, "AT+CMGS=", 8));
+			line_len = 0;
+			continue;
+		}
+		if (buf[i] == '\r' || buf[i] == '\n')
+			continue;
+		if (line_len < LINE_MAX - 1)
+			line[line_len++] = buf[i];
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: modemsim [-t <tcp port, 0: any>] [-P (pty)] [-b <baud>] [-l <latency, ms>]\n"
+		"\t[-x <MO network delay, ms>] [-m <MT messages>] [-s <messages on SIM>]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in sin;
+	socklen_t sl = sizeof(sin);
+	struct pollfd pfd[2];
+	struct termios tio;
+	char buf[4096];
+	int tcp_port = 0, pty = 0;
+	int lfd = -1;
+	int s, n, timeout;
+	int one = 1;
+
+	while ((s = getopt(argc, argv, "t:Pb:l:x:m:s:h?")) != -1) {
+		switch (s) {
+		case 't': tcp_port = atoi(optarg); break;
+		case 'P': pty = 1; break;
+		case 'b': baud = atoi(optarg); break;
+		case 'l': latency = atoi(optarg); break;
+		case 'x': net_delay = atoi(optarg); break;
+		case 'm': mt_count = atoi(optarg); break;
+		case 's': sim_count = atoi(optarg); break;
+		default: usage();
+		}
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pty) {
+		if ((fd = posix_openpt(O_RDWR|O_NOCTTY)) < 0 || grantpt(fd) || unlockpt(fd)) {
+			perror("modemsim: pty");
+			return 1;
+		}
+		/* raw, and no echo of what m20d writes */
+		tcgetattr(fd, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+		printf("PTY %s\n", ptsname(fd));
+	} else {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(tcp_port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		s = 1;
+		if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+		    || setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &s, sizeof(s))
+		    || bind(lfd, (struct sockaddr *)&sin, sizeof(sin))
+		    || listen(lfd, 1)
+		    || getsockname(lfd, (struct sockaddr *)&sin, &sl)) {
+			perror("modemsim: tcp");
+			return 1;
+		}
+		printf("LISTEN %d\n", ntohs(sin.sin_port));
+	}
+
+	for (;;) {
+		timeout = flush_out();
+
+		n = 0;
+		if (fd >= 0) {
+			pfd[n].fd = fd;
+			pfd[n++].events = POLLIN;
+		} else {
+			pfd[n].fd = lfd;
+			pfd[n++].events = POLLIN;
+		}
+
+		if (poll(pfd, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("modemsim: poll");
+			return 1;
+		}
+
+		if (!(pfd[0].revents & (POLLIN|POLLHUP|POLLERR)))
+			continue;
+
+		if (fd < 0) {
+			/* a serial line does not hold bytes back */
+			if ((fd = accept(lfd, NULL, NULL)) >= 0)
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			continue;
+		}
+
+		n = read(fd, buf, sizeof(buf));
+		if (n > 0) {
+			input(buf, n);
+		} else if (pty) {
+			/* nobody has the other end open yet */
+			usleep(10000);
+		} else {
+			close(fd);
+			fd = -1;
+			mt_waiting = 0;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,378 @@
+
+/*
+ *	pdu_bench.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	The CPU a message costs in the PDU codec: mt_parse_pdu() and
+ *	mt_split_pdu_deliver() over received PDUs with 7-bit, 8-bit and
+ *	UCS2 content, an alphanumeric sender and user data headers,
+ *	mo_create_pdu() over messages to be sent, and the hex and character
+ *	set conversions under them. Reports ns and bytes per second for
+ *	each, and can save the results as a baseline, or compare them
+ *	against one and fail if something got slower:
+ *
+ *		bench/pdu_bench -s base.txt	(before a change)
+ *		bench/pdu_bench -c base.txt	(after it)
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "log.h"
+#include "message.h"
+#include "device.h"
+#include "hmalloc.h"
+
+/* in m20d.c, which is linked in with its main() renamed */
+extern int mt_parse_pdu(struct message *m, char *pdu);
+extern int mt_split_pdu_deliver(struct message *m, char *pdu);
+extern int mo_create_pdu(struct message *m, char *pdu);
+extern void mo_segment(struct message *m);
+
+#define MAX_CASES	64
+
+/*
+ *	Received PDUs, as the module gives them in +CMT
+ */
+
+static struct mt_pdu {
+	char *name;
+	char *pdu;
+} mt_corpus[] = {
+	{ "7bit",		/* 160 characters */
+	"00040C91534810325476000062102131000000A054741914AFA7C76B9058FEBEBB41E6371EA4AEB7E173D0DB5E9683E8E832881DD6E741E4F7990582C564335ACD76C3E55C202ABA0C8AD7D3E335482C7FDFDD20F31B0F52D7DBF039E86D2FCB41747419C40EEBF320F2FBCC02C162B219AD66BBE1722E10155D06C5EBE9F11A2496BFEF6E90F98D07A9EB6DF81CF4B697E5203ABA0C6287F57910F97D668160" },
+	{ "7bit_smsc",		/* 60 characters, SMSC address given */
+	"0791534850020200040C915348103254760000621021310000003C54741914AFA7C76B9058FEBEBB41E6371EA4AEB7E173D0DB5E9683E8E832881DD6E741E4F7990582C564335ACD76C3E55C202ABA0C" },
+	{ "8bit",		/* 140 bytes */
+	"00040C915348103254760004621021310000008C000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F808182838485868788898A8B" },
+	{ "ucs2",		/* 48 UCS2 characters */
+	"00040C915348103254760008621021310000006000480079007600E400E40020007000E40069007600E400E4002C002000FC006E00EF006300F6006400E900202713002000480079007600E400E40020007000E40069007600E400E4002C002000FC006E00EF006300F6006400E9002027130020" },
+	{ "alnum",		/* 100 characters from "Operator" */
+	"00040ED04F78591EA6BFE50000621021310000006454741914AFA7C76B9058FEBEBB41E6371EA4AEB7E173D0DB5E9683E8E832881DD6E741E4F7990582C564335ACD76C3E55C202ABA0C8AD7D3E335482C7FDFDD20F31B0F52D7DBF039E86D2FCB41747419C40EEBF320F2FB0C" },
+	{ "udh7",		/* part 2 of 3, 153 characters */
+	"00440C91534810325476000062102131000000A0050003070302A8E832285E4F8FD720B1FC7D7783CC6F3C485D6FC3E7A0B7BD2C07D1D165103BACCF83C8EF330B048BC966B49AED86CBB94054741914AFA7C76B9058FEBEBB41E6371EA4AEB7E173D0DB5E9683E8E832881DD6E741E4F7990582C564335ACD76C3E55C202ABA0C8AD7D3E335482C7FDFDD20F31B0F52D7DBF039E86D2FCB41747419C40EEBF3" },
+	{ "udh8",		/* WAP port and 16-bit concatenation, 127 bytes */
+	"00440C915348103254760004621021310000008C0C05040B8423F0080412340201000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E" },
+	{ NULL, NULL }
+};
+
+/* where mt_split_pdu_deliver() starts, after the SMSC and the PDU type */
+struct deliver {
+	char *pdu;
+	int has_udh;
+};
+
+static char *text = "The quick brown fox jumps over the lazy dog, 0123456789. ";
+
+static char ascii[IBLEN];	/* results go here */
+static char hex[IBLEN];
+static char bin[IBLEN];
+static char septets[160];	/* 160 septets packed in 140 bytes */
+static char escapable[160];
+
+static int min_ms = 200;	/* time each case at least this long */
+
+static struct result {
+	char name[48];
+	double ns;
+} results[MAX_CASES], baseline[MAX_CASES];
+static int nresults, nbaseline;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *	The operations, each on one message
+ */
+
+static void op_parse(void *arg)
+{
+	struct message *m = alloc_message();
+
+	mt_parse_pdu(m, arg);
+	free_message(m);
+}
+
+static void op_split(void *arg)
+{
+	struct deliver *d = arg;
+	struct message *m = alloc_message();
+
+	m->has_udh = d->has_udh;
+	mt_split_pdu_deliver(m, d->pdu);
+	free_message(m);
+}
+
+static void op_create(void *arg)
+{
+	struct message *m = arg;
+	char pdu[IBLEN];
+
+	for (m->parts_sent = 0; m->parts_sent < m->parts; m->parts_sent++)
+		mo_create_pdu(m, pdu);
+}
+
+static void op_bin2hex(void *arg)
+{
+	bin2hexstring(septets, sizeof(septets), hex);
+}
+
+static void op_hex2bin(void *arg)
+{
+	hexstring2bin(arg, strlen(arg) / 2, bin, sizeof(bin));
+}
+
+static void op_octet2bin(void *arg)
+{
+	char *p = arg;
+	int i, l = strlen(p) / 2;
+
+	for (i = 0; i < l; i++)
+		bin[i] = octet2bin(p + (i << 1));
+}
+
+static void op_bin2ascii(void *arg)
+{
+	binary2ascii(septets, 160, ascii, sizeof(ascii), 0, 0);
+}
+
+static void op_escape(void *arg)
+{
+	ascii2escaped(escapable, sizeof(escapable), ascii, sizeof(ascii));
+}
+
+/*
+ *	Time an operation: find a round count which takes long enough, and
+ *	keep the best of three runs of it
+ */
+
+static void run(char *name, char *variant, void (*op)(void *), void *arg, int bytes)
+{
+	struct result *r = &results[nresults];
+	double start, elapsed, best = 0, base = 0;
+	long rounds, i;
+	int n;
+
+	for (rounds = 64; ; rounds *= 2) {
+		start = now_sec();
+		for (i = 0; i < rounds; i++)
+			op(arg);
+		if ((elapsed = now_sec() - start) * 1000 >= min_ms / 4)
+			break;
+	}
+	for (n = 0; n < 3; n++) {
+		start = now_sec();
+		for (i = 0; i < rounds; i++)
+			op(arg);
+		elapsed = now_sec() - start;
+		if (!n || elapsed < best)
+			best = elapsed;
+	}
+
+	snprintf(r->name, sizeof(r->name), "%s/%s", name, variant);
+	r->ns = best * 1e9 / rounds;
+	if (nresults < MAX_CASES - 1)
+		nresults++;
+
+	for (n = 0; n < nbaseline; n++)
+		if (!strcmp(baseline[n].name, r->name))
+			base = baseline[n].ns;
+
+	printf("%-32s %9.1f ns/op %9.1f MB/s", r->name, r->ns, bytes / r->ns * 1e3);
+	if (base > 0)
+		printf(" %+7.1f%%", (r->ns - base) * 100 / base);
+	printf("\n");
+}
+
+/*
+ *	Baseline file: a line of name and ns/op for each case
+ */
+
+static int load_baseline(char *fn)
+{
+	FILE *f;
+
+	if (!(f = fopen(fn, "r"))) {
+		perror(fn);
+		return -1;
+	}
+	while (nbaseline < MAX_CASES
+	    && fscanf(f, "%47s %lf", baseline[nbaseline].name, &baseline[nbaseline].ns) == 2)
+		nbaseline++;
+	fclose(f);
+
+	return 0;
+}
+
+static int save_baseline(char *fn)
+{
+	FILE *f;
+	int i;
+
+	if (!(f = fopen(fn, "w"))) {
+		perror(fn);
+		return -1;
+	}
+	for (i = 0; i < nresults; i++)
+		fprintf(f, "%s %.2f\n", results[i].name, results[i].ns);
+	if (fclose(f)) {
+		perror(fn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Count the cases which got slower than the baseline by more than
+ *	threshold percent
+ */
+
+static int regressions(int threshold)
+{
+	int i, n, bad = 0;
+
+	for (i = 0; i < nresults; i++)
+		for (n = 0; n < nbaseline; n++)
+			if (!strcmp(baseline[n].name, results[i].name)
+			    && results[i].ns > baseline[n].ns * (100 + threshold) / 100) {
+				printf("REGRESSION %s: %.1f ns/op, was %.1f\n",
+					results[i].name, results[i].ns, baseline[n].ns);
+				bad++;
+			}
+
+	return bad;
+}
+
+static struct message *mo_message(char *content, int len, int is_binary, int dcs)
+{
+	struct message *m = alloc_message();
+
+	m->msgid = hstrdup("bench");
+	m->dst = hstrdup("+358401234567");
+	m->content = hmalloc(len);
+	memcpy(m->content, content, len);
+	m->len = len;
+	m->is_binary = is_binary;
+	m->dcs = dcs;
+	mo_segment(m);
+
+	return m;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pdu_bench [-s <save baseline to file>] [-c <compare to baseline file>]\n"
+		"\t[-t <regression threshold, percent>] [-m <time per case, ms>]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct deliver deliver[sizeof(mt_corpus) / sizeof(mt_corpus[0])];
+	struct message *mo[4];
+	char *save = NULL, *compare = NULL;
+	int threshold = 10;
+	char *p;
+	int i, s, l;
+
+	while ((s = getopt(argc, argv, "s:c:t:m:h?")) != -1) {
+		switch (s) {
+		case 's': save = optarg; break;
+		case 'c': compare = optarg; break;
+		case 't': threshold = atoi(optarg); break;
+		case 'm': min_ms = atoi(optarg); break;
+		default: usage();
+		}
+	}
+
+	if (compare && load_baseline(compare))
+		return 1;
+
+	/* errors only, a message which does not parse shows up */
+	log_dest = L_STDERR;
+	log_level = LOG_ERR;
+	open_log("pdu_bench");
+
+	for (i = 0; i < 160; i++) {
+		ascii[i] = text[i % strlen(text)];
+		escapable[i] = (i % 40 == 39) ? '\n' : (i % 20 == 7) ? '\t' : ascii[i];
+	}
+	/* the user data of the 160-character PDU */
+	p = mt_corpus[0].pdu;
+	hexstring2bin(p + strlen(p) - 280, 140, septets, sizeof(septets));
+
+	printf("MT, bytes of PDU:\n");
+	for (i = 0; mt_corpus[i].name; i++)
+		run("mt_parse_pdu", mt_corpus[i].name, op_parse, mt_corpus[i].pdu, strlen(mt_corpus[i].pdu) / 2);
+
+	for (i = 0; mt_corpus[i].name; i++) {
+		p = mt_corpus[i].pdu;
+		p += octet2bin(p) * 2 + 2;
+		deliver[i].has_udh = (octet2bin(p) >> 6) & 1;
+		deliver[i].pdu = p + 2;
+		run("mt_split_pdu_deliver", mt_corpus[i].name, op_split, &deliver[i], strlen(deliver[i].pdu) / 2);
+	}
+
+	printf("MO, bytes of content:\n");
+	for (i = 0; i < 400; i++)
+		bin[i] = (char)i;
+	mo[0] = mo_message(ascii, 160, 0, 0);
+	memcpy(hex, ascii, 160);
+	hex[40] = '[';		/* extended characters, two septets each */
+	hex[80] = '{';
+	mo[1] = mo_message(hex, 160, 0, 0);
+	for (l = 0; l < 400; l++)
+		hex[l] = text[l % strlen(text)];
+	mo[2] = mo_message(hex, 400, 0, 0);
+	mo[3] = mo_message(bin, 140, 1, 4);
+	run("mo_create_pdu", "7bit", op_create, mo[0], mo[0]->len);
+	run("mo_create_pdu", "7bit_ext", op_create, mo[1], mo[1]->len);
+	run("mo_create_pdu", "7bit_concat", op_create, mo[2], mo[2]->len);
+	run("mo_create_pdu", "8bit", op_create, mo[3], mo[3]->len);
+	for (i = 0; i < 4; i++)
+		free_message(mo[i]);
+
+	printf("Conversions, bytes of binary or text:\n");
+	bin2hexstring(septets, sizeof(septets), hex);
+	run("bin2hexstring", "140", op_bin2hex, NULL, sizeof(septets));
+	run("hexstring2bin", "140", op_hex2bin, hex, sizeof(septets));
+	run("octet2bin", "140", op_octet2bin, hex, sizeof(septets));
+	run("binary2ascii", "160", op_bin2ascii, NULL, 160);
+	run("ascii2escaped", "160", op_escape, NULL, sizeof(escapable));
+
+	if (save && save_baseline(save))
+		return 1;
+
+	if (compare && regressions(threshold)) {
+		printf("slower than %s by more than %d%%\n", compare, threshold);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,222 @@
+
+/*
+ *	septet_bench.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	GSM 7-bit septet packing: checks the word-at-a-time packer against
+ *	the bit-at-a-time loops m20d used before, over a corpus of septet
+ *	strings of every length a message can have, and then measures both.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "septet.h"
+
+#define MAX_SEPTETS	200	/* a bit over a message, to cover the tails */
+#define DEF_ROUNDS	200000	/* messages per timing run */
+
+/*
+ *	The packing loop of the old mo_encode_ascii()
+ */
+
+static int old_pack(const unsigned char *septets, int n, unsigned char *tmp)
+{
+	int pdubitposition;
+	int pdubyteposition = -1;
+	int character;
+	int bit;
+	int pdubitnr;
+
+	memset(tmp, 0, SEPTET_OCTETS(n) + 1);
+
+	for (character = 0; character < n; character++) {
+		for (bit = 0; bit < 7; bit++) {
+			pdubitnr = 7 * character + bit;
+			pdubyteposition = pdubitnr / 8;
+			pdubitposition = pdubitnr % 8;
+			if (septets[character] & (1 << bit))
+				tmp[pdubyteposition] = tmp[pdubyteposition] | (1 << pdubitposition);
+			else
+				tmp[pdubyteposition] = tmp[pdubyteposition] & ~(1 << pdubitposition);
+		}
+	}
+
+	return pdubyteposition + 1;
+}
+
+/*
+ *	The unpacking loop of the old binary2ascii()
+ */
+
+static int old_unpack(const unsigned char *bin, int n, unsigned char *septets)
+{
+	int l;
+	unsigned char c;
+	int bit, bitpos = 0;
+	int bytepos, byteofs;
+
+	for (l = 0; l < n; l++) {
+		c = 0;
+		for (bit = 0; bit < 7; bit++) {
+			bytepos = bitpos / 8;
+			byteofs = bitpos % 8;
+			if (bin[bytepos] & (1 << byteofs))
+				c = c | 128;
+			bitpos++;
+			c = (c >> 1) & 127;
+		}
+		septets[l] = c;
+	}
+
+	return l;
+}
+
+/*
+ *	Fill a corpus entry: a few fixed patterns, then random text
+ */
+
+static void fill(unsigned char *s, int n, int pattern)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		switch (pattern) {
+		case 0: s[i] = 0; break;
+		case 1: s[i] = 0x7f; break;
+		case 2: s[i] = (i & 1) ? 0x55 : 0x2a; break;
+		case 3: s[i] = 0x1b; break;			/* escapes */
+		case 4: s[i] = 0x80 | (rand() & 0x7f); break;	/* high bit set, ignored */
+		default: s[i] = rand() & 0x7f;
+		}
+	}
+}
+
+/*
+ *	Check the new functions against the old ones, and the round trip
+ */
+
+static int verify(void)
+{
+	unsigned char s[MAX_SEPTETS], back[MAX_SEPTETS + 8];
+	unsigned char oldp[MAX_SEPTETS], newp[MAX_SEPTETS];
+	unsigned char oldu[MAX_SEPTETS];
+	int n, pattern, ol, nl, i;
+	int cases = 0;
+
+	for (pattern = 0; pattern < 10; pattern++) {
+		for (n = 0; n <= MAX_SEPTETS; n++) {
+			fill(s, n, pattern);
+			ol = old_pack(s, n, oldp);
+			nl = septet_pack(s, n, newp);
+			if (ol != nl || memcmp(oldp, newp, nl)) {
+				fprintf(stderr, "pack mismatch: pattern %d length %d\n", pattern, n);
+				return -1;
+			}
+
+			old_unpack(newp, n, oldu);
+			memset(back, 0xee, sizeof(back));
+			septet_unpack(newp, n, back);
+			if (memcmp(oldu, back, n)) {
+				fprintf(stderr, "unpack mismatch: pattern %d length %d\n", pattern, n);
+				return -1;
+			}
+			if (back[n] != 0xee) {
+				fprintf(stderr, "unpack overrun: pattern %d length %d\n", pattern, n);
+				return -1;
+			}
+			for (i = 0; i < n; i++) {
+				if (back[i] != (s[i] & 0x7f)) {
+					fprintf(stderr, "round trip mismatch: pattern %d length %d at %d\n", pattern, n, i);
+					return -1;
+				}
+			}
+			cases++;
+		}
+	}
+
+	printf("septet: %d corpus strings of 0 to %d septets packed, unpacked and compared: OK\n", cases, MAX_SEPTETS);
+
+	return 0;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *	Time packing and unpacking of full 160-septet messages
+ */
+
+static double run(const char *name, int (*pack)(const unsigned char *, int, unsigned char *),
+	int (*unpack)(const unsigned char *, int, unsigned char *), int rounds)
+{
+	unsigned char s[160], p[160], u[168];
+	double start, elapsed;
+	unsigned sum = 0;
+	int i;
+
+	fill(s, 160, 9);
+
+	start = now_sec();
+	for (i = 0; i < rounds; i++) {
+		s[i % 160] = i & 0x7f;
+		pack(s, 160, p);
+		unpack(p, 160, u);
+		sum += u[i % 160];
+	}
+	elapsed = now_sec() - start;
+
+	printf("%-12s %7d messages %8.3f s %8.1f ns/message (pack + unpack) [%u]\n",
+		name, rounds, elapsed, elapsed * 1e9 / rounds, sum & 1);
+
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = DEF_ROUNDS;
+	double old_t, new_t;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	srand(1);
+	if (verify())
+		return 1;
+
+#ifdef __BMI2__
+	printf("septet: word-at-a-time with BMI2 pext/pdep\n");
+#else
+	printf("septet: word-at-a-time with shifts and masks\n");
+#endif
+	old_t = run("bit-loop", old_pack, old_unpack, rounds);
+	new_t = run("word", septet_pack, septet_unpack, rounds);
+	printf("speedup: %.1fx\n", old_t / new_t);
+
+	return 0;
+}
+
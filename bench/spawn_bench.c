@@ -0,0 +1,139 @@
+
+/*
+ *	spawn_bench.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Handler launch latency: the fork(), close loop and execl() m20d
+ *	used to run the handler with, against posix_spawn(), with the
+ *	benchmark process grown to a few resident set sizes, since the
+ *	cost of fork() goes up with the memory which has to be copied.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+
+#define DEF_ROUNDS	200		/* launches per timing run */
+#define PROG		"/bin/true"
+
+extern char **environ;
+
+static int rss_mb[] = { 0, 64, 256, 1024 };
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *	The launch path of the old fork_handler()
+ */
+
+static pid_t launch_fork(void)
+{
+	pid_t p;
+	int i;
+
+	if ((p = fork()) == 0) {
+		for (i = 3; i < 128; i++)
+			close(i);
+		close(0);
+		execl(PROG, PROG, NULL);
+		_exit(1);
+	}
+
+	return p;
+}
+
+static pid_t launch_spawn(void)
+{
+	char *argv[] = { PROG, NULL };
+	pid_t p;
+
+	if (posix_spawn(&p, PROG, NULL, NULL, argv, environ))
+		return -1;
+
+	return p;
+}
+
+/*
+ *	Time launching the program and waiting for it
+ */
+
+static double run(const char *name, pid_t (*launch)(void), int mb, int rounds)
+{
+	double start, elapsed;
+	pid_t p;
+	int i, status;
+
+	start = now_sec();
+	for (i = 0; i < rounds; i++) {
+		if ((p = launch()) < 0) {
+			perror(name);
+			exit(1);
+		}
+		waitpid(p, &status, 0);
+	}
+	elapsed = now_sec() - start;
+
+	printf("%-12s rss %5d MB %5d launches %8.3f s %8.1f us/launch\n",
+		name, mb, rounds, elapsed, elapsed * 1e6 / rounds);
+
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = DEF_ROUNDS;
+	char *mem = NULL;
+	size_t size;
+	double old_t, new_t;
+	unsigned i;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	for (i = 0; i < sizeof(rss_mb) / sizeof(rss_mb[0]); i++) {
+		/* grow the process and touch every page so that it is resident */
+		size = (size_t)rss_mb[i] << 20;
+		if (size && !(mem = realloc(mem, size))) {
+			printf("spawn: could not allocate %d MB, stopping here\n", rss_mb[i]);
+			break;
+		}
+		if (size)
+			memset(mem, i + 1, size);
+
+		old_t = run("fork+exec", launch_fork, rss_mb[i], rounds);
+		new_t = run("posix_spawn", launch_spawn, rss_mb[i], rounds);
+		printf("speedup at %d MB: %.1fx\n", rss_mb[i], old_t / new_t);
+	}
+
+	free(mem);
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+
+/*
+ *	statemap_check.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	A reader of the state map (statemap.h), as a monitoring tool would
+ *	be: maps <state file>.map read-only and takes copies of it with
+ *	statemap_read() while the daemon updates it, until the daemon
+ *	exits or the time is up. Every copy is checked: the magic and the
+ *	version, an even sequence number which never goes back, counters
+ *	and times which never go back, terminated strings, the pid of the
+ *	daemon, and the same name for a state number every time. A torn
+ *	copy would show up as one of these. bench/e2e_bench -c runs it
+ *	alongside a live daemon.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+#include "statemap.h"
+
+#define MAX_STATES	64	/* state numbers tracked for their names */
+#define MAX_ERRORS	10	/* errors printed, the rest are counted */
+
+static long errors = 0;
+
+static void fail(long n, const char *what)
+{
+	if (++errors <= MAX_ERRORS)
+		printf("statemap: copy %ld: %s\n", n, what);
+}
+
+static int terminated(const char *s, size_t size)
+{
+	return memchr(s, 0, size) != NULL;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	struct statemap *m, c, last;
+	char names[MAX_STATES][sizeof(c.state_name)];
+	double deadline, t0;
+	long reads = 0, busy = 0, seqs = 0;
+	int limit = 60;
+	int fd, s, first = 1;
+
+	while ((s = getopt(argc, argv, "t:h?")) != -1) {
+		switch (s) {
+		case 't': limit = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: statemap_check [-t <seconds>] <state file>.map\n");
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: statemap_check [-t <seconds>] <state file>.map\n");
+		return 1;
+	}
+
+	if ((fd = open(argv[optind], O_RDONLY)) < 0) {
+		fprintf(stderr, "statemap_check: %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		fprintf(stderr, "statemap_check: mmap %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	memset(names, 0, sizeof(names));
+	memset(&last, 0, sizeof(last));
+	t0 = now_s();
+	deadline = t0 + limit;
+
+	while (now_s() < deadline) {
+		if (statemap_read(m, &c)) {
+			busy++;
+			continue;
+		}
+		reads++;
+
+		if (c.magic != STATEMAP_MAGIC)
+			fail(reads, "bad magic");
+		if (c.version != STATEMAP_VERSION)
+			fail(reads, "unknown version");
+		if (c.seq & 1)
+			fail(reads, "odd sequence number in a copy");
+		if (!terminated(c.state_name, sizeof(c.state_name)) || !terminated(c.device, sizeof(c.device))
+		    || !terminated(c.message, sizeof(c.message)) || !terminated(c.network, sizeof(c.network)))
+			fail(reads, "unterminated string");
+		if (c.state < 0 || c.state >= MAX_STATES)
+			fail(reads, "state out of range");
+		else if (!names[c.state][0])
+			strcpy(names[c.state], c.state_name);
+		else if (strcmp(names[c.state], c.state_name))
+			fail(reads, "state name does not match the state number");
+
+		if (!first) {
+			if (c.pid != last.pid)
+				fail(reads, "daemon pid changed");
+			if (c.seq < last.seq)
+				fail(reads, "sequence number went back");
+			if (c.changes < last.changes || c.updated < last.updated
+			    || c.mt < last.mt || c.mo_ok < last.mo_ok || c.mo_try_fail < last.mo_try_fail)
+				fail(reads, "a counter or the update time went back");
+			if (c.seq != last.seq)
+				seqs++;
+		}
+		first = 0;
+		last = c;
+
+		/* until the daemon is gone */
+		if ((reads & 1023) == 0 && kill(c.pid, 0) && errno == ESRCH)
+			break;
+		usleep(20);
+	}
+
+	printf("statemap: %ld copies in %.1f s, %ld updates seen, %ld retried, %ld errors, last state %s\n",
+		reads, now_s() - t0, seqs, busy, errors, (reads) ? last.state_name : "-");
+
+	munmap(m, sizeof(*m));
+
+	return (errors || !reads) ? 1 : 0;
+}
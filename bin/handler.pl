@@ -5,29 +5,61 @@ $plugins = "/opt/m20d/plugins";
 
 use Fcntl;
 
-my($msgid, $src, $tmpf) = @ARGV;
+# With -w this runs as a persistent worker of m20d: messages come in
+# on stdin as lines of "msgid<tab>src<tab>spoolfile", with %XX escapes,
+# and each one is answered on the same socket with "msgid<tab>status".
 
-open(F, $tmpf) || die "[$msgid] Could not open spool file $tmpf: $!";
-$len = read(F, $msg, 2000);
-if (!defined($len)) { die "Could not read from spool file $tmpf: $!"; }
-close(F) || die "[$msgid] Could not close spool file $tmpf after reading: $!";
-#if (unlink($tmpf) ne 1) { die "Could not unlink spool file $tmpf: $!"; }
+if (@ARGV && $ARGV[0] eq '-w') {
+	&load_plugins;
+	open(ANSWER, ">&=0") || die "Could not open answer channel: $!";
+	select((select(ANSWER), $| = 1)[0]);
+	
+	while (defined($line = <STDIN>)) {
+		chomp($line);
+		my($msgid, $src, $tmpf) = map { s/%([0-9A-Fa-f]{2})/chr(hex($1))/eg; $_ } split(/\t/, $line, 3);
+		$status = 0;
+		eval { &handle_message($msgid, $src, $tmpf); };
+		if ($@) {
+			warn $@;
+			$status = 1;
+		}
+		print ANSWER "$msgid\t$status\n";
+	}
+	exit(0);
+}
 
-opendir(D, $plugins) || die "Could not opendir $plugins: $!";
-@plugfiles = grep { /^([^.].*\.pl)$/ } readdir(D);
-closedir(D) || die "Could not closedir $plugins: $!";
+my($msgid, $src, $tmpf) = @ARGV;
 
-foreach $plug (@plugfiles) {
-	do "$plugins/$plug" || die "Could not do $plug: $!";
-}
+&load_plugins;
+&handle_message($msgid, $src, $tmpf);
 
-($cmd, @args) = split(/\s+/, $msg);
-$cmd = lc($cmd);
+sub load_plugins {
+	opendir(D, $plugins) || die "Could not opendir $plugins: $!";
+	@plugfiles = grep { /^([^.].*\.pl)$/ } readdir(D);
+	closedir(D) || die "Could not closedir $plugins: $!";
+	
+	foreach $plug (@plugfiles) {
+		do "$plugins/$plug" || die "Could not do $plug: $!";
+	}
+}
 
-if (!defined($commands{$cmd})) {
-	# Don't respond by default! spoolsms($src, "Keep your tunkki.");
-} else {
-	&{ $commands{$cmd} } ($src, @args);
+sub handle_message {
+	my($msgid, $src, $tmpf) = @_;
+	
+	open(F, $tmpf) || die "[$msgid] Could not open spool file $tmpf: $!";
+	$len = read(F, $msg, 2000);
+	if (!defined($len)) { die "Could not read from spool file $tmpf: $!"; }
+	close(F) || die "[$msgid] Could not close spool file $tmpf after reading: $!";
+	#if (unlink($tmpf) ne 1) { die "Could not unlink spool file $tmpf: $!"; }
+	
+	($cmd, @args) = split(/\s+/, $msg);
+	$cmd = lc($cmd);
+	
+	if (!defined($commands{$cmd})) {
+		# Don't respond by default! spoolsms($src, "Keep your tunkki.");
+	} else {
+		&{ $commands{$cmd} } ($src, @args);
+	}
 }
 
 ########################################################################
@@ -0,0 +1,308 @@
+
+/*
+ *	concat.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Reassembly of concatenated MT messages, within a memory budget
+ *	and a time limit for each message.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "concat.h"
+#include "event.h"
+#include "hmalloc.h"
+#include "log.h"
+
+int concat_timeout = 300;		/* seconds to wait for the rest of the parts */
+long concat_mem_max = 1024 * 1024;	/* bytes of parts to keep at most */
+
+long stats_concat_parts = 0;
+long stats_concat_hits = 0;
+long stats_concat_done = 0;
+long stats_concat_timeouts = 0;
+long stats_concat_evictions = 0;
+long stats_concat_sets = 0;
+long stats_concat_mem = 0;
+
+/*
+ *	The parts of one message received so far
+ */
+
+struct concat_set {
+	char *src;			/* key: sender */
+	int ref;			/* key: reference number */
+	int ref16;			/* key: the reference is 16 bits */
+	int parts;			/* key: number of parts */
+	int got;			/* parts received */
+	int mem;			/* bytes held */
+	time_t expires;			/* delivered incomplete at this time */
+	struct message **part;		/* by sequence number, from 0 */
+	struct concat_set *next;	/* by expiry time, oldest first */
+	struct concat_set **prevp;
+};
+
+static struct concat_set *sets = NULL;
+static struct ev_timer *concat_timer;
+static concat_deliver_cb deliver;
+
+static void concat_expire(struct ev_timer *t, void *arg);
+
+void concat_init(concat_deliver_cb cb)
+{
+	deliver = cb;
+	concat_timer = ev_timer_new(concat_expire, NULL);
+}
+
+/*
+ *	Memory taken by a part
+ */
+
+static int part_mem(struct message *m)
+{
+	return sizeof(*m) + m->len;
+}
+
+/*
+ *	Set the timer to go off when the oldest set expires
+ */
+
+static void concat_schedule(void)
+{
+	if (!sets) {
+		ev_timer_stop(concat_timer);
+		return;
+	}
+
+	ev_timer_set(concat_timer, (sets->expires - time(NULL)) * 1000);
+}
+
+/*
+ *	Put a set in the list by its expiry time, and take it off
+ */
+
+static void set_insert(struct concat_set *cs)
+{
+	struct concat_set **prevp;
+
+	for (prevp = &sets; (*prevp) && (*prevp)->expires <= cs->expires; prevp = &(*prevp)->next)
+		;
+
+	cs->prevp = prevp;
+	if ((cs->next = *prevp))
+		cs->next->prevp = &cs->next;
+	*prevp = cs;
+}
+
+static void set_remove(struct concat_set *cs)
+{
+	*cs->prevp = cs->next;
+	if (cs->next)
+		cs->next->prevp = cs->prevp;
+}
+
+static char *dupstr(char *s)
+{
+	return (s) ? hstrdup(s) : NULL;
+}
+
+/*
+ *	Put the parts of a set together as one message, and free the set
+ */
+
+static struct message *concat_assemble(struct concat_set *cs)
+{
+	struct message *m, *p, *first = NULL;
+	int i, len, skip, files = 0;
+
+	for (i = 0, len = 0; i < cs->parts; i++) {
+		if (!(p = cs->part[i]))
+			continue;
+		if (!first)
+			first = p;
+		len += p->len;
+	}
+
+	m = alloc_message();
+	m->msgid = dupstr(first->msgid);
+	m->received = first->received;
+	memcpy(m->tl, first->tl, sizeof(m->tl));
+	m->smsc = dupstr(first->smsc);
+	m->src = dupstr(first->src);
+	m->date = dupstr(first->date);
+	m->time = dupstr(first->time);
+	m->type = first->type;
+	m->pid = first->pid;
+	m->dcs = first->dcs;
+	m->is_binary = first->is_binary;
+	m->is_flash = first->is_flash;
+	m->has_udh = first->has_udh;
+	m->parts = cs->parts;
+	m->parts_got = cs->got;
+	m->concat_ref = cs->ref;
+	m->concat_ref16 = cs->ref16;
+
+	/* the spool files of the parts go away when the message is in the spool */
+	m->part_files = hmalloc((cs->got + 1) * sizeof(*m->part_files));
+
+	/* a UDH left in the first part is kept, the others are dropped */
+	m->content = hmalloc(len + 1);
+	for (i = 0; i < cs->parts; i++) {
+		if (!(p = cs->part[i]))
+			continue;
+		if (p->spoolfile) {
+			m->part_files[files++] = p->spoolfile;
+			p->spoolfile = NULL;
+		}
+		skip = 0;
+		if (p != first && p->is_binary && p->has_udh && p->len > 0)
+			skip = (unsigned char)p->content[0] + 1;
+		if (skip < p->len) {
+			memcpy(m->content + m->len, p->content + skip, p->len - skip);
+			m->len += p->len - skip;
+		}
+		free_message(p);
+	}
+	m->content[m->len] = 0;
+	m->part_files[files] = NULL;
+
+	set_remove(cs);
+	stats_concat_sets--;
+	stats_concat_mem -= cs->mem;
+
+	hfree(cs->src);
+	hfree(cs->part);
+	hfree(cs);
+
+	return m;
+}
+
+/*
+ *	Deliver a set, complete or not
+ */
+
+static void concat_deliver(struct concat_set *cs, const char *why)
+{
+	struct message *m;
+
+	m = concat_assemble(cs);
+	hlog((m->parts_got == m->parts) ? LOG_INFO : LOG_WARNING,
+		"[%s] MESSAGE MT CONCAT from %s ref %d: %d of %d parts received, %s",
+		m->msgid, m->src, m->concat_ref, m->parts_got, m->parts, why);
+
+	deliver(m);
+}
+
+/*
+ *	Add a part
+ */
+
+void concat_add(struct message *m)
+{
+	struct concat_set *cs;
+	struct message *p;
+	char *src = (m->src) ? m->src : "";
+
+	stats_concat_parts++;
+
+	for (cs = sets; (cs); cs = cs->next)
+		if (cs->ref == m->concat_ref && cs->ref16 == m->concat_ref16
+		    && cs->parts == m->parts && !strcmp(cs->src, src))
+			break;
+
+	if (cs) {
+		stats_concat_hits++;
+	} else {
+		cs = hmalloc(sizeof(*cs));
+		memset(cs, 0, sizeof(*cs));
+		cs->src = hstrdup(src);
+		cs->ref = m->concat_ref;
+		cs->ref16 = m->concat_ref16;
+		cs->parts = m->parts;
+		cs->part = hmalloc(m->parts * sizeof(*cs->part));
+		memset(cs->part, 0, m->parts * sizeof(*cs->part));
+		cs->mem = sizeof(*cs) + m->parts * sizeof(*cs->part);
+		cs->expires = m->received + concat_timeout;
+
+		set_insert(cs);
+		stats_concat_sets++;
+		stats_concat_mem += cs->mem;
+	}
+
+	/* the timeout counts from the first part to arrive, which after a
+	 * restart, reading the parts back, need not be the first one added
+	 */
+	if (m->received + concat_timeout < cs->expires) {
+		set_remove(cs);
+		cs->expires = m->received + concat_timeout;
+		set_insert(cs);
+	}
+
+	if ((p = cs->part[m->part_seq - 1])) {
+		/* the new copy is the one acknowledged, and its spool file
+		 * the one kept
+		 */
+		hlog(LOG_WARNING, "[%s] Part %d of %d from %s ref %d received again, replacing the earlier copy",
+			m->msgid, m->part_seq, m->parts, src, m->concat_ref);
+		if (p->spoolfile && unlink(p->spoolfile) && errno != ENOENT)
+			hlog(LOG_ERR, "[%s] Could not unlink part spool file %s: %s", p->msgid, p->spoolfile, strerror(errno));
+		cs->mem -= part_mem(p);
+		stats_concat_mem -= part_mem(p);
+		free_message(p);
+	} else {
+		cs->got++;
+	}
+
+	cs->part[m->part_seq - 1] = m;
+	cs->mem += part_mem(m);
+	stats_concat_mem += part_mem(m);
+
+	if (cs->got == cs->parts) {
+		stats_concat_done++;
+		concat_deliver(cs, "complete");
+	}
+
+	/* stay within the budget, giving up on the oldest ones first */
+	while (sets && stats_concat_mem > concat_mem_max) {
+		stats_concat_evictions++;
+		concat_deliver(sets, "out of reassembly memory");
+	}
+
+	concat_schedule();
+}
+
+/*
+ *	Deliver the sets which have waited for too long
+ */
+
+static void concat_expire(struct ev_timer *t, void *arg)
+{
+	time_t now = time(NULL);
+
+	while (sets && sets->expires <= now) {
+		stats_concat_timeouts++;
+		concat_deliver(sets, "timed out");
+	}
+
+	concat_schedule();
+}
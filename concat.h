@@ -0,0 +1,36 @@
+
+#ifndef CONCAT_H
+#define CONCAT_H
+
+#include "message.h"
+
+/*
+ *	Reassembly of concatenated MT messages. Parts are kept in sets
+ *	keyed by the sender, the reference number and the number of
+ *	parts, until the set is complete, it has been waiting for too
+ *	long, or the memory budget runs out. Then the parts are put
+ *	together and given to the delivery callback as one message, with
+ *	parts_got telling how many of the parts made it, and part_files
+ *	listing the spool files of the parts (m->spoolfile of each).
+ */
+
+typedef void (*concat_deliver_cb)(struct message *m);
+
+extern int concat_timeout;		/* seconds to wait for the rest of the parts */
+extern long concat_mem_max;		/* bytes of parts to keep at most */
+
+extern long stats_concat_parts;		/* parts taken for reassembly */
+extern long stats_concat_hits;		/* parts which found their set waiting */
+extern long stats_concat_done;		/* sets completed */
+extern long stats_concat_timeouts;	/* incomplete sets flushed after the timeout */
+extern long stats_concat_evictions;	/* incomplete sets flushed to stay within the budget */
+extern long stats_concat_sets;		/* gauge: sets waiting */
+extern long stats_concat_mem;		/* gauge: bytes held */
+
+/* Set up, assembled messages go to cb */
+extern void concat_init(concat_deliver_cb cb);
+
+/* Take a part of a concatenated message (m->parts > 1) */
+extern void concat_add(struct message *m);
+
+#endif
@@ -46,6 +46,29 @@ int port = 0;
 int serial_speed = 38400;	/* in bits per second */
 int trace_connection = 0;	/* print module traffic to stdout */
 
+/*
+ *	Input ring buffers, one for each open device fd. Data is read from
+ *	the fd in as large chunks as there are available, and bytes which
+ *	were read but not yet consumed by device_read() are kept here for
+ *	the next call.
+ */
+
+#define RBUF_LEN	4096		/* must be a power of two */
+#define RBUF_MASK	(RBUF_LEN - 1)
+
+struct rbuf {
+	int fd;
+	char *name;			/* device name, for logging */
+	unsigned int head;		/* consume position, free-running */
+	unsigned int tail;		/* fill position, free-running */
+	char data[RBUF_LEN];
+	struct rbuf *next;
+};
+
+static struct rbuf *rbufs = NULL;
+
+static struct rbuf *rbuf_get(int f);
+
 /*
  *	Open a serial device and configure it, returning the fd
  */
@@ -56,7 +79,7 @@ int open_serial_device(char *d)
 	int speed;
 	struct termios tio;
 	
-	if ((f = open(d, O_RDWR)) == -1) {
+	if ((f = open(d, O_RDWR|O_CLOEXEC)) == -1) {
 		hlog(LOG_CRIT, "Could not open %s for read/write: %s",
 			d, strerror(errno));
 		return -1;
@@ -131,7 +154,7 @@ int open_socket_device(char *h, int p)
 	
 	hlog(LOG_DEBUG, "Connecting to %s:%d ...", inet_ntoa(sa.sin_addr), port);
 	
-	if ((f = socket(sa.sin_family, SOCK_STREAM, 0)) < 0) {  /* get socket */
+	if ((f = socket(sa.sin_family, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0) {  /* get socket */
 		hlog(LOG_CRIT, "Could not get a socket: %s", strerror(errno));
 		return -1;
 	}
@@ -153,6 +176,7 @@ int open_device(char *dev)
 {
 	char *p, *d;
 	int i;
+	struct rbuf *rb;
 	
 	d = hstrdup(dev);
 	
@@ -171,14 +195,21 @@ int open_device(char *dev)
 		host = hstrdup(d);
 		port = i;
 		
-		hfree(d);
-		
-		return open_socket_device(host, port);
+		i = open_socket_device(host, port);
 	} else {
 		i = open_serial_device(d);
-		hfree(d);
-		return i;
 	}
+	
+	hfree(d);
+	
+	if (i >= 0) {
+		/* name the input buffer for logging */
+		rb = rbuf_get(i);
+		hfree(rb->name);
+		rb->name = hstrdup(dev);
+	}
+	
+	return i;
 }
 
 /*
@@ -222,135 +253,108 @@ int fdprintf(int f, const char *fmt, ...)
 }
 
 /*
- *	Read and discard bytes from fd for sec seconds
+ *	Find the input buffer of a fd, allocate one if there is none yet
  */
 
-int empty_read_buffer(int f, int sec)
+static struct rbuf *rbuf_get(int f)
 {
-	fd_set read_fds;
-	struct timeval tv;
-	char c;
-	int i, n;
-	
-	FD_ZERO(&read_fds);
-	FD_SET(f, &read_fds);
-	tv.tv_sec = sec;
-	tv.tv_usec = 0;
-	
-	if (trace_connection)
-		printf("empty_read_buffer: ");
-	
-	n = 0;
-	while ((i = select(f+1, &read_fds, NULL, NULL, &tv))) {
-		if (read(f, &c, 1) != 1) {
- 			hlog(LOG_ERR, "Could not read a character from %s: %s", device, strerror(errno));
-			return -2;
-		}
-		n++;
-		if ((trace_connection) && (c != '\r'))
-			printf("%c", c);
-		FD_ZERO(&read_fds);
-		FD_SET(f, &read_fds);
-	}
-	if (trace_connection) {
-		printf("\n");
-		fflush(stdout);
-	}
-	if (i == -1) {
-		hlog(LOG_ERR, "select on %s failed: %s", device, strerror(errno));
-		return -2;
-	}
-	return n;
+	struct rbuf *rb;
+	
+	for (rb = rbufs; (rb); rb = rb->next)
+		if (rb->fd == f)
+			return rb;
+	
+	rb = hmalloc(sizeof(*rb));
+	rb->fd = f;
+	rb->name = hstrdup(device);
+	rb->head = rb->tail = 0;
+	rb->next = rbufs;
+	rbufs = rb;
+	
+	return rb;
 }
 
 /*
- *	check if one of the listed strings is found in the buffer
- *	return a pointer to the location
+ *	Do a single read() from the fd to the free space of the ring buffer.
+ *	Returns the read() return value.
  */
 
-char *string_in(char *buffer, char **strings)
+static int rbuf_fill(struct rbuf *rb)
 {
-	char **s, *p;
+	unsigned int ofs, space;
+	int r;
 	
-	for (s = strings; (*s); s++)
-		if ((p = strstr(buffer, *s)))
-			return p;
+	ofs = rb->tail & RBUF_MASK;
+	space = RBUF_LEN - (rb->tail - rb->head);
+	if (space > RBUF_LEN - ofs)
+		space = RBUF_LEN - ofs;	/* contiguous part only */
 	
-	return NULL;
+	r = read(rb->fd, rb->data + ofs, space);
+	if (r > 0)
+		rb->tail += r;
+	
+	return r;
 }
 
 /*
- *	Read from fd to buffer until one of the defined strings is received.
+ *	Read what is available from fd without waiting for more: the bytes
+ *	already buffered, or what a single read() gives if there are none.
+ *	Only call this when the fd is readable.
  *
- *	returns:
- *	 0 on timeout
- *	 -1 on error (read/write/EOF)
- *	 otherwise the number of bytes read
+ *	returns the number of bytes, 0 if nothing was available,
+ *	-1 on error or end of file
  */
 
-int readuntil(int f, char *buf, int buflen, char **expect_ok, char **expect_error, int timeout)
+int device_read(int f, char *buf, int len)
 {
-	fd_set read_fds;
-	struct timeval tv;
-	char c;
-	int i = 0;
-	int l, r;
-	
-	FD_ZERO(&read_fds);
-	FD_SET(f, &read_fds);
-	
-	tv.tv_sec = timeout / 1000;
-	tv.tv_usec = (timeout % 1000) * 1000;
+	struct rbuf *rb;
+	int l = 0;
+	int r;
 	
-	l = 0;
-	bzero(buf, buflen);
+	rb = rbuf_get(f);
 	
-	if (trace_connection)
-		printf("readuntil: ");
-	
-	while ((l < buflen) && (!string_in(buf, expect_ok)) && (!string_in(buf, expect_error))
-	   && ((i = select(f+1, &read_fds, NULL, NULL, &tv) > 0))) {
-		r = read(f, &c, 1);
+	if (rb->head == rb->tail) {
+		r = rbuf_fill(rb);
 		if (r == 0) {
-			hlog(LOG_ERR, "End of file from %s", device);
+			hlog(LOG_ERR, "End of file from %s", rb->name);
 			return -1;
 		}
 		if (r < 0) {
-			hlog(LOG_ERR, "Could not read a character from %s: %s", device, strerror(errno));
+			if (errno == EINTR || errno == EAGAIN)
+				return 0;
+			hlog(LOG_ERR, "Could not read from %s: %s", rb->name, strerror(errno));
 			return -1;
 		}
-		
-		if (c != '\r') {
-			buf[l] = c;
-			l++;
-			if (trace_connection)
-				printf("%c", c);
-		}
-		
-		FD_ZERO(&read_fds);
-		FD_SET(f, &read_fds);
 	}
 	
+	while (rb->head != rb->tail && l < len)
+		buf[l++] = rb->data[rb->head++ & RBUF_MASK];
+	
 	if (trace_connection) {
-		printf("\n");
+		printf("device_read: %.*s\n", l, buf);
 		fflush(stdout);
 	}
 	
-	buf[buflen-1] = '\0';
-	
-	if (i == 0) {
-		//hlog(LOG_DEBUG, "select() timed out");
-		return 0;
-	}
-	
-	if (i == -1) {
-		hlog(LOG_CRIT, "select on %s failed: %s", device, strerror(errno));
-		if (errno == EINTR)
-			return -1;
-		else
-			exit(2);
-	}
-	
 	return l;
 }
 
+/*
+ *	Close a device fd and throw away any buffered input
+ */
+
+int close_device(int f)
+{
+	struct rbuf *rb, **prevp;
+	
+	for (prevp = &rbufs; (*prevp); prevp = &(*prevp)->next) {
+		rb = *prevp;
+		if (rb->fd == f) {
+			*prevp = rb->next;
+			hfree(rb->name);
+			hfree(rb);
+			break;
+		}
+	}
+	
+	return close(f);
+}
@@ -0,0 +1,398 @@
+
+/*
+ *	event.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Event loop: readable or writable fds and one-shot timers. epoll
+ *	and timerfd on Linux, poll() and a timer list elsewhere.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include "event.h"
+#include "hmalloc.h"
+#include "log.h"
+
+#define EV_MAX_EVENTS	32
+
+struct ev_fd {
+	int fd;
+	int deleted;		/* removed, waiting for the loop to let go */
+	int write;		/* watched for writability, not readability */
+	ev_fd_cb cb;
+	void *arg;
+	struct ev_fd *next;
+};
+
+static struct ev_fd *ev_fds = NULL;
+static struct ev_timer *ev_timers = NULL;
+static int ev_garbage = 0;	/* there are deleted entries to free */
+
+#ifdef __linux__
+static int epoll_fd = -1;
+#endif
+
+/*
+ *	Set up the event loop
+ */
+
+int ev_init(void)
+{
+#ifdef __linux__
+	if (epoll_fd >= 0)
+		return 0;
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		hlog(LOG_CRIT, "epoll_create1 failed: %s", strerror(errno));
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/*
+ *	Add and remove fds to watch
+ */
+
+int ev_add_fd(int fd, ev_fd_cb cb, void *arg)
+{
+	struct ev_fd *e;
+#ifdef __linux__
+	struct epoll_event ee;
+#endif
+
+	e = hmalloc(sizeof(*e));
+	e->fd = fd;
+	e->deleted = 0;
+	e->write = 0;
+	e->cb = cb;
+	e->arg = arg;
+
+#ifdef __linux__
+	memset(&ee, 0, sizeof(ee));
+	ee.events = EPOLLIN;
+	ee.data.ptr = e;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ee)) {
+		hlog(LOG_ERR, "epoll_ctl ADD fd %d failed: %s", fd, strerror(errno));
+		hfree(e);
+		return -1;
+	}
+#endif
+
+	e->next = ev_fds;
+	ev_fds = e;
+
+	return 0;
+}
+
+int ev_del_fd(int fd)
+{
+	struct ev_fd *e;
+
+	for (e = ev_fds; (e); e = e->next)
+		if (e->fd == fd && !e->deleted)
+			break;
+
+	if (!e)
+		return -1;
+
+#ifdef __linux__
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL))
+		hlog(LOG_ERR, "epoll_ctl DEL fd %d failed: %s", fd, strerror(errno));
+#endif
+
+	/* events for it may be pending in this round, free it later */
+	e->deleted = 1;
+	ev_garbage = 1;
+
+	return 0;
+}
+
+int ev_mod_fd(int fd, ev_fd_cb cb, int write)
+{
+	struct ev_fd *e;
+#ifdef __linux__
+	struct epoll_event ee;
+#endif
+
+	for (e = ev_fds; (e); e = e->next)
+		if (e->fd == fd && !e->deleted)
+			break;
+
+	if (!e)
+		return -1;
+
+#ifdef __linux__
+	memset(&ee, 0, sizeof(ee));
+	ee.events = (write) ? EPOLLOUT : EPOLLIN;
+	ee.data.ptr = e;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ee)) {
+		hlog(LOG_ERR, "epoll_ctl MOD fd %d failed: %s", fd, strerror(errno));
+		return -1;
+	}
+#endif
+
+	e->cb = cb;
+	e->write = write;
+
+	return 0;
+}
+
+/*
+ *	Timers
+ */
+
+#ifdef __linux__
+static void ev_timerfd_read(int fd, void *arg)
+{
+	struct ev_timer *t = arg;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;	/* rearmed or stopped after it fired */
+
+	t->armed = 0;
+	t->cb(t, t->arg);
+}
+#endif
+
+struct ev_timer *ev_timer_new(ev_timer_cb cb, void *arg)
+{
+	struct ev_timer *t;
+
+	t = hmalloc(sizeof(*t));
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+	t->cb = cb;
+	t->arg = arg;
+
+#ifdef __linux__
+	if ((t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0) {
+		hlog(LOG_CRIT, "timerfd_create failed: %s", strerror(errno));
+		exit(2);
+	}
+	if (ev_add_fd(t->fd, ev_timerfd_read, t)) {
+		hlog(LOG_CRIT, "Could not add a timer to the event loop");
+		exit(2);
+	}
+#endif
+
+	t->next = ev_timers;
+	ev_timers = t;
+
+	return t;
+}
+
+void ev_timer_free(struct ev_timer *t)
+{
+	ev_timer_stop(t);
+#ifdef __linux__
+	ev_del_fd(t->fd);
+	close(t->fd);
+	t->fd = -1;
+#endif
+	t->deleted = 1;
+	ev_garbage = 1;
+}
+
+void ev_timer_set(struct ev_timer *t, int ms)
+{
+#ifdef __linux__
+	struct itimerspec its;
+#endif
+
+	if (ms < 0)
+		ms = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t->expires);
+	t->expires.tv_sec += ms / 1000;
+	t->expires.tv_nsec += (ms % 1000) * 1000000;
+	if (t->expires.tv_nsec >= 1000000000) {
+		t->expires.tv_sec++;
+		t->expires.tv_nsec -= 1000000000;
+	}
+	t->armed = 1;
+
+#ifdef __linux__
+	memset(&its, 0, sizeof(its));
+	its.it_value = t->expires;
+	if (timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &its, NULL))
+		hlog(LOG_ERR, "timerfd_settime failed: %s", strerror(errno));
+#endif
+}
+
+void ev_timer_stop(struct ev_timer *t)
+{
+#ifdef __linux__
+	struct itimerspec its;
+
+	if (t->armed) {
+		memset(&its, 0, sizeof(its));
+		timerfd_settime(t->fd, 0, &its, NULL);
+	}
+#endif
+	t->armed = 0;
+}
+
+int ev_timer_left(struct ev_timer *t)
+{
+	struct timespec now;
+	long ms;
+
+	if (!t->armed)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (t->expires.tv_sec - now.tv_sec) * 1000
+		+ (t->expires.tv_nsec - now.tv_nsec) / 1000000;
+
+	return (ms < 0) ? 0 : ms;
+}
+
+/*
+ *	Free entries deleted during the previous round
+ */
+
+static void ev_collect(void)
+{
+	struct ev_fd *e, **ep;
+	struct ev_timer *t, **tp;
+
+	ep = &ev_fds;
+	while ((e = *ep)) {
+		if (e->deleted) {
+			*ep = e->next;
+			hfree(e);
+		} else
+			ep = &e->next;
+	}
+
+	tp = &ev_timers;
+	while ((t = *tp)) {
+		if (t->deleted) {
+			*tp = t->next;
+			hfree(t);
+		} else
+			tp = &t->next;
+	}
+
+	ev_garbage = 0;
+}
+
+/*
+ *	Wait for events and run callbacks
+ */
+
+#ifdef __linux__
+
+int ev_run(int timeout)
+{
+	struct epoll_event events[EV_MAX_EVENTS];
+	struct ev_fd *e;
+	int n, i;
+
+	n = epoll_wait(epoll_fd, events, EV_MAX_EVENTS, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return -1;
+		hlog(LOG_CRIT, "epoll_wait failed: %s", strerror(errno));
+		exit(2);
+	}
+
+	for (i = 0; i < n; i++) {
+		e = events[i].data.ptr;
+		if (!e->deleted)
+			e->cb(e->fd, e->arg);
+	}
+
+	if (ev_garbage)
+		ev_collect();
+
+	return n;
+}
+
+#else
+
+int ev_run(int timeout)
+{
+	struct pollfd pfds[EV_MAX_EVENTS];
+	struct ev_fd *fds[EV_MAX_EVENTS];
+	struct ev_fd *e;
+	struct ev_timer *t;
+	int nfds = 0, n, i, left;
+	int ran = 0;
+
+	for (e = ev_fds; (e) && nfds < EV_MAX_EVENTS; e = e->next) {
+		if (e->deleted)
+			continue;
+		pfds[nfds].fd = e->fd;
+		pfds[nfds].events = (e->write) ? POLLOUT : POLLIN;
+		pfds[nfds].revents = 0;
+		fds[nfds] = e;
+		nfds++;
+	}
+
+	for (t = ev_timers; (t); t = t->next) {
+		if (t->deleted || (left = ev_timer_left(t)) < 0)
+			continue;
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+
+	n = poll(pfds, nfds, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return -1;
+		hlog(LOG_CRIT, "poll failed: %s", strerror(errno));
+		exit(2);
+	}
+
+	for (i = 0; i < nfds; i++) {
+		if ((pfds[i].revents) && !fds[i]->deleted) {
+			fds[i]->cb(fds[i]->fd, fds[i]->arg);
+			ran++;
+		}
+	}
+
+	for (t = ev_timers; (t); t = t->next) {
+		if (!t->deleted && ev_timer_left(t) == 0) {
+			t->armed = 0;
+			t->cb(t, t->arg);
+			ran++;
+		}
+	}
+
+	if (ev_garbage)
+		ev_collect();
+
+	return ran;
+}
+
+#endif
+
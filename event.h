@@ -0,0 +1,59 @@
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <time.h>
+
+/*
+ *	A small event loop: callbacks for readable (or writable) file
+ *	descriptors and one-shot timers. On Linux this runs on epoll, and every timer is a
+ *	timerfd in the same epoll set. Elsewhere poll() is used, with the
+ *	timeout calculated from the nearest timer.
+ */
+
+struct ev_timer;
+
+typedef void (*ev_fd_cb)(int fd, void *arg);
+typedef void (*ev_timer_cb)(struct ev_timer *t, void *arg);
+
+struct ev_timer {
+	int fd;				/* timerfd, -1 if not used */
+	int armed;			/* timer is running */
+	int deleted;			/* freed, waiting for the loop to let go */
+	struct timespec expires;	/* CLOCK_MONOTONIC expiry time, if armed */
+	ev_timer_cb cb;
+	void *arg;
+	struct ev_timer *next;		/* list of all timers */
+};
+
+/* Set up the event loop, returns -1 on failure */
+extern int ev_init(void);
+
+/* Call cb when fd becomes readable */
+extern int ev_add_fd(int fd, ev_fd_cb cb, void *arg);
+extern int ev_del_fd(int fd);
+
+/* Call cb instead when fd becomes writable if write is set,
+ * or readable if it is not
+ */
+extern int ev_mod_fd(int fd, ev_fd_cb cb, int write);
+
+/* Allocate and free timers */
+extern struct ev_timer *ev_timer_new(ev_timer_cb cb, void *arg);
+extern void ev_timer_free(struct ev_timer *t);
+
+/* Arm a timer to fire once after ms milliseconds, stop it */
+extern void ev_timer_set(struct ev_timer *t, int ms);
+extern void ev_timer_stop(struct ev_timer *t);
+
+/* Milliseconds until a timer fires, -1 if it is not armed */
+extern int ev_timer_left(struct ev_timer *t);
+
+/* Wait at most timeout milliseconds (-1: forever) for events,
+ * and run the callbacks of the ones which happened. Returns the number
+ * of callbacks run, or -1 if the wait was interrupted by a signal.
+ */
+extern int ev_run(int timeout);
+
+#endif
+
@@ -0,0 +1,91 @@
+
+/*
+ *	gencharset.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Build-time generator for the character set lookup tables: reads
+ *	the conversion table in charset_table.h, and prints a 256-entry
+ *	direct lookup table for every pair of character sets, with the
+ *	same results as scanning the table: the first matching entry
+ *	wins, and characters which are not found become spaces.
+ *
+ *	usage: gencharset > charset_map.h
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+
+#include "charset.h"
+#include "charset_table.h"
+
+#define CHARSETS	4
+
+/*
+ *	Look up a character by scanning a table
+ */
+
+static char scan(char *table, char c, int from, int to)
+{
+	int i;
+
+	for (i = 0; table[i*4]; i++)
+		if (table[i*4+from] == c)
+			return table[i*4+to];
+
+	return ' ';
+}
+
+/*
+ *	Print the lookup tables of one conversion table
+ */
+
+static void print_map(char *name, char *table)
+{
+	int from, to, c;
+
+	printf("static const char %s[%d][%d][256] = {\n", name, CHARSETS, CHARSETS);
+	for (from = 0; from < CHARSETS; from++) {
+		printf("  {\n");
+		for (to = 0; to < CHARSETS; to++) {
+			printf("    { /* %d => %d */", from, to);
+			for (c = 0; c < 256; c++) {
+				if (c % 16 == 0)
+					printf("\n      ");
+				printf("0x%02X,", (unsigned char)scan(table, (char)c, from, to));
+			}
+			printf("\n    },\n");
+		}
+		printf("  },\n");
+	}
+	printf("};\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	printf("/* Generated by gencharset from charset_table.h, do not edit */\n\n");
+	printf("#ifndef CHARSET_MAP_H\n#define CHARSET_MAP_H\n\n");
+
+	print_map("charset_map", charset);
+	print_map("ext_charset_map", ext_charset);
+
+	printf("#endif\n");
+
+	return 0;
+}
+
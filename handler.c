@@ -0,0 +1,897 @@
+
+/*
+ *	handler.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Running the MT message handler: either a process for each message,
+ *	at most handler_max at a time, or a pool of persistent handler
+ *	processes, so that a burst of incoming messages does not start a
+ *	new handler for each of them. Messages wait in a queue for their
+ *	turn either way.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* for posix_spawn_file_actions_addclosefrom_np() and NSIG */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
+
+#include "handler.h"
+#include "event.h"
+#include "hmalloc.h"
+#include "log.h"
+#include "timeline.h"
+
+#define WORKER_BUFLEN		512	/* longest answer line from a worker */
+#define WORKER_QUICK_DEATH	5	/* seconds: dying sooner than this after starting is suspicious */
+#define WORKER_MAX_DEATHS	3	/* quick deaths in a row before giving up on the pool */
+#define WORKER_RESTART_DELAY	1000	/* ms to wait before starting a dead worker again */
+#define SWEEP_INTERVAL		1000	/* ms between looks at the running handlers */
+#define SPAWN_RETRY_DELAY	1000	/* ms to wait after a handler could not be started */
+
+int handler_workers = 0;		/* processes in the pool, 0: no pool */
+int handler_timeout = 60;		/* seconds a handler may spend on a message */
+int handler_max = 10;			/* handler processes at a time without the pool */
+int handler_high = 100;			/* messages waiting before MT is held back */
+
+long stats_handler_jobs = 0;
+long stats_handler_fail = 0;
+long stats_handler_timeouts = 0;
+long stats_handler_restarts = 0;
+long stats_handler_waiting = 0;
+long stats_handler_running = 0;
+long stats_handler_backlogs = 0;
+long stats_handler_runtime[HANDLER_HIST_BUCKETS];
+long stats_handler_runtime_max = 0;
+
+/* upper bounds of the runtime histogram buckets, ms, the last one has none */
+int handler_hist_limits[HANDLER_HIST_BUCKETS] = { 10, 100, 1000, 10000, -1 };
+
+struct hjob {
+	char *msgid;
+	char *src;
+	char *spoolf;
+	struct timespec start;		/* when a handler got it */
+	struct timespec tl[TL_STAMPS];	/* timeline of the message */
+	struct hjob *next;
+};
+
+/* a handler process running for one message */
+struct hchild {
+	pid_t pid;
+	struct hjob *job;
+	struct hchild *next;
+};
+
+/* a persistent worker of the pool */
+struct hworker {
+	int id;
+	pid_t pid;
+	int fd;				/* socket to the worker, -1 if not running */
+	time_t started;			/* when it was started */
+	int deaths;			/* quick deaths in a row */
+	struct hjob *job;		/* message being handled */
+	struct ev_timer *timer;		/* job timeout, or restart delay when not running */
+	char buf[WORKER_BUFLEN];	/* partial answer line */
+	int buflen;
+};
+
+static char *handler_prog = NULL;
+static struct hworker *workers = NULL;
+static int pool_up = 0;			/* the pool is in use */
+static int backlogged = 0;		/* too many messages waiting */
+
+static struct hjob *jobs = NULL;	/* messages waiting for a handler */
+static struct hjob **jobs_tail = &jobs;
+static struct hchild *children = NULL;	/* handlers running without the pool */
+
+static struct ev_timer *sweep_timer;
+static struct ev_timer *spawn_timer;
+static int sigchld_fd = -1;
+
+static int worker_start(struct hworker *w);
+static void handler_dispatch(void);
+
+extern char **environ;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_ADDCLOSEFROM
+#endif
+
+#ifdef HAVE_ADDCLOSEFROM
+
+/*
+ *	Start a program without copying the daemon with fork(). Everything
+ *	above stderr is closed in the child, in case something slipped
+ *	through without close-on-exec. The signal setup of the daemon is
+ *	not passed on.
+ */
+
+int handler_spawn(char *const argv[], int in_fd, int new_session, pid_t *pid)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t set;
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	int e;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawnattr_init(&attr);
+
+	if (in_fd >= 0)
+		posix_spawn_file_actions_adddup2(&fa, in_fd, 0);
+	posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+	if (new_session)
+		flags |= POSIX_SPAWN_SETSID;
+	sigemptyset(&set);
+	posix_spawnattr_setsigmask(&attr, &set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &set);
+	posix_spawnattr_setflags(&attr, flags);
+
+	e = posix_spawn(pid, argv[0], &fa, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (e) {
+		errno = e;
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+
+/*
+ *	The C library can not close the fds for posix_spawn(), so do what
+ *	it would: vfork(), and in the child close everything above stderr
+ *	with close_range() where the kernel has it, or one by one. Signals
+ *	are blocked around it so that the handlers of the daemon never run
+ *	in the child, which shares the memory of the daemon until exec.
+ */
+
+int handler_spawn(char *const argv[], int in_fd, int new_session, pid_t *pid)
+{
+	sigset_t all, old;
+	struct sigaction sa;
+	volatile int e = 0;
+	long maxfd = sysconf(_SC_OPEN_MAX);
+	pid_t p;
+	int i;
+
+	if (maxfd < 0)
+		maxfd = 1024;
+
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, &old);
+
+	if ((p = vfork()) == 0) {
+		for (i = 1; i < NSIG; i++) {
+			if (sigaction(i, NULL, &sa) || (sa.sa_handler == SIG_IGN && i != SIGPIPE))
+				continue;
+			sa.sa_handler = SIG_DFL;
+			sa.sa_flags = 0;
+			sigaction(i, &sa, NULL);
+		}
+		if (in_fd >= 0 && dup2(in_fd, 0) < 0)
+			goto fail;
+		if (new_session)
+			setsid();
+#ifdef SYS_close_range
+		if (syscall(SYS_close_range, 3, ~0U, 0))
+#endif
+			for (i = 3; i < maxfd; i++)
+				close(i);
+		sigemptyset(&all);
+		sigprocmask(SIG_SETMASK, &all, NULL);
+		execve(argv[0], argv, environ);
+	fail:
+		e = errno;
+		_exit(127);
+	}
+
+	if (p < 0)
+		e = errno;
+	else if (e)
+		waitpid(p, NULL, 0);	/* exec failed */
+	sigprocmask(SIG_SETMASK, &old, NULL);
+
+	if (e) {
+		errno = e;
+		return -1;
+	}
+
+	*pid = p;
+	return 0;
+}
+
+#endif
+
+/*
+ *	Allocate and free jobs
+ */
+
+static struct hjob *job_new(char *msgid, char *src, char *spoolf, struct timespec *tl)
+{
+	struct hjob *j;
+
+	j = hmalloc(sizeof(*j));
+	j->msgid = hstrdup(msgid);
+	j->src = hstrdup((src) ? src : "");
+	j->spoolf = hstrdup(spoolf);
+	memcpy(j->tl, tl, sizeof(j->tl));
+	j->next = NULL;
+
+	return j;
+}
+
+static void job_free(struct hjob *j)
+{
+	hfree(j->msgid);
+	hfree(j->src);
+	hfree(j->spoolf);
+	hfree(j);
+}
+
+/*
+ *	Take the next waiting job
+ */
+
+static struct hjob *job_get(void)
+{
+	struct hjob *j;
+
+	if (!(j = jobs))
+		return NULL;
+
+	if (!(jobs = j->next))
+		jobs_tail = &jobs;
+	j->next = NULL;
+	stats_handler_waiting--;
+
+	if (backlogged && stats_handler_waiting <= handler_high / 2) {
+		backlogged = 0;
+		hlog(LOG_NOTICE, "Handlers caught up, %ld messages waiting, accepting MT again", stats_handler_waiting);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &j->start);
+	j->tl[TL_SPAWNED] = j->start;
+	stats_handler_jobs++;
+
+	return j;
+}
+
+/*
+ *	Put a job which could not be started back at the head of the queue
+ */
+
+static void job_unget(struct hjob *j)
+{
+	if (!(j->next = jobs))
+		jobs_tail = &j->next;
+	jobs = j;
+	stats_handler_waiting++;
+	stats_handler_jobs--;
+}
+
+/*
+ *	A job is done: record how long it took, and whether it went well
+ */
+
+static long job_ms(struct hjob *j)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - j->start.tv_sec) * 1000 + (now.tv_nsec - j->start.tv_nsec) / 1000000;
+}
+
+static void job_done(struct hjob *j, int ok)
+{
+	long ms = job_ms(j);
+	int i;
+
+	for (i = 0; i < HANDLER_HIST_BUCKETS - 1 && ms > handler_hist_limits[i]; i++)
+		;
+	stats_handler_runtime[i]++;
+	if (ms > stats_handler_runtime_max)
+		stats_handler_runtime_max = ms;
+
+	if (!ok)
+		stats_handler_fail++;
+
+	tl_stamp(j->tl, TL_EXITED);
+	tl_report(j->msgid, (ok) ? "MT result:OK" : "MT result:FAILED", j->tl, TS_MT_PARSE, TS_MT_TOTAL);
+
+	job_free(j);
+}
+
+/*
+ *	Escape a field to p, return the end
+ */
+
+static char *hesc(char *p, const char *s)
+{
+	static const char hexdigits[] = "0123456789ABCDEF";
+	unsigned char c;
+
+	for (; *s; s++) {
+		c = *s;
+		if (c < ' ' || c == '%' || c == 0x7f) {
+			*p++ = '%';
+			*p++ = hexdigits[c >> 4];
+			*p++ = hexdigits[c & 15];
+		} else
+			*p++ = c;
+	}
+
+	return p;
+}
+
+/*
+ *	Run the handler program for a job, without the pool. The spool file
+ *	is the only copy of an acknowledged message: if the handler can not
+ *	be started, the job goes back to wait and is tried again in a while.
+ */
+
+static int child_start(struct hjob *j)
+{
+	char *argv[] = { handler_prog, j->msgid, j->src, j->spoolf, NULL };
+	struct hchild *c;
+	pid_t pid;
+
+	if (handler_spawn(argv, -1, 0, &pid)) {
+		hlog(LOG_ERR, "[%s] Could not execute handler %s, trying again in %d ms: %s",
+			j->msgid, handler_prog, SPAWN_RETRY_DELAY, strerror(errno));
+		job_unget(j);
+		if (ev_timer_left(spawn_timer) < 0)
+			ev_timer_set(spawn_timer, SPAWN_RETRY_DELAY);
+		return -1;
+	}
+
+	hlog(LOG_DEBUG, "[%s] Executing handler with pid %d spoolfile %s", j->msgid, (int)pid, j->spoolf);
+
+	c = hmalloc(sizeof(*c));
+	c->pid = pid;
+	c->job = j;
+	c->next = children;
+	children = c;
+	stats_handler_running++;
+
+	if (ev_timer_left(sweep_timer) < 0)
+		ev_timer_set(sweep_timer, SWEEP_INTERVAL);
+
+	return 0;
+}
+
+/*
+ *	A child process exited
+ */
+
+static void child_exited(pid_t pid, int status)
+{
+	struct hchild *c, **prevp;
+	int i;
+
+	for (prevp = &children; (c = *prevp); prevp = &c->next)
+		if (c->pid == pid)
+			break;
+
+	if (!c) {
+		/* workers of the pool are watched through their sockets */
+		for (i = 0; i < handler_workers && (workers); i++)
+			if (workers[i].pid == pid)
+				hlog(LOG_DEBUG, "Handler worker %d (pid %d) exit status %d", i, (int)pid, status);
+		return;
+	}
+
+	*prevp = c->next;
+	stats_handler_running--;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		hlog(LOG_DEBUG, "[%s] Handler pid %d done in %ld ms", c->job->msgid, (int)pid, job_ms(c->job));
+		job_done(c->job, 1);
+	} else {
+		if (WIFSIGNALED(status))
+			hlog(LOG_ERR, "[%s] Handler pid %d killed by signal %d after %ld ms",
+				c->job->msgid, (int)pid, WTERMSIG(status), job_ms(c->job));
+		else
+			hlog(LOG_ERR, "[%s] Handler pid %d failed with exit status %d after %ld ms",
+				c->job->msgid, (int)pid, WEXITSTATUS(status), job_ms(c->job));
+		job_done(c->job, 0);
+	}
+	hfree(c);
+}
+
+/*
+ *	Reap the children which have exited, and start the next ones
+ */
+
+static void handler_reap(void)
+{
+	pid_t pid;
+	int status, c = 0;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		child_exited(pid, status);
+		c++;
+	}
+
+	if (c)
+		handler_dispatch();
+}
+
+#ifdef __linux__
+static void sigchld_cb(int fd, void *arg)
+{
+	struct signalfd_siginfo si;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si))
+		;
+
+	handler_reap();
+}
+#endif
+
+/*
+ *	Every now and then while handlers run: reap them in case a signal
+ *	was missed, and kill the ones which take too long
+ */
+
+static void sweep_timer_cb(struct ev_timer *t, void *arg)
+{
+	struct hchild *c;
+
+	handler_reap();
+
+	for (c = children; (c); c = c->next)
+		if (job_ms(c->job) > handler_timeout * 1000L) {
+			hlog(LOG_ERR, "[%s] Handler pid %d timed out after %d s, killing it",
+				c->job->msgid, (int)c->pid, handler_timeout);
+			stats_handler_timeouts++;
+			kill(c->pid, SIGKILL);
+		}
+
+	if (children)
+		ev_timer_set(sweep_timer, SWEEP_INTERVAL);
+}
+
+static void spawn_timer_cb(struct ev_timer *t, void *arg)
+{
+	handler_dispatch();
+}
+
+/*
+ *	Give up on the pool, the handler is run for each message from now on,
+ *	starting with the ones the workers were handling
+ */
+
+static void pool_fail(void)
+{
+	int i;
+
+	hlog(LOG_ERR, "Handler workers keep dying, running %s for each message instead", handler_prog);
+	pool_up = 0;
+
+	for (i = 0; i < handler_workers; i++) {
+		ev_timer_stop(workers[i].timer);
+		if (workers[i].fd >= 0) {
+			ev_del_fd(workers[i].fd);
+			close(workers[i].fd);
+			workers[i].fd = -1;
+			if (workers[i].job)
+				kill(workers[i].pid, SIGKILL);
+		}
+		if (workers[i].job) {
+			child_start(workers[i].job);
+			workers[i].job = NULL;
+		}
+	}
+
+	handler_dispatch();
+}
+
+/*
+ *	A worker is gone, one way or another: fail the message it was
+ *	handling, and start it again after a moment. If the worker did
+ *	not live long, again, the pool is given up on.
+ */
+
+static void worker_dead(struct hworker *w, const char *why)
+{
+	if (w->job)
+		hlog(LOG_ERR, "[%s] Handler worker %d (pid %d) %s while handling the message",
+			w->job->msgid, w->id, (int)w->pid, why);
+	else
+		hlog(LOG_ERR, "Handler worker %d (pid %d) %s", w->id, (int)w->pid, why);
+
+	ev_del_fd(w->fd);
+	close(w->fd);
+	w->fd = -1;
+	w->buflen = 0;
+
+	if (time(NULL) - w->started >= WORKER_QUICK_DEATH)
+		w->deaths = 0;
+	else if (++w->deaths >= WORKER_MAX_DEATHS) {
+		pool_fail();
+		return;
+	}
+
+	if (w->job) {
+		job_done(w->job, 0);
+		w->job = NULL;
+	}
+
+	ev_timer_set(w->timer, WORKER_RESTART_DELAY);
+}
+
+/*
+ *	An answer from a worker
+ */
+
+static void worker_answer(struct hworker *w, char *s)
+{
+	char *status;
+	int ok;
+
+	if (!(status = strchr(s, '\t')) || !w->job || strncmp(s, w->job->msgid, status - s)
+	    || strlen(w->job->msgid) != (size_t)(status - s)) {
+		hlog(LOG_ERR, "Handler worker %d (pid %d): Unexpected answer \"%s\"", w->id, (int)w->pid, s);
+		return;
+	}
+	status++;
+
+	if (!(ok = (atoi(status) == 0)))
+		hlog(LOG_ERR, "[%s] Handler worker %d failed the message, status %s after %ld ms",
+			w->job->msgid, w->id, status, job_ms(w->job));
+	else
+		hlog(LOG_DEBUG, "[%s] Handler worker %d done in %ld ms", w->job->msgid, w->id, job_ms(w->job));
+
+	ev_timer_stop(w->timer);
+	job_done(w->job, ok);
+	w->job = NULL;
+	w->deaths = 0;
+	handler_dispatch();
+}
+
+static void worker_read_cb(int fd, void *arg)
+{
+	struct hworker *w = arg;
+	char *nl;
+	int l;
+
+	while ((l = read(fd, w->buf + w->buflen, sizeof(w->buf) - 1 - w->buflen)) > 0) {
+		w->buflen += l;
+		w->buf[w->buflen] = 0;
+		while ((nl = strchr(w->buf, '\n'))) {
+			*nl = 0;
+			if (nl > w->buf && nl[-1] == '\r')
+				nl[-1] = 0;
+			worker_answer(w, w->buf);
+			if (w->fd < 0)
+				return;
+			w->buflen -= nl + 1 - w->buf;
+			memmove(w->buf, nl + 1, w->buflen + 1);
+		}
+		if (w->buflen == sizeof(w->buf) - 1) {
+			hlog(LOG_ERR, "Handler worker %d (pid %d): Too long answer line, discarding", w->id, (int)w->pid);
+			w->buflen = 0;
+		}
+	}
+
+	if (l == 0)
+		worker_dead(w, "exited");
+	else if (errno != EAGAIN && errno != EINTR)
+		worker_dead(w, strerror(errno));
+}
+
+/*
+ *	Worker timer: the job took too long, or it's time to start again
+ */
+
+static void worker_timer_cb(struct ev_timer *t, void *arg)
+{
+	struct hworker *w = arg;
+
+	if (w->fd < 0) {
+		if (pool_up && worker_start(w) == 0)
+			handler_dispatch();
+		return;
+	}
+
+	stats_handler_timeouts++;
+	kill(w->pid, SIGKILL);
+	worker_dead(w, "timed out");
+}
+
+/*
+ *	Give a job to an idle worker
+ */
+
+static void worker_give(struct hworker *w, struct hjob *j)
+{
+	char *line, *p;
+	int len;
+
+	w->job = j;
+
+	line = hmalloc((strlen(j->msgid) + strlen(j->src) + strlen(j->spoolf)) * 3 + 3);
+	p = hesc(line, j->msgid);
+	*p++ = '\t';
+	p = hesc(p, j->src);
+	*p++ = '\t';
+	p = hesc(p, j->spoolf);
+	*p++ = '\n';
+	len = p - line;
+
+	hlog(LOG_DEBUG, "[%s] Giving message to handler worker %d (pid %d)", j->msgid, w->id, (int)w->pid);
+	ev_timer_set(w->timer, handler_timeout * 1000);
+
+	/* the worker reads a line at a time, and the socket has room for many */
+	if (write(w->fd, line, len) != len)
+		worker_dead(w, "could not be written to");
+
+	hfree(line);
+}
+
+/*
+ *	Start a worker
+ */
+
+static int worker_start(struct hworker *w)
+{
+	char *argv[] = { handler_prog, "-w", NULL };
+	int sv[2];
+	int r;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv)) {
+		hlog(LOG_ERR, "Handler worker %d: socketpair failed: %s", w->id, strerror(errno));
+		return -1;
+	}
+
+	/* the socket is stdin of the worker, and it is left alone by
+	 * signals for the daemon, it exits when the socket closes
+	 */
+	r = handler_spawn(argv, sv[1], 1, &w->pid);
+	close(sv[1]);
+	if (r) {
+		hlog(LOG_ERR, "Could not start handler worker %d (%s): %s", w->id, handler_prog, strerror(errno));
+		close(sv[0]);
+		return -1;
+	}
+
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	if (ev_add_fd(sv[0], worker_read_cb, w)) {
+		close(sv[0]);
+		kill(w->pid, SIGKILL);
+		return -1;
+	}
+
+	w->fd = sv[0];
+	w->buflen = 0;
+	if (w->started)
+		stats_handler_restarts++;
+	time(&w->started);
+	hlog(LOG_DEBUG, "Handler worker %d started, pid %d", w->id, (int)w->pid);
+
+	return 0;
+}
+
+/*
+ *	Give waiting messages to idle workers or to new handler processes,
+ *	as far as there is room
+ */
+
+static void handler_dispatch(void)
+{
+	int i;
+
+	if (pool_up) {
+		for (i = 0; i < handler_workers && (jobs); i++)
+			if (workers[i].fd >= 0 && !workers[i].job)
+				worker_give(&workers[i], job_get());
+		return;
+	}
+
+	while (jobs && stats_handler_running < handler_max)
+		if (child_start(job_get()))
+			break;
+}
+
+/*
+ *	Set up
+ */
+
+int handler_init(char *prog)
+{
+	int i, up = 0;
+#ifdef __linux__
+	sigset_t set;
+#endif
+
+	handler_prog = prog;
+	sweep_timer = ev_timer_new(sweep_timer_cb, NULL);
+	spawn_timer = ev_timer_new(spawn_timer_cb, NULL);
+
+	/* exits of the handlers come in as events, elsewhere
+	 * they are looked for every SWEEP_INTERVAL
+	 */
+#ifdef __linux__
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	if ((sigchld_fd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC)) < 0)
+		hlog(LOG_ERR, "signalfd failed, handler exits are noticed late: %s", strerror(errno));
+	else if (ev_add_fd(sigchld_fd, sigchld_cb, NULL)) {
+		close(sigchld_fd);
+		sigchld_fd = -1;
+	}
+#endif
+
+	if (handler_workers <= 0)
+		return 0;
+
+	workers = hmalloc(handler_workers * sizeof(*workers));
+	memset(workers, 0, handler_workers * sizeof(*workers));
+	for (i = 0; i < handler_workers; i++) {
+		workers[i].id = i;
+		workers[i].fd = -1;
+		workers[i].timer = ev_timer_new(worker_timer_cb, &workers[i]);
+		if (worker_start(&workers[i]) == 0)
+			up++;
+	}
+
+	if (!up) {
+		hlog(LOG_ERR, "Could not start any handler workers, running %s for each message", prog);
+		return -1;
+	}
+
+	hlog(LOG_INFO, "Started %d handler workers", up);
+	pool_up = 1;
+
+	return 0;
+}
+
+/*
+ *	Queue a message for the handler
+ */
+
+void handler_submit(char *msgid, char *src, char *spoolf, struct timespec *tl)
+{
+	*jobs_tail = job_new(msgid, src, spoolf, tl);
+	jobs_tail = &(*jobs_tail)->next;
+	stats_handler_waiting++;
+
+	handler_dispatch();
+
+	if (!jobs)
+		return;
+
+	hlog(LOG_DEBUG, "[%s] All handlers busy, %ld messages waiting", msgid, stats_handler_waiting);
+	if (!backlogged && stats_handler_waiting >= handler_high) {
+		backlogged = 1;
+		stats_handler_backlogs++;
+		hlog(LOG_WARNING, "Handlers are behind with %ld messages waiting, holding back MT", stats_handler_waiting);
+	}
+}
+
+/*
+ *	Should new MT messages be held back
+ */
+
+int handler_backlogged(void)
+{
+	return backlogged;
+}
+
+/*
+ *	Is a worker of the pool handling a message
+ */
+
+static int pool_busy(void)
+{
+	int i;
+
+	for (i = 0; i < handler_workers; i++)
+		if (workers[i].job)
+			return 1;
+
+	return 0;
+}
+
+/*
+ *	Shut down: the workers get to finish what they have and what is
+ *	waiting, for as long as a handler may take, then they see the end
+ *	of their input and exit. The messages still waiting get a handler
+ *	process each, limit or not. A message which gets no handler is
+ *	left in its spool file, and logged.
+ */
+
+void handler_shutdown(void)
+{
+	struct hchild *c;
+	struct hjob *j;
+	struct timespec now, deadline;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += handler_timeout;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (pool_up && (jobs || pool_busy()) && now.tv_sec < deadline.tv_sec && ev_run(1000) >= 0);
+
+	if (workers) {
+		pool_up = 0;
+		for (i = 0; i < handler_workers; i++) {
+			ev_timer_free(workers[i].timer);
+			if (workers[i].fd >= 0) {
+				ev_del_fd(workers[i].fd);
+				close(workers[i].fd);
+			}
+			if (workers[i].job) {
+				hlog(LOG_ERR, "[%s] Handler worker %d did not finish the message before shutdown, leaving %s in the spool",
+					workers[i].job->msgid, i, workers[i].job->spoolf);
+				job_free(workers[i].job);
+			}
+		}
+		hfree(workers);
+		workers = NULL;
+	}
+
+	handler_reap();
+	while (jobs && child_start(job_get()) == 0)
+		;
+	while ((j = jobs)) {
+		jobs = j->next;
+		hlog(LOG_ERR, "[%s] No handler for the message at shutdown, leaving %s in the spool", j->msgid, j->spoolf);
+		job_free(j);
+	}
+	jobs_tail = &jobs;
+	stats_handler_waiting = 0;
+
+	while ((c = children)) {
+		children = c->next;
+		job_free(c->job);
+		hfree(c);
+	}
+	ev_timer_free(sweep_timer);
+	ev_timer_free(spawn_timer);
+	if (sigchld_fd >= 0) {
+		ev_del_fd(sigchld_fd);
+		close(sigchld_fd);
+	}
+}
@@ -0,0 +1,72 @@
+
+#ifndef HANDLER_H
+#define HANDLER_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ *	Running the MT message handler. Messages wait in a queue, from
+ *	which they are given to a process of their own, at most handler_max
+ *	running at a time, or to a pool of long-lived handler processes.
+ *	When the queue grows to handler_high messages, new MT is held back
+ *	until it has drained to half of that.
+ *
+ *	A pool worker is the handler program started with the argument -w
+ *	and a socket as its standard input. A message is given to an idle
+ *	worker as one line of tab-separated fields:
+ *
+ *		<msgid> <src> <spoolfile>
+ *
+ *	and the worker answers with one line when it is done with it:
+ *
+ *		<msgid> <status>
+ *
+ *	where status 0 means success. Tabs, line feeds, control characters
+ *	and % in the fields are written as %XX. A worker gets one message
+ *	at a time. A worker which takes too long is killed, and workers
+ *	which die are restarted. If they keep dying right after starting,
+ *	the pool is given up and a process is run for each message.
+ */
+
+#define HANDLER_HIST_BUCKETS	5
+
+extern int handler_workers;		/* processes in the pool, 0: no pool */
+extern int handler_timeout;		/* seconds a handler may spend on a message */
+extern int handler_max;			/* handler processes at a time without the pool */
+extern int handler_high;		/* messages waiting before MT is held back */
+
+extern long stats_handler_jobs;		/* messages given to handlers */
+extern long stats_handler_fail;		/* messages which the handlers failed */
+extern long stats_handler_timeouts;	/* handlers killed for taking too long */
+extern long stats_handler_restarts;	/* workers started again after dying */
+extern long stats_handler_waiting;	/* gauge: messages waiting for a handler */
+extern long stats_handler_running;	/* gauge: handler processes running without the pool */
+extern long stats_handler_backlogs;	/* times MT was held back */
+extern long stats_handler_runtime[HANDLER_HIST_BUCKETS]; /* handler runtimes by bucket */
+extern long stats_handler_runtime_max;	/* longest handler runtime, ms */
+extern int handler_hist_limits[HANDLER_HIST_BUCKETS]; /* bucket upper bounds, ms, -1: none */
+
+/* Start argv[0] with in_fd (if >= 0) as stdin, in a new session if
+ * new_session is set, without forking the daemon. Returns -1 with errno
+ * set if it could not be started.
+ */
+extern int handler_spawn(char *const argv[], int in_fd, int new_session, pid_t *pid);
+
+/* Set up for running the program prog, and start the pool if one is
+ * wanted. Returns -1 if the pool could not be started.
+ */
+extern int handler_init(char *prog);
+
+/* Queue a message for the handler, with its timeline (TL_STAMPS) */
+extern void handler_submit(char *msgid, char *src, char *spoolf, struct timespec *tl);
+
+/* Should new MT messages be held back */
+extern int handler_backlogged(void);
+
+/* Let the workers finish, stop them, and start handlers for what is
+ * still waiting; messages which get none stay in the spool
+ */
+extern void handler_shutdown(void);
+
+#endif
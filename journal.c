@@ -0,0 +1,714 @@
+
+/*
+ *	journal.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Write-ahead journal of the MO queue, so that queued messages
+ *	survive a restart. Records are lines of space-separated fields,
+ *	in which spaces, control characters, high bytes and % are
+ *	written as %XX.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "journal.h"
+#include "event.h"
+#include "hmalloc.h"
+#include "log.h"
+
+#define MAX_FIELDS	20
+
+char *journal_file = NULL;		/* journal file name, NULL: no journal */
+int journal_sync_time = 200;		/* ms to collect records for one sync */
+int journal_compact_records = 1000;	/* records to write before compacting */
+
+long stats_journal_records = 0;
+long stats_journal_syncs = 0;
+long stats_journal_compactions = 0;
+
+static int jfd = -1;			/* the journal, -1 if not journaling */
+static long jid_last = 0;		/* key of the last message recorded */
+static int jrecords = 0;		/* records in the journal file */
+static int jdirty = 0;			/* records written since the last sync */
+static struct ev_timer *sync_timer;
+
+static struct message *live = NULL;	/* messages recorded and not done, oldest first */
+static struct message **live_tail = &live;
+static int live_count = 0;
+
+struct junlink {
+	char *fn;
+	struct junlink *next;
+};
+
+static struct junlink *unlinks = NULL;	/* files to unlink after the sync */
+
+static void journal_compact(void);
+
+/*
+ *	Keep track of the live messages
+ */
+
+static void live_add(struct message *m)
+{
+	m->jnext = NULL;
+	m->jprevp = live_tail;
+	*live_tail = m;
+	live_tail = &m->jnext;
+	live_count++;
+}
+
+static void live_del(struct message *m)
+{
+	*m->jprevp = m->jnext;
+	if (m->jnext)
+		m->jnext->jprevp = m->jprevp;
+	else
+		live_tail = m->jprevp;
+	m->jnext = NULL;
+	m->jprevp = NULL;
+	live_count--;
+}
+
+/*
+ *	Escape a field to p, return the end
+ */
+
+static char *jesc(char *p, const char *s, int len)
+{
+	static const char hexdigits[] = "0123456789ABCDEF";
+	unsigned char c;
+	int i;
+
+	if (!s || len == 0) {
+		*p++ = '-';
+		return p;
+	}
+
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if (c <= ' ' || c == '%' || c >= 0x7f || (i == 0 && c == '-' && len == 1)) {
+			*p++ = '%';
+			*p++ = hexdigits[c >> 4];
+			*p++ = hexdigits[c & 15];
+		} else
+			*p++ = c;
+	}
+
+	return p;
+}
+
+/*
+ *	Unescape a field in place, returning its length, or -1 if it is "-"
+ */
+
+static int junesc(char *s)
+{
+	char *p = s, *q = s;
+	int c;
+
+	if (!strcmp(s, "-"))
+		return -1;
+
+	while (*p) {
+		if (*p == '%' && p[1] && p[2]) {
+			sscanf(p + 1, "%2x", &c);
+			*q++ = c;
+			p += 3;
+		} else
+			*q++ = *p++;
+	}
+	*q = 0;
+
+	return q - s;
+}
+
+static char *junesc_str(char *s)
+{
+	return (junesc(s) < 0) ? NULL : hstrdup(s);
+}
+
+/*
+ *	Room needed for a record of a message
+ */
+
+static int record_size(struct message *m)
+{
+	return 256 + 3 * (m->len + strlen(m->msgid)
+		+ ((m->dst) ? strlen(m->dst) : 0)
+		+ ((m->spoolfile) ? strlen(m->spoolfile) : 0))
+		+ 12 * (m->parts + 1);
+}
+
+/*
+ *	Format records
+ */
+
+static int format_enqueue(struct message *m, char *buf)
+{
+	char *p = buf;
+	int i;
+
+	p += sprintf(p, "Q %ld ", m->jid);
+	p = jesc(p, m->msgid, strlen(m->msgid));
+	p += sprintf(p, " %ld ", (long)m->received);
+	p = jesc(p, m->spoolfile, (m->spoolfile) ? strlen(m->spoolfile) : 0);
+	*p++ = ' ';
+	p = jesc(p, m->dst, (m->dst) ? strlen(m->dst) : 0);
+	p += sprintf(p, " %d %d %d %d %d %d %d %d %d ",
+		m->is_binary, m->has_udh, m->pid, m->dcs, m->is_flash, m->request_report,
+		m->parts, m->concat_ref, m->concat_ref16);
+	if (m->part_ofs) {
+		for (i = 0; i <= m->parts; i++)
+			p += sprintf(p, (i) ? ",%d" : "%d", m->part_ofs[i]);
+	} else
+		*p++ = '-';
+	*p++ = ' ';
+	p = jesc(p, m->content, m->len);
+	*p++ = '\n';
+
+	return p - buf;
+}
+
+static int format_update(struct message *m, char *buf)
+{
+	return sprintf(buf, "A %ld %d %d %d %ld\n", m->jid, m->tries, m->parts_sent, m->retry_time, (long)m->next_try);
+}
+
+/*
+ *	Sync timer
+ */
+
+static void sync_timer_cb(struct ev_timer *t, void *arg)
+{
+	journal_sync();
+}
+
+/*
+ *	Give up journaling after an error. What was waiting for the
+ *	sync is done right away, as it would be without a journal.
+ */
+
+static void journal_fail(const char *what)
+{
+	hlog(LOG_ERR, "Could not %s journal %s: %s - continuing without a journal!", what, journal_file, strerror(errno));
+	close(jfd);
+	jfd = -1;
+	jdirty = 0;
+	journal_sync();
+}
+
+/*
+ *	Append a record: a single write
+ */
+
+static void jwrite(char *buf, int len)
+{
+	if (jfd < 0)
+		return;
+
+	if (write(jfd, buf, len) != len) {
+		journal_fail("write to");
+		return;
+	}
+
+	jrecords++;
+	stats_journal_records++;
+	if (!jdirty) {
+		jdirty = 1;
+		ev_timer_set(sync_timer, journal_sync_time);
+	}
+}
+
+/*
+ *	Record events
+ */
+
+void journal_enqueue(struct message *m)
+{
+	char *buf;
+	int len;
+
+	if (jfd < 0)
+		return;
+
+	m->jid = ++jid_last;
+	live_add(m);
+
+	buf = hmalloc(record_size(m));
+	len = format_enqueue(m, buf);
+	jwrite(buf, len);
+	hfree(buf);
+}
+
+void journal_update(struct message *m)
+{
+	char buf[128];
+
+	if (jfd < 0 || !m->jid)
+		return;
+
+	jwrite(buf, format_update(m, buf));
+}
+
+void journal_done(struct message *m, int delivered)
+{
+	char buf[64];
+
+	if (!m->jid)
+		return;
+
+	live_del(m);
+
+	if (jfd >= 0)
+		jwrite(buf, sprintf(buf, "%c %ld\n", (delivered) ? 'S' : 'D', m->jid));
+
+	m->jid = 0;
+}
+
+/*
+ *	Unlink files after the sync
+ */
+
+void journal_unlink(char *fn)
+{
+	struct junlink *u;
+
+	if (jfd < 0) {
+		if (unlink(fn))
+			hlog(LOG_ERR, "Could not unlink %s: %s", fn, strerror(errno));
+		return;
+	}
+
+	u = hmalloc(sizeof(*u));
+	u->fn = hstrdup(fn);
+	u->next = unlinks;
+	unlinks = u;
+
+	if (!jdirty) {
+		jdirty = 1;
+		ev_timer_set(sync_timer, journal_sync_time);
+	}
+}
+
+int journal_unlinking(char *fn)
+{
+	struct junlink *u;
+
+	for (u = unlinks; (u); u = u->next)
+		if (!strcmp(u->fn, fn))
+			return 1;
+
+	return 0;
+}
+
+/*
+ *	Sync the records written, then do what was waiting for it
+ */
+
+void journal_sync(void)
+{
+	struct junlink *u;
+
+	if (jfd >= 0 && jdirty) {
+		if (fdatasync(jfd)) {
+			journal_fail("sync");
+			return;
+		}
+		stats_journal_syncs++;
+	}
+	jdirty = 0;
+	if (sync_timer)
+		ev_timer_stop(sync_timer);
+
+	while ((u = unlinks)) {
+		unlinks = u->next;
+		if (unlink(u->fn) && errno != ENOENT)
+			hlog(LOG_ERR, "Could not unlink %s: %s", u->fn, strerror(errno));
+		hfree(u->fn);
+		hfree(u);
+	}
+
+	if (jfd >= 0 && jrecords >= journal_compact_records && jrecords >= 4 * live_count)
+		journal_compact();
+}
+
+/*
+ *	Sync the directory, so that a rename sticks
+ */
+
+static void sync_dir(char *fn)
+{
+	char *dir, *p;
+	int fd;
+
+	dir = hstrdup(fn);
+	if ((p = strrchr(dir, '/')))
+		*(p == dir ? p + 1 : p) = 0;
+	else
+		strcpy(dir, ".");
+
+	if ((fd = open(dir, O_RDONLY|O_CLOEXEC)) >= 0) {
+		if (fsync(fd))
+			hlog(LOG_ERR, "Could not sync directory %s: %s", dir, strerror(errno));
+		close(fd);
+	}
+
+	hfree(dir);
+}
+
+/*
+ *	Write a new journal with only the live messages in it, and
+ *	replace the old one with it
+ */
+
+static int journal_rewrite(void)
+{
+	struct message *m;
+	char *tmpf, *buf;
+	int fd, len, records = 0;
+
+	tmpf = hmalloc(strlen(journal_file) + 4 + 1);
+	sprintf(tmpf, "%s.tmp", journal_file);
+
+	if ((fd = open(tmpf, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, S_IRUSR|S_IWUSR)) < 0) {
+		hlog(LOG_ERR, "Could not create journal %s: %s", tmpf, strerror(errno));
+		hfree(tmpf);
+		return -1;
+	}
+
+	for (m = live; (m); m = m->jnext) {
+		buf = hmalloc(record_size(m));
+		len = format_enqueue(m, buf);
+		len += format_update(m, buf + len);
+		if (write(fd, buf, len) != len) {
+			hlog(LOG_ERR, "Could not write to journal %s: %s", tmpf, strerror(errno));
+			hfree(buf);
+			goto fail;
+		}
+		hfree(buf);
+		records += 2;
+	}
+
+	if (fsync(fd)) {
+		hlog(LOG_ERR, "Could not sync journal %s: %s", tmpf, strerror(errno));
+		goto fail;
+	}
+
+	if (close(fd)) {
+		hlog(LOG_ERR, "Could not close journal %s: %s", tmpf, strerror(errno));
+		fd = -1;
+		goto fail;
+	}
+
+	if (rename(tmpf, journal_file)) {
+		hlog(LOG_ERR, "Could not rename journal %s to %s: %s", tmpf, journal_file, strerror(errno));
+		fd = -1;
+		goto fail;
+	}
+	sync_dir(journal_file);
+
+	hfree(tmpf);
+	stats_journal_compactions++;
+
+	return records;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	if (unlink(tmpf))
+		hlog(LOG_ERR, "Could not unlink journal %s: %s", tmpf, strerror(errno));
+	hfree(tmpf);
+	return -1;
+}
+
+/*
+ *	Compact the journal while running
+ */
+
+static void journal_compact(void)
+{
+	int records;
+
+	hlog(LOG_DEBUG, "Compacting journal %s: %d records, %d messages", journal_file, jrecords, live_count);
+
+	if ((records = journal_rewrite()) < 0)
+		return;	/* keep appending to the old one */
+
+	close(jfd);
+	if ((jfd = open(journal_file, O_WRONLY|O_APPEND|O_CLOEXEC)) < 0) {
+		journal_fail("reopen");
+		return;
+	}
+	jrecords = records;
+}
+
+/*
+ *	Find a recovered message by its key, the list is in key order
+ */
+
+static struct message *find_jid(struct message **ms, int n, long jid)
+{
+	int lo = 0, hi = n - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ms[mid]->jid == jid)
+			return ms[mid];
+		if (ms[mid]->jid < jid)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Parse the Q record of a message
+ */
+
+static struct message *parse_enqueue(char **f, int n)
+{
+	struct message *m;
+	char *p;
+	int i, l;
+
+	if (n != 17)
+		return NULL;
+
+	m = alloc_message();
+	m->jid = atol(f[1]);
+	m->msgid = junesc_str(f[2]);
+	m->received = atol(f[3]);
+	m->spoolfile = junesc_str(f[4]);
+	m->dst = junesc_str(f[5]);
+	m->is_binary = atoi(f[6]);
+	m->has_udh = atoi(f[7]);
+	m->pid = atoi(f[8]);
+	m->dcs = atoi(f[9]);
+	m->is_flash = atoi(f[10]);
+	m->request_report = atoi(f[11]);
+	m->parts = atoi(f[12]);
+	m->concat_ref = atoi(f[13]);
+	m->concat_ref16 = atoi(f[14]);
+
+	if (strcmp(f[15], "-") && m->parts > 0 && m->parts <= 255) {
+		m->part_ofs = hmalloc((m->parts + 1) * sizeof(int));
+		for (i = 0, p = f[15]; i <= m->parts; i++) {
+			m->part_ofs[i] = atoi(p);
+			if ((p = strchr(p, ',')))
+				p++;
+			else if (i < m->parts)
+				break;
+		}
+		if (i <= m->parts) {
+			free_message(m);
+			return NULL;
+		}
+	}
+
+	l = junesc(f[16]);
+	m->len = (l < 0) ? 0 : l;
+	m->content = hmalloc(m->len + 1);
+	memcpy(m->content, f[16], m->len);
+	m->content[m->len] = 0;
+
+	if (m->parts < 1)
+		m->parts = 1;
+	if (!m->msgid || !m->dst || m->jid <= 0 || (m->parts > 1 && !m->part_ofs)
+	    || (m->part_ofs && m->part_ofs[m->parts] > m->len)) {
+		free_message(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+/*
+ *	Read the journal, and put the messages in it which are still
+ *	live to the MO queue. Returns the number of messages, -1 if the
+ *	journal could not be read.
+ */
+
+static int journal_recover(void)
+{
+	struct message **ms = NULL, *m;
+	int nms = 0, sms = 0;
+	char *f[MAX_FIELDS];
+	char *data, *line, *e, *p;
+	struct stat st;
+	int fd, n, i, live_n = 0, bad = 0;
+	long len, l;
+	time_t now = time(NULL);
+
+	if ((fd = open(journal_file, O_RDONLY|O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		hlog(LOG_ERR, "Could not open journal %s: %s", journal_file, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		hlog(LOG_ERR, "Could not stat journal %s: %s", journal_file, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	data = hmalloc(st.st_size + 1);
+	for (len = 0; len < st.st_size; len += l) {
+		if ((l = read(fd, data + len, st.st_size - len)) <= 0)
+			break;
+	}
+	data[len] = 0;
+	close(fd);
+
+	for (line = data; line < data + len; line = e + 1) {
+		if (!(e = strchr(line, '\n')))
+			break;	/* the last record did not make it */
+		*e = 0;
+
+		for (n = 0, p = line; n < MAX_FIELDS && (f[n] = strsep(&p, " ")); n++)
+			;
+
+		if (n >= 2 && !strcmp(f[0], "Q")) {
+			if (!(m = parse_enqueue(f, n)) || find_jid(ms, nms, m->jid)) {
+				if (m)
+					free_message(m);
+				bad++;
+				continue;
+			}
+			if (nms == sms) {
+				sms = (sms) ? sms * 2 : 64;
+				ms = hrealloc(ms, sms * sizeof(*ms));
+			}
+			/* keep them in key order, they normally come that way */
+			for (i = nms; i > 0 && ms[i-1]->jid > m->jid; i--)
+				ms[i] = ms[i-1];
+			ms[i] = m;
+			nms++;
+			if (m->jid > jid_last)
+				jid_last = m->jid;
+		} else if (n == 6 && !strcmp(f[0], "A")) {
+			if (!(m = find_jid(ms, nms, atol(f[1])))) {
+				bad++;
+				continue;
+			}
+			m->tries = atoi(f[2]);
+			m->parts_sent = atoi(f[3]);
+			m->retry_time = atoi(f[4]);
+			m->next_try = atol(f[5]);
+			if (m->parts_sent >= m->parts)
+				m->parts_sent = m->parts - 1;
+		} else if (n == 2 && (!strcmp(f[0], "S") || !strcmp(f[0], "D"))) {
+			if (!(m = find_jid(ms, nms, atol(f[1])))) {
+				bad++;
+				continue;
+			}
+			m->sending = 1;	/* here: delivered or dropped */
+		} else
+			bad++;
+	}
+
+	if (bad)
+		hlog(LOG_ERR, "Journal %s: %d bad records ignored", journal_file, bad);
+
+	for (i = 0; i < nms; i++) {
+		m = ms[i];
+		if (m->sending) {
+			free_message(m);
+			continue;
+		}
+
+		/* the spool file might not have been unlinked yet */
+		if (m->spoolfile && unlink(m->spoolfile) == 0)
+			hlog(LOG_INFO, "[%s] Removed spool file %s which was already in the journal", m->msgid, m->spoolfile);
+
+		if (m->next_try < now)
+			m->next_try = now;
+		live_add(m);
+		live_n++;
+
+		hlog(LOG_INFO, "[%s] QUEUE: Recovered from journal, to %s, %d tries made", m->msgid, m->dst, m->tries);
+		queue_message(m);
+	}
+
+	if (ms)
+		hfree(ms);
+	hfree(data);
+
+	return live_n;
+}
+
+/*
+ *	Start journaling
+ */
+
+int journal_open(void)
+{
+	int n, records;
+
+	if (!journal_file)
+		return -1;
+
+	if ((n = journal_recover()) < 0)
+		return -1;
+
+	/* start with a journal which has only the live messages */
+	if ((records = journal_rewrite()) < 0)
+		return -1;
+
+	if ((jfd = open(journal_file, O_WRONLY|O_APPEND|O_CLOEXEC)) < 0) {
+		hlog(LOG_ERR, "Could not open journal %s: %s", journal_file, strerror(errno));
+		return -1;
+	}
+	jrecords = records;
+
+	sync_timer = ev_timer_new(sync_timer_cb, NULL);
+
+	if (n)
+		hlog(LOG_NOTICE, "Recovered %d queued messages from journal %s", n, journal_file);
+	else
+		hlog(LOG_DEBUG, "Journaling MO queue to %s", journal_file);
+
+	return n;
+}
+
+void journal_close(void)
+{
+	if (jfd < 0)
+		return;
+
+	journal_sync();
+	if (jfd >= 0 && journal_rewrite() < 0)
+		hlog(LOG_ERR, "Could not compact journal %s at shutdown, it will be read as it is", journal_file);
+
+	if (jfd >= 0)
+		close(jfd);
+	jfd = -1;
+}
@@ -0,0 +1,50 @@
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "message.h"
+
+/*
+ *	Write-ahead journal of the MO queue. Every event of a message
+ *	is one appended line: Q (taken from the spool, with the whole
+ *	message), A (an attempt failed or a part went out, with the new
+ *	retry state), S (delivered) and D (dropped). The journal is synced
+ *	in batches, and spool files are unlinked only after the record of
+ *	their message has been synced. At startup the messages which were
+ *	not delivered or dropped are put back in the queue, and the journal
+ *	is rewritten with only them in it, which is also done every now
+ *	and then while running.
+ */
+
+extern char *journal_file;		/* journal file name, NULL: no journal */
+extern int journal_sync_time;		/* ms to collect records for one sync */
+extern int journal_compact_records;	/* records to write before compacting */
+
+extern long stats_journal_records;	/* records written */
+extern long stats_journal_syncs;	/* syncs done */
+extern long stats_journal_compactions;	/* compactions done */
+
+/* Recover the messages in the journal to the MO queue, and start
+ * journaling. Returns the number of messages recovered, -1 if the
+ * journal could not be used.
+ */
+extern int journal_open(void);
+
+/* Sync and compact the journal, and stop journaling */
+extern void journal_close(void);
+
+/* Record a new message, a change in its retry state, and its end */
+extern void journal_enqueue(struct message *m);
+extern void journal_update(struct message *m);
+extern void journal_done(struct message *m, int delivered);
+
+/* Unlink a file when the records written so far have been synced */
+extern void journal_unlink(char *fn);
+
+/* Check if a file is waiting to be unlinked */
+extern int journal_unlinking(char *fn);
+
+/* Sync now */
+extern void journal_sync(void);
+
+#endif
@@ -4,15 +4,33 @@
  *
  *	logging facility with configurable log levels and
  *	logging destinations
+ *
+ *	Once log_async_start() has been called, hlog() formats the line
+ *	and puts it in a ring buffer, and a writer thread takes the lines
+ *	from there in batches and writes them out. There is one producer
+ *	(the main thread) and one consumer (the writer), so the ring needs
+ *	no locks: the producer owns ring_head, the writer owns ring_tail.
+ *	A line which does not fit in the ring is dropped and counted.
  */
 
+/* for pipe2() */
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 
 #include "log.h"
 #include "hmalloc.h"
@@ -21,6 +39,10 @@ int log_dest = L_DEFDEST;	/* Logging destination */
 int log_level = LOG_INFO;	/* Logging level */
 int log_facility = LOG_LOCAL1;	/* Logging facility */
 char *log_name = NULL;		/* Logging name */
+char *log_file = NULL;		/* Log file, with L_FILE */
+
+long stats_log_lines = 0;	/* lines given to the writer */
+long stats_log_dropped = 0;	/* lines dropped, ring buffer full */
 
 char *log_levelnames[] = {
 	"EMERG",
@@ -41,6 +63,39 @@ char *log_destnames[] = {
 	NULL
 };
 
+static int log_fd = 2;		/* stderr, or the log file */
+
+/*
+ *	The ring buffer. A record is a header and the formatted line,
+ *	padded to LOG_ALIGN. A record never wraps around the end of the
+ *	buffer; if the next one would, a padding record fills the end.
+ */
+
+#define LOG_RING_SIZE	(256 * 1024)	/* a power of two */
+#define LOG_ALIGN	8
+#define LOG_PAD		0xff		/* priority of a padding record */
+#define LOG_IOV		64		/* lines per writev() */
+
+struct log_rec {
+	unsigned short len;		/* whole record, padded */
+	unsigned short line_len;	/* line, with the line feed */
+	unsigned char priority;
+	unsigned short msg_off;		/* "LEVEL: message" for syslog starts here */
+};
+
+#define REC_HDR		((sizeof(struct log_rec) + LOG_ALIGN - 1) & ~(LOG_ALIGN - 1))
+
+static char *ring;
+static atomic_ulong ring_head;		/* written up to here by hlog() */
+static atomic_ulong ring_tail;		/* written out up to here by the writer */
+static atomic_int writer_sleeping;
+static atomic_int writer_stop;
+static int wake_pipe[2] = { -1, -1 };
+static pthread_t writer;
+static int async = 0;
+static long dropped = 0;		/* dropped lines not reported yet */
+static volatile sig_atomic_t in_hlog = 0;
+
 /*
  *	Append a formatted string to a dynamically allocated string
  */
@@ -78,19 +133,21 @@ int pick_loglevel(char *s, char **names)
 	for (i = 0; (names[i]); i++)
 		if (!strcasecmp(s, names[i]))
 			return i;
-			
+	
 	return -1;
 }
 
 /*
  *	Open log
  */
- 
+
 int open_log(char *name)
 {
+	int fd;
+	
 	if (log_name)
 		hfree(log_name);
-		
+	
 	if (!(log_name = hstrdup(name))) {
 		fprintf(stderr, "m20d logger: out of memory!\n");
 		exit(1);
@@ -98,20 +155,220 @@ int open_log(char *name)
 	
 	if (log_dest & L_SYSLOG)
 		openlog(name, LOG_NDELAY|LOG_PID, log_facility);
-		
+	
+	if (log_dest & L_FILE) {
+		if ((fd = open(log_file, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644)) < 0) {
+			fprintf(stderr, "m20d logger: could not open %s: %s\n", log_file, strerror(errno));
+			return -1;
+		}
+		if (log_fd > 2)
+			close(log_fd);
+		log_fd = fd;
+	}
+	
 	return 0;
 }
 
 /*
- *	Log a message
+ *	Format a log line: time stamp, name, pid, level and the message.
+ *	localtime() is only asked once a second.
  */
 
-int hlog(int priority, const char *fmt, ...)
+static int log_format(char *s, int size, int priority, int *msg_off, const char *fmt, va_list args)
 {
-	va_list args;
-	char s[LOG_LEN];
+	static time_t last_t = 0;
+	static char tbuf[80];
 	time_t t;
 	struct tm *lt;
+	int l, m;
+	
+	time(&t);
+	if (t != last_t) {
+		lt = localtime(&t);
+		snprintf(tbuf, sizeof(tbuf), "%4.4d/%2.2d/%2.2d %2.2d:%2.2d:%2.2d",
+			lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday, lt->tm_hour, lt->tm_min, lt->tm_sec);
+		last_t = t;
+	}
+	
+	l = snprintf(s, size, "%s %s[%d] ", tbuf, (log_name) ? log_name : "m20d", (int)getpid());
+	if (l >= size - 2)
+		l = size - 2;
+	*msg_off = l;
+	m = snprintf(s + l, size - l, "%s: ", log_levelnames[priority]);
+	l += (m < size - l) ? m : size - l - 1;
+	m = vsnprintf(s + l, size - l - 1, fmt, args);
+	l += (m < size - l - 1) ? m : size - l - 2;
+	s[l++] = '\n';
+	s[l] = 0;
+	
+	return l;
+}
+
+/*
+ *	Write out a line, without the ring
+ */
+
+static void log_out(int priority, char *line, int len, int msg_off)
+{
+	if (log_dest & (L_STDERR|L_FILE))
+		if (write(log_fd, line, len) < 0)
+			return;
+	if (log_dest & L_SYSLOG) {
+		line[len - 1] = 0;
+		syslog(priority, "%s", line + msg_off);
+		line[len - 1] = '\n';
+	}
+}
+
+/*
+ *	Write out the records between tail and head, returns the new tail
+ */
+
+static unsigned long ring_write(unsigned long tail, unsigned long head)
+{
+	struct iovec iov[LOG_IOV];
+	struct log_rec *r;
+	char *line;
+	int n = 0;
+	
+	while (tail != head) {
+		r = (struct log_rec *)(ring + (tail & (LOG_RING_SIZE - 1)));
+		if (r->priority != LOG_PAD) {
+			line = (char *)r + REC_HDR;
+			if (log_dest & (L_STDERR|L_FILE)) {
+				iov[n].iov_base = line;
+				iov[n].iov_len = r->line_len;
+				n++;
+			}
+			if (log_dest & L_SYSLOG) {
+				line[r->line_len - 1] = 0;
+				syslog(r->priority, "%s", line + r->msg_off);
+				line[r->line_len - 1] = '\n';
+			}
+		}
+		tail += r->len;
+	
+		if (n == LOG_IOV || (n && tail == head)) {
+			if (writev(log_fd, iov, n) < 0) {
+				/* nowhere to complain, keep going */
+			}
+			n = 0;
+		}
+	}
+	
+	if (n && writev(log_fd, iov, n) < 0) {
+		/* nowhere to complain */
+	}
+	
+	return tail;
+}
+
+/*
+ *	The writer thread
+ */
+
+static void *log_writer(void *arg)
+{
+	unsigned long head, tail;
+	struct pollfd pfd;
+	char buf[64];
+	
+	pfd.fd = wake_pipe[0];
+	pfd.events = POLLIN;
+	
+	for (;;) {
+		tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+		head = atomic_load_explicit(&ring_head, memory_order_acquire);
+	
+		if (tail != head) {
+			tail = ring_write(tail, head);
+			atomic_store_explicit(&ring_tail, tail, memory_order_release);
+			continue;
+		}
+	
+		if (atomic_load(&writer_stop))
+			break;
+	
+		/* hlog() wakes us up if it sees that we are sleeping */
+		atomic_store(&writer_sleeping, 1);
+		if (atomic_load(&ring_head) == tail && !atomic_load(&writer_stop))
+			poll(&pfd, 1, 1000);
+		atomic_store(&writer_sleeping, 0);
+		while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+			;
+	}
+	
+	return NULL;
+}
+
+/*
+ *	Put a formatted line in the ring, returns -1 if there is no room
+ */
+
+static int ring_put(int priority, char *line, int len, int msg_off)
+{
+	unsigned long head, tail, pos;
+	unsigned int need, room;
+	struct log_rec *r;
+	
+	need = (REC_HDR + len + LOG_ALIGN - 1) & ~(LOG_ALIGN - 1);
+	head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+	pos = head & (LOG_RING_SIZE - 1);
+	
+	/* pad to the end of the buffer if the record would wrap */
+	room = LOG_RING_SIZE - pos;
+	if (room < need) {
+		if (LOG_RING_SIZE - (head - tail) < room + need)
+			return -1;
+		r = (struct log_rec *)(ring + pos);
+		r->len = room;
+		r->priority = LOG_PAD;
+		head += room;
+		pos = 0;
+	} else if (LOG_RING_SIZE - (head - tail) < need) {
+		return -1;
+	}
+	
+	r = (struct log_rec *)(ring + pos);
+	r->len = need;
+	r->line_len = len;
+	r->priority = priority;
+	r->msg_off = msg_off;
+	memcpy((char *)r + REC_HDR, line, len);
+	
+	atomic_store_explicit(&ring_head, head + need, memory_order_release);
+	stats_log_lines++;
+	
+	if (atomic_exchange(&writer_sleeping, 0))
+		if (write(wake_pipe[1], "", 1) < 0) {
+			/* the pipe is full, the writer is awake anyway */
+		}
+	
+	return 0;
+}
+
+static int log_line(char *s, int priority, const char *fmt, ...)
+{
+	va_list args;
+	int l, off;
+	
+	va_start(args, fmt);
+	l = log_format(s, LOG_LEN, priority, &off, fmt, args);
+	va_end(args);
+	
+	return ring_put(priority, s, l, off);
+}
+
+/*
+ *	Log a message, called through the hlog() macro
+ */
+
+int hlog_emit(int priority, const char *fmt, ...)
+{
+	va_list args;
+	char s[LOG_LEN];
+	int l, off;
 	
 	if (priority > 7)
 		priority = 7;
@@ -122,22 +379,112 @@ int hlog(int priority, const char *fmt, ...)
 		return 0;
 	
 	va_start(args, fmt);
-	vsnprintf(s, LOG_LEN, fmt, args);
+	l = log_format(s, LOG_LEN, priority, &off, fmt, args);
 	va_end(args);
 	
-	if (log_dest & L_STDERR) {
-		time(&t);
-		lt = localtime(&t);
-		fprintf(stderr, "%4.4d/%2.2d/%2.2d %2.2d:%2.2d:%2.2d %s[%d] %s: %s\n",
-			lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday, lt->tm_hour, lt->tm_min, lt->tm_sec,
-			(log_name) ? log_name : "m20d", (int)getpid(), log_levelnames[priority], s);
+	/* a signal handler logging in the middle of hlog() writes directly */
+	if (!async || in_hlog) {
+		log_out(priority, s, l, off);
+		return 1;
 	}
-	if (log_dest & L_SYSLOG)
-		syslog(priority, "%s: %s", log_levelnames[priority], s);
+	
+	in_hlog = 1;
+	if (dropped) {
+		char d[LOG_LEN];
+		if (log_line(d, LOG_WARNING, "Log buffer was full, dropped %ld lines", dropped) == 0)
+			dropped = 0;
+	}
+	if (ring_put(priority, s, l, off)) {
+		dropped++;
+		stats_log_dropped++;
+	}
+	in_hlog = 0;
 	
 	return 1;
 }
 
+/*
+ *	Write out what is left in the ring after a crash, and die
+ *	of the signal
+ */
+
+static void log_crash(int sig)
+{
+	unsigned long tail, head;
+	
+	tail = atomic_load(&ring_tail);
+	head = atomic_load(&ring_head);
+	if (head - tail <= LOG_RING_SIZE)
+		ring_write(tail, head);
+	
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/*
+ *	Start the writer thread. Call after forking to the background,
+ *	as the thread does not follow a fork().
+ */
+
+int log_async_start(void)
+{
+	sigset_t set, old;
+	int i;
+	
+	if (async)
+		return 0;
+	
+	if (pipe2(wake_pipe, O_CLOEXEC|O_NONBLOCK)) {
+		hlog(LOG_ERR, "Logger: pipe failed, logging synchronously: %s", strerror(errno));
+		return -1;
+	}
+	
+	ring = hmalloc(LOG_RING_SIZE);
+	
+	/* signals are for the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	i = pthread_create(&writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (i) {
+		hlog(LOG_ERR, "Logger: could not start the writer thread, logging synchronously: %s", strerror(i));
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		hfree(ring);
+		return -1;
+	}
+	
+	async = 1;
+	atexit(log_async_stop);
+	signal(SIGSEGV, log_crash);
+	signal(SIGBUS, log_crash);
+	signal(SIGABRT, log_crash);
+	signal(SIGFPE, log_crash);
+	
+	return 0;
+}
+
+/*
+ *	Write out what is in the ring and stop the writer thread
+ */
+
+void log_async_stop(void)
+{
+	if (!async)
+		return;
+	
+	atomic_store(&writer_stop, 1);
+	if (write(wake_pipe[1], "", 1) < 0) {
+		/* awake anyway */
+	}
+	pthread_join(writer, NULL);
+	async = 0;
+	
+	if (dropped)
+		hlog(LOG_WARNING, "Log buffer was full, dropped %ld lines", dropped);
+	dropped = 0;
+}
+
 /*
  *	Write my PID to file
  */
@@ -146,7 +493,7 @@ int writepid(char *name)
 {
 	FILE *f;
 	
-	if (!(f = fopen(name, "w"))) {
+	if (!(f = fopen(name, "we"))) {
 		hlog(LOG_ERR, "Could not open %s for writing: %s",
 			name, strerror(errno));
 		return -1;
@@ -165,4 +512,3 @@ int writepid(char *name)
 	}
 	return 0;
 }
-
@@ -6,11 +6,12 @@
 
 #define L_STDERR        1  /* Log to stderror */
 #define L_SYSLOG        2  /* Log to syslog */
+#define L_FILE          4  /* Log to log_file */
 
 #define L_DEFDEST	(L_STDERR)
 
 #define LOG_LEVELS "emerg alert crit err warning notice info debug"
-#define LOG_DESTS "syslog stderr"
+#define LOG_DESTS "syslog stderr <file path>"
 
 #include <syslog.h>
 
@@ -19,12 +20,38 @@ extern char *log_destnames[];
 
 extern int log_dest;     /* Logging destination */
 extern int log_level;	 /* Logging level */
+extern char *log_file;	 /* Log file, with L_FILE */
+
+extern long stats_log_lines;	/* lines given to the writer thread */
+extern long stats_log_dropped;	/* lines dropped, ring buffer full */
 
 extern char *str_append(char *s, const char *fmt, ...);
 
 extern int pick_loglevel(char *s, char **names);
 extern int open_log(char *name);
-extern int hlog(int priority, const char *fmt, ...);
+extern int hlog_emit(int priority, const char *fmt, ...);
+
+/* Levels above LOG_MIN_LEVEL are left out of the binary altogether,
+ * build with -DLOG_MIN_LEVEL=LOG_INFO to drop the debug lines.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+/* Is a line of this level written out. Check this before doing
+ * work only needed for the log line, such as escaping message content.
+ */
+#define hlog_on(priority) ((priority) <= LOG_MIN_LEVEL && (priority) <= log_level)
+
+/* The arguments are only evaluated if the line is written out */
+#define hlog(priority, ...) \
+	do { if (hlog_on(priority)) hlog_emit(priority, __VA_ARGS__); } while (0)
+
+/* Write the log from a thread of its own, log_async_stop() writes out
+ * what is left. Start it after forking a daemon.
+ */
+extern int log_async_start(void);
+extern void log_async_stop(void);
 
 extern int writepid(char *name);
 
@@ -22,7 +22,6 @@
  *
  */
 
-
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
@@ -41,12 +40,24 @@
 #ifndef __sun__
 #include <getopt.h>
 #endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "log.h"
 #include "hmalloc.h"
 #include "charset.h"
 #include "message.h"
 #include "device.h"
+#include "septet.h"
+#include "event.h"
+#include "atcmd.h"
+#include "modem.h"
+#include "concat.h"
+#include "journal.h"
+#include "handler.h"
+#include "timeline.h"
+#include "metrics.h"
 
 /* Default settings */
 
@@ -77,16 +88,19 @@ int transmit_timeout = 60000;	/* MO transmit timeout, ms ! */
 int register_timeout = 60000;	/* Network registration timeout (from AT+CPIN to OK), ms ! */
 int retry_sleep = 10;		/* module reconnection delay time: seconds */
 int poll_time = 30;		/* module poll time: seconds */
+int drain_slice = 10000;	/* MO backlog: send back to back this long before polling, ms ! */
+int mt_commit_delay = 50;	/* MT: collect spool files this long for one sync, ms ! */
+int state_interval = 10;	/* state file rewrite interval unless going up or down, seconds */
 int mo_queue_max_tries = 4;	/* mo max tries */
 int mo_queue_init_retryt = 10;	/* mo initial retry time: seconds */
 float mo_queue_retry_mult = 3;	/* retry time multiplicator at each retry */
 int mo_queue_max_retryt = 300;	/* mo max retry time: seconds */
 int fork_a_daemon = 0;		/* fork a daemon */
+int concat_ref16 = 0;		/* concatenated MO: use 16-bit reference numbers */
 
 char *spool_dir = DEF_SPOOLDIR;
 char *outhandler = DEF_HANDLER;
 char *pidfile = NULL;
-char *statefile = NULL;
 
 /*
  * ********************
@@ -95,36 +109,27 @@ char *statefile = NULL;
  */
 
 int shutting_down = 0;		/* a shutdown is queued */
+int journaling = 0;		/* MO queue is kept in the journal */
 
 long stats_mt = 0;		/* received MT messages */
 long stats_mt_ok = 0;		/* MT: successfully handled messages */
 long stats_mt_fail = 0;		/* MT: unsuccessfully handled messages */
 long stats_mt_fail_parse = 0;	/* MT: PDU parsing failures */
 long stats_mt_fail_handle = 0;	/* MT: Handler failures */
+long stats_mt_deferred = 0;	/* MT: left unacknowledged while the handlers are behind */
+long stats_mt_commits = 0;	/* MT: spool syncs which succeeded */
+long stats_mt_committed = 0;	/* MT: spool files made durable by them */
 long stats_mo = 0;		/* MO: messages taken for delivery */
 long stats_mo_ok = 0;		/* MO: successfully delivered */
 long stats_mo_tries = 0;	/* MO: delivery attempts made */
 long stats_mo_try_fail = 0;	/* MO: delivery attempts failed */
 long stats_mo_dropped = 0;	/* MO: messages dropped */
-
-/*
- *	running state
- */
-
-#define STATE_UNDEFINED		0
-#define STATE_DOWN_INIT		1
-#define STATE_DOWN_CONNECTING	2
-#define STATE_DOWN_HANDSHAKING	3
-#define STATE_DOWN_NONETWORK	4
-#define STATE_DOWN_RETRYSLEEP	5
-#define STATE_DOWN_SHUTTINGDOWN	6
-#define STATE_DOWN_SHUTDOWN	7
-#define STATE_DOWN_FAILQUIT	8
-#define STATE_UP		9
-#define STATE_UP_SLEEPING	9
-#define STATE_UP_SENDING_MO	10
-#define STATE_UP_POLLING	11
-#define STATE_MAX		12
+long stats_spool_backlog = 0;	/* MO: gauge: spool files waiting to be sent */
+long stats_mo_drains = 0;	/* MO: back-to-back sending periods */
+long stats_mo_drained = 0;	/* MO: messages delivered back to back */
+long stats_mo_drain_ms = 0;	/* MO: time spent sending back to back, ms */
+long stats_state_changes = 0;	/* state changes made */
+long stats_state_writes = 0;	/* state files written */
 
 static char *state_strings[] = {
 	"DOWN/UNDEFINED",
@@ -142,20 +147,35 @@ static char *state_strings[] = {
 	NULL
 };
 
-int running_state = STATE_UNDEFINED;
-char *last_message = NULL;
-char *net_status = NULL;
+struct modem *modems = NULL;		/* all modules */
+int modem_count = 0;			/* number of modules */
+int exit_code = 0;			/* exit code of the last module given up on */
+long mo_seq = 0;			/* MO dispatch sequence */
+
+/*
+ *	shared event loop state
+ */
+
+struct ev_timer *retry_timer;		/* next MO retry deadline */
+struct ev_timer *spool_timer;		/* spool directory scan */
+int spool_watch_fd = -1;		/* inotify watch on the spool directory */
+
+long spool_oldest_age(void);
+int mo_work_waiting(void);
+long ms_since(struct timespec *t);
+int mt_parse_pdu(struct message *m, char *pdu);
 
 /*
- *	response sets to expect
+ *	Translate state to string
  */
 
-char *expect_errors[] = { "ERROR", NULL };
-char *expect_ok[] = { "OK", NULL };
-char *expect_ok_or_mt[] = { "OK", "+CMT:", "+CDS:", "+CBM:", NULL };
-char *expect_mt[] = { "+CMT:", "+CDS:", "+CBM:", NULL };
-char *expect_mo_transmit[] = { ">", "+CMT:", "+CDS:", "+CBM:", NULL };
-char *expect_linefeed[] = { "\n", NULL };
+char *statestring(int state)
+{
+	if (state < 0 || state >= STATE_MAX) {
+		state = STATE_UNDEFINED;
+	}
+	return state_strings[state];
+}
 
 /*
  *	Log statistics counters
@@ -163,30 +183,135 @@ char *expect_linefeed[] = { "\n", NULL };
 
 void log_stats(void)
 {
+	struct modem *md;
+	struct tl_stage *s;
+	int i;
+	
 	hlog(LOG_NOTICE, "STATS mt=%ld mt_ok=%ld mt_fail=%ld mt_fail_parse=%ld mt_fail_handle=%ld"
 		" mo=%ld mo_ok=%ld mo_dropped=%ld mo_tries=%ld mo_try_fails=%ld mo_queued=%ld mo_queue_len=%ld",
 		stats_mt, stats_mt_ok, stats_mt_fail, stats_mt_fail_parse, stats_mt_fail_handle,
 		stats_mo, stats_mo_ok, stats_mo_dropped, stats_mo_tries, stats_mo_try_fail, stats_mo_queued, stats_mo_queue_len);
+	hlog(LOG_NOTICE, "STATS concat_parts=%ld concat_hits=%ld concat_done=%ld concat_timeouts=%ld concat_evictions=%ld"
+		" concat_sets=%ld concat_mem=%ld",
+		stats_concat_parts, stats_concat_hits, stats_concat_done, stats_concat_timeouts, stats_concat_evictions,
+		stats_concat_sets, stats_concat_mem);
+	hlog(LOG_NOTICE, "STATS mt_commits=%ld mt_committed=%ld",
+		stats_mt_commits, stats_mt_committed);
+	hlog(LOG_NOTICE, "STATS spool_backlog=%ld spool_oldest_age=%ld",
+		stats_spool_backlog, spool_oldest_age());
+	hlog(LOG_NOTICE, "STATS mo_drains=%ld mo_drained=%ld mo_drain_ms=%ld mo_drain_rate=%.2f",
+		stats_mo_drains, stats_mo_drained, stats_mo_drain_ms,
+		(stats_mo_drain_ms) ? stats_mo_drained * 1000.0 / stats_mo_drain_ms : 0.0);
+	hlog(LOG_NOTICE, "STATS handler_jobs=%ld handler_fail=%ld handler_timeouts=%ld handler_restarts=%ld handler_waiting=%ld"
+		" handler_running=%ld handler_backlogs=%ld mt_deferred=%ld",
+		stats_handler_jobs, stats_handler_fail, stats_handler_timeouts, stats_handler_restarts, stats_handler_waiting,
+		stats_handler_running, stats_handler_backlogs, stats_mt_deferred);
+	hlog(LOG_NOTICE, "STATS handler_ms_le%d=%ld handler_ms_le%d=%ld handler_ms_le%d=%ld handler_ms_le%d=%ld"
+		" handler_ms_inf=%ld handler_ms_max=%ld",
+		handler_hist_limits[0], stats_handler_runtime[0], handler_hist_limits[1], stats_handler_runtime[1],
+		handler_hist_limits[2], stats_handler_runtime[2], handler_hist_limits[3], stats_handler_runtime[3],
+		stats_handler_runtime[4], stats_handler_runtime_max);
+	for (i = 0; i < TS_STAGES; i++) {
+		s = &tl_stages[i];
+		if (!s->h.count)
+			continue;
+		hlog(LOG_NOTICE, "STATS %s_ms_le%d=%ld %s_ms_le%d=%ld %s_ms_le%d=%ld %s_ms_le%d=%ld %s_ms_le%d=%ld"
+			" %s_ms_inf=%ld %s_ms_max=%.1f",
+			s->name, tl_hist_limits[0], s->h.bucket[0], s->name, tl_hist_limits[1], s->h.bucket[1],
+			s->name, tl_hist_limits[2], s->h.bucket[2], s->name, tl_hist_limits[3], s->h.bucket[3],
+			s->name, tl_hist_limits[4], s->h.bucket[4], s->name, s->h.bucket[5], s->name, s->h.max);
+	}
+	hlog(LOG_NOTICE, "STATS state_changes=%ld state_writes=%ld",
+		stats_state_changes, stats_state_writes);
+	hlog(LOG_NOTICE, "STATS log_lines=%ld log_dropped=%ld",
+		stats_log_lines, stats_log_dropped);
+	hlog(LOG_NOTICE, "STATS journal_records=%ld journal_syncs=%ld journal_compactions=%ld",
+		stats_journal_records, stats_journal_syncs, stats_journal_compactions);
+	
+	if (modem_count > 1) {
+		for (md = modems; (md); md = md->next)
+			hlog(LOG_NOTICE, "STATS module %s state=%s mt=%ld mo_ok=%ld mo_try_fails=%ld",
+				md->device, statestring(md->state), md->stats_mt, md->stats_mo_ok, md->stats_mo_try_fail);
+	}
 }
 
 /*
- *	Translate state to string
+ *	Answer a metrics request
  */
 
-char *statestring(int state)
+void write_metrics(FILE *f)
 {
-	if (state < 0 || state >= STATE_MAX) {
-		state = STATE_UNDEFINED;
-	}
-	return state_strings[state];
+	struct modem *md;
+	int i;
+	
+	metrics_counter(f, "mt_total", "Received MT messages", stats_mt);
+	metrics_counter(f, "mt_ok_total", "MT messages handled", stats_mt_ok);
+	metrics_counter(f, "mt_fail_total", "MT messages which could not be handled", stats_mt_fail);
+	metrics_counter(f, "mt_fail_parse_total", "MT PDUs which could not be parsed", stats_mt_fail_parse);
+	metrics_counter(f, "mt_fail_handle_total", "MT messages which could not be given to the handler", stats_mt_fail_handle);
+	metrics_counter(f, "mt_deferred_total", "MT messages left while the handlers were behind", stats_mt_deferred);
+	metrics_counter(f, "mt_commits_total", "MT spool syncs", stats_mt_commits);
+	metrics_counter(f, "mt_committed_total", "MT spool files synced", stats_mt_committed);
+	metrics_counter(f, "mo_total", "MO messages taken for delivery", stats_mo);
+	metrics_counter(f, "mo_ok_total", "MO messages delivered", stats_mo_ok);
+	metrics_counter(f, "mo_dropped_total", "MO messages dropped", stats_mo_dropped);
+	metrics_counter(f, "mo_tries_total", "MO delivery attempts", stats_mo_tries);
+	metrics_counter(f, "mo_try_fails_total", "MO delivery attempts failed", stats_mo_try_fail);
+	metrics_counter(f, "mo_queued_total", "MO messages queued for a retry", stats_mo_queued);
+	metrics_gauge(f, "mo_queue_len", "MO messages in the retry queue", stats_mo_queue_len);
+	metrics_gauge(f, "spool_backlog", "MO spool files waiting", stats_spool_backlog);
+	metrics_gauge(f, "spool_oldest_age_seconds", "Age of the oldest MO spool file waiting", spool_oldest_age());
+	metrics_counter(f, "mo_drains_total", "MO back-to-back sending periods", stats_mo_drains);
+	metrics_counter(f, "mo_drained_total", "MO messages sent back to back", stats_mo_drained);
+	metrics_counter(f, "concat_parts_total", "MT parts taken for reassembly", stats_concat_parts);
+	metrics_counter(f, "concat_done_total", "MT messages reassembled", stats_concat_done);
+	metrics_counter(f, "concat_timeouts_total", "Incomplete MT messages flushed after the timeout", stats_concat_timeouts);
+	metrics_counter(f, "concat_evictions_total", "Incomplete MT messages flushed to stay within the memory budget", stats_concat_evictions);
+	metrics_gauge(f, "concat_sets", "MT messages waiting for parts", stats_concat_sets);
+	metrics_gauge(f, "concat_mem_bytes", "Memory held by MT parts waiting", stats_concat_mem);
+	metrics_counter(f, "handler_jobs_total", "MT messages given to handlers", stats_handler_jobs);
+	metrics_counter(f, "handler_fail_total", "MT messages the handlers failed", stats_handler_fail);
+	metrics_counter(f, "handler_timeouts_total", "Handlers killed for taking too long", stats_handler_timeouts);
+	metrics_counter(f, "handler_restarts_total", "Handler workers restarted", stats_handler_restarts);
+	metrics_counter(f, "handler_backlogs_total", "Times MT was held back for the handlers", stats_handler_backlogs);
+	metrics_gauge(f, "handler_waiting", "MT messages waiting for a handler", stats_handler_waiting);
+	metrics_gauge(f, "handler_running", "Handler processes running", stats_handler_running);
+	metrics_counter(f, "journal_records_total", "MO journal records written", stats_journal_records);
+	metrics_counter(f, "journal_syncs_total", "MO journal syncs", stats_journal_syncs);
+	metrics_counter(f, "state_changes_total", "Module state changes", stats_state_changes);
+	metrics_counter(f, "state_writes_total", "State files written", stats_state_writes);
+	metrics_counter(f, "log_lines_total", "Log lines written", stats_log_lines);
+	metrics_counter(f, "log_dropped_total", "Log lines dropped", stats_log_dropped);
+	
+	metrics_family(f, "module_state", "State of a module, see the state file for the names", "gauge");
+	for (md = modems; (md); md = md->next)
+		metrics_value(f, "module_state", "module", md->device, md->state);
+	metrics_family(f, "module_mt_total", "MT messages received by a module", "counter");
+	for (md = modems; (md); md = md->next)
+		metrics_value(f, "module_mt_total", "module", md->device, md->stats_mt);
+	metrics_family(f, "module_mo_ok_total", "MO messages delivered by a module", "counter");
+	for (md = modems; (md); md = md->next)
+		metrics_value(f, "module_mo_ok_total", "module", md->device, md->stats_mo_ok);
+	metrics_family(f, "module_mo_try_fails_total", "MO delivery attempts failed on a module", "counter");
+	for (md = modems; (md); md = md->next)
+		metrics_value(f, "module_mo_try_fails_total", "module", md->device, md->stats_mo_try_fail);
+	
+	/* mo_total is the MO end-to-end latency, mt_handler the handler runtime */
+	metrics_family(f, "stage_seconds", "Time messages spend in each stage", "histogram");
+	for (i = 0; i < TS_STAGES; i++)
+		metrics_hist(f, "stage_seconds", "stage", tl_stages[i].name, &tl_stages[i].h);
+	metrics_family(f, "at_command_seconds", "AT command round trip, written to final result", "histogram");
+	for (i = 0; i < at_rtt_count; i++)
+		metrics_hist(f, "at_command_seconds", "command", at_rtts[i].cmd, &at_rtts[i].h);
 }
 
 /*
  *	Write state file
  */
 
-int write_statefile(char *fname)
+int write_statefile(struct modem *md)
 {
+	char *fname = md->statefile;
 	char *tmpf;
 	int fd;
 	FILE *f;
@@ -196,8 +321,8 @@ int write_statefile(char *fname)
 	tmpf = hmalloc(strlen(fname) + 4 + 1);
 	sprintf(tmpf, "%s.tmp", fname);
 	
-	fd = open(tmpf, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-	if (f < 0) {
+	fd = open(tmpf, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0) {
 		hlog(LOG_ERR, "Could not create temporary state file %s: %s", tmpf, strerror(errno));
 		hfree(tmpf);
 		return -1;
@@ -215,10 +340,14 @@ int write_statefile(char *fname)
 	time(&t);
 	rt = gmtime(&t);
 	
-	fprintf(f, "State: %s\n", statestring(running_state));
-	fprintf(f, "Message: %s\n", (last_message) ? last_message : "No message");
-	if (net_status)
-		fprintf(f, "Network: %s\n", net_status);
+	fprintf(f, "State: %s\n", statestring(md->state));
+	if (modem_count > 1)
+		fprintf(f, "Device: %s\n", md->device);
+	fprintf(f, "Message: %s\n", (md->last_message) ? md->last_message : "No message");
+	if (md->net_status)
+		fprintf(f, "Network: %s\n", md->net_status);
+	if (stats_spool_backlog)
+		fprintf(f, "Spool: %ld files waiting, oldest %ld s\n", stats_spool_backlog, spool_oldest_age());
 	fprintf(f, "Updated: %02d/%02d/%02d %d:%02d:%02d UTC %ld\n",
 		rt->tm_year % 100, rt->tm_mon + 1, rt->tm_mday,
 		rt->tm_hour, rt->tm_min, rt->tm_sec,
@@ -240,35 +369,91 @@ int write_statefile(char *fname)
 		return -1;
 	}
 	
+	hfree(tmpf);
+	stats_state_writes++;
+	clock_gettime(CLOCK_MONOTONIC, &md->state_written);
+	
 	return 0;
 }
 
+void state_timer_cb(struct ev_timer *t, void *arg)
+{
+	write_statefile(arg);
+}
+
+/*
+ *	Publish the state in the state map, counting a change if there was one
+ */
+
+void publish_state(struct modem *md, int changed)
+{
+	struct statemap *sm = md->statemap;
+	
+	if (!sm)
+		return;
+	
+	statemap_begin(sm);
+	sm->state = md->state;
+	strncpy(sm->state_name, statestring(md->state), sizeof(sm->state_name) - 1);
+	strncpy(sm->device, md->device, sizeof(sm->device) - 1);
+	strncpy(sm->message, (md->last_message) ? md->last_message : "", sizeof(sm->message) - 1);
+	strncpy(sm->network, (md->net_status) ? md->net_status : "", sizeof(sm->network) - 1);
+	sm->updated = time(NULL);
+	sm->changes += changed;
+	sm->spool_backlog = stats_spool_backlog;
+	sm->spool_oldest_age = (stats_spool_backlog) ? spool_oldest_age() : 0;
+	sm->mo_queue_len = stats_mo_queue_len;
+	sm->mt = md->stats_mt;
+	sm->mo_ok = md->stats_mo_ok;
+	sm->mo_try_fail = md->stats_mo_try_fail;
+	statemap_end(sm);
+}
+
 /*
  *	State change
  */
 
-void state_change(int new_state, const char *fmt, ...)
+void state_change(struct modem *md, int new_state, const char *fmt, ...)
 {
 	va_list args;
 	char s[LOG_LEN];
+	int transition;
+	long delay;
 	
 	if (fmt) {
 		va_start(args, fmt);
 		vsnprintf(s, LOG_LEN, fmt, args);
 		va_end(args);
 		
-		if (last_message)
-			hfree(last_message);
-		last_message = hstrdup(s);
+		if (md->last_message)
+			hfree(md->last_message);
+		md->last_message = hstrdup(s);
 	}
 	
-	if (running_state != new_state) {
-		hlog(LOG_DEBUG, "Changing state from %s to %s", statestring(running_state), statestring(new_state));
+	if (md->state != new_state) {
+		hlog(LOG_DEBUG, "%s: Changing state from %s to %s", md->device, statestring(md->state), statestring(new_state));
 	}
 	
-	running_state = new_state;
+	/* a module going up or down, and the final states, are written
+	 * out right away; the sleeping - polling - sending round of a
+	 * running one and the connecting - registering steps of one which
+	 * is down at most once every state_interval seconds
+	 */
+	transition = ((md->state >= STATE_UP) != (new_state >= STATE_UP)
+		|| (md->state != new_state && (new_state == STATE_DOWN_SHUTDOWN || new_state == STATE_DOWN_FAILQUIT)));
+	
+	md->state = new_state;
+	stats_state_changes++;
+	publish_state(md, 1);
 	
-	write_statefile(statefile);
+	if (transition || state_interval <= 0 || !md->state_timer) {
+		if (md->state_timer)
+			ev_timer_stop(md->state_timer);
+		write_statefile(md);
+	} else if (ev_timer_left(md->state_timer) < 0) {
+		delay = state_interval * 1000 - ms_since(&md->state_written);
+		ev_timer_set(md->state_timer, (delay > 0) ? delay : 0);
+	}
 }
 
 /*
@@ -295,8 +480,10 @@ void sig_handler(int sig)
 	default:
 		log_stats();
 		hlog(LOG_CRIT, "Received signal %d, quitting NOW.", s);
-		if (stats_mo_queue_len)
-			hlog(LOG_ERR, "Lost %d queued messages!", stats_mo_queue_len);
+		if (stats_mo_queue_len && journaling)
+			hlog(LOG_NOTICE, "%ld queued messages are in the journal", stats_mo_queue_len);
+		else if (stats_mo_queue_len)
+			hlog(LOG_ERR, "Lost %ld queued messages!", stats_mo_queue_len);
 		exit(0);
 	}
 }
@@ -312,18 +499,54 @@ void print_version(void)
 
 void print_help(void)
 {
-	fprintf(stderr, "usage: " PROGNAME " [-n <logname>] [-d <device>] [-b <speed>] [-p <pin>]\n" \
+	fprintf(stderr, "usage: " PROGNAME " [-n <logname>] [-d <device> ...] [-b <speed>] [-p <pin>]\n" \
 		"\t[-s <spooldir>] [-a <handler>] [-x <pidfile>]\n" \
 		"\t[-t <cmd timeout>] [-l <reconnect delay>] [-i <poll interval>]\n" \
 		"\t[-e <loglevel>] [-o <logdest>] [-f (fork)] [-r (trace)]\n" \
 		"\t[-1 <initial retry time>] [-2 <retry time multiplicator>]\n" \
-		"\t[-3 <max retry count>]\n" \
+		"\t[-3 <max retry count>] [-P <AT commands in flight>]\n" \
+		"\t[-R <concatenated MO reference bits: 8 or 16>]\n" \
+		"\t[-c <MT reassembly timeout>] [-M <MT reassembly memory, kB>]\n" \
+		"\t[-j <MO queue journal>] [-J <journal sync delay, ms>]\n" \
+		"\t[-D <MO backlog time slice between polls, ms, 0: poll after each MO>]\n" \
+		"\t[-C <MT spool sync delay, ms>]\n" \
+		"\t[-w <persistent handler workers, 0: run handler for each MT>]\n" \
+		"\t[-W <handler timeout per message, s>]\n" \
+		"\t[-H <handler processes at a time without workers>]\n" \
+		"\t[-Q <MT messages waiting for a handler before MT is held back>]\n" \
+		"\t[-m <metrics: port on 127.0.0.1, or /path of a Unix socket>]\n" \
+		"\t[-S <state file rewrite interval unless going up or down, s, 0: on every change>]\n" \
 		"defaults: device " DEF_DEVICE " pin " DEF_PIN "\n" \
+		"\tgive -d multiple times to drive several modules\n" \
 		"\tspool " DEF_SPOOLDIR " handler " DEF_HANDLER "\n" \
 		"log levels: " LOG_LEVELS "\n" \
 		"log destinations: " LOG_DESTS "\n");
 }
 
+/*
+ *	Add a module to drive
+ */
+
+struct modem *add_modem(char *dev)
+{
+	struct modem *md, **prevp;
+	
+	md = hmalloc(sizeof(*md));
+	memset(md, 0, sizeof(*md));
+	md->device = hstrdup(dev);
+	md->fd = -1;
+	md->state = STATE_UNDEFINED;
+	md->op_status = OP_RUNNING;
+	
+	/* keep them in command line order */
+	for (prevp = &modems; (*prevp); prevp = &(*prevp)->next)
+		;
+	*prevp = md;
+	md->id = modem_count++;
+	
+	return md;
+}
+
 /*
  *	Parse arguments
  */
@@ -332,11 +555,12 @@ void parse_cmdline(int argc, char *argv[])
 {
 	int s;
 	int i;
+	struct modem *md;
 	
-	while ((s = getopt(argc, argv, "d:b:p:n:x:t:i:l:s:a:e:o:1:2:3:fr?h")) != -1) {
+	while ((s = getopt(argc, argv, "d:b:p:n:x:t:i:l:s:a:e:o:1:2:3:P:R:c:M:j:J:D:C:w:W:H:Q:m:S:fr?h")) != -1) {
 	switch (s) {
 		case 'd':
-			device = hstrdup(optarg);
+			add_modem(optarg);
 			break;
 		case 'b':
 			if ((serial_speed = atoi(optarg)) <= 0) {
@@ -391,7 +615,10 @@ void parse_cmdline(int argc, char *argv[])
 			i = pick_loglevel(optarg, log_destnames);
 			if (i > -1)
 				log_dest = i;
-			else {
+			else if (optarg[0] == '/') {
+				log_dest = L_FILE;
+				log_file = hstrdup(optarg);
+			} else {
 				fprintf(stderr, "Log destination unknown: \"%s\"\n", optarg);
 				print_help();
 				exit(1);
@@ -406,6 +633,99 @@ void parse_cmdline(int argc, char *argv[])
 		case '3':
 			mo_queue_max_tries = atoi(optarg);
 			break;
+		case 'P':
+			if ((at_pipeline = atoi(optarg)) < 1) {
+				fprintf(stderr, "Bad AT command pipeline depth \"%s\": minimum 1.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'R':
+			i = atoi(optarg);
+			if (i != 8 && i != 16) {
+				fprintf(stderr, "Bad concatenation reference size \"%s\": 8 or 16.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			concat_ref16 = (i == 16);
+			break;
+		case 'D':
+			if ((drain_slice = atoi(optarg)) < 0) {
+				fprintf(stderr, "Bad MO backlog time slice \"%s\": minimum 0.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'c':
+			if ((concat_timeout = atoi(optarg)) < 1) {
+				fprintf(stderr, "Bad reassembly timeout \"%s\": minimum 1.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'M':
+			if ((i = atoi(optarg)) < 1) {
+				fprintf(stderr, "Bad reassembly memory \"%s\": minimum 1.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			concat_mem_max = (long)i * 1024;
+			break;
+		case 'j':
+			journal_file = hstrdup(optarg);
+			break;
+		case 'J':
+			if ((journal_sync_time = atoi(optarg)) < 0) {
+				fprintf(stderr, "Bad journal sync delay \"%s\": minimum 0.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'C':
+			if ((mt_commit_delay = atoi(optarg)) < 0) {
+				fprintf(stderr, "Bad MT spool sync delay \"%s\": minimum 0.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'w':
+			if ((handler_workers = atoi(optarg)) < 0) {
+				fprintf(stderr, "Bad number of handler workers \"%s\": minimum 0.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'W':
+			if ((handler_timeout = atoi(optarg)) < 1) {
+				fprintf(stderr, "Bad handler timeout \"%s\": minimum 1.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'H':
+			if ((handler_max = atoi(optarg)) < 1) {
+				fprintf(stderr, "Bad number of handler processes \"%s\": minimum 1.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'Q':
+			if ((handler_high = atoi(optarg)) < 2) {
+				fprintf(stderr, "Bad handler queue limit \"%s\": minimum 2.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'm':
+			metrics_addr = hstrdup(optarg);
+			break;
+		case 'S':
+			if ((state_interval = atoi(optarg)) < 0) {
+				fprintf(stderr, "Bad state file interval \"%s\": minimum 0.\n", optarg);
+				print_help();
+				exit(1);
+			}
+			break;
 		case 'f':
 			fork_a_daemon = 1;
 			break;
@@ -419,57 +739,327 @@ void parse_cmdline(int argc, char *argv[])
 	}
 	}
 	
-	if (!statefile) {
-		statefile = hmalloc(strlen(spool_dir) + 1 + strlen(logname) + 7);
-		sprintf(statefile, "%s/state.%s", spool_dir, logname);
+	if (!modems)
+		add_modem(device);
+	
+	if (!journal_file) {
+		journal_file = hmalloc(strlen(spool_dir) + 1 + strlen(logname) + 9);
+		sprintf(journal_file, "%s/journal.%s", spool_dir, logname);
+	}
+	
+	/* one state file for each module, numbered if there are many */
+	for (md = modems; (md); md = md->next) {
+		md->statefile = hmalloc(strlen(spool_dir) + 1 + strlen(logname) + 7 + 12);
+		if (modem_count > 1)
+			sprintf(md->statefile, "%s/state.%s.%d", spool_dir, logname, md->id);
+		else
+			sprintf(md->statefile, "%s/state.%s", spool_dir, logname);
 	}
 }
 
 /*
- *	Issue a command to the module, wait for normal OK or error or timeout
- *	Does not handle incoming messages if such appear
+ *	MT group commit: received messages are written to the spool and
+ *	the module is told that they have been taken (AT+CNMA, or AT+CMGD
+ *	for messages listed from the SIM) only after the files have been
+ *	synced. Files and acknowledgements are collected for mt_commit_delay
+ *	ms, so that a burst of messages costs one sync for the files and
+ *	one for the spool directory.
  *
- * returns:
- *	0 on OK
- *	-1 on I/O error
- *	-2 on error message received
- *	-3 on timeut
+ *	A part of a concatenated message is written to a .part file of its
+ *	own while it waits for the rest, and acknowledged when that has been
+ *	synced. The part files are removed when the reassembled message is
+ *	in the spool, and read back in if the daemon starts with some left.
+ */
+
+struct mt_file {
+	char *msgid;
+	char *src;
+	char *spoolf;
+	FILE *f;			/* kept open until synced */
+	int part;			/* a .part file, not for the handler */
+	char **part_files;		/* .part files to remove after the sync, or NULL */
+	struct timespec tl[TL_STAMPS];	/* timeline of the message */
+	struct mt_file *next;
+};
+
+struct mt_ack {
+	struct modem *md;		/* NULL if the module went away */
+	char cmd[24];
+	int urgent;
+	char *indexes;			/* SIM storage to empty: indexes listed, comma separated */
+	int bulk;			/* they are all the read messages there are */
+	struct mt_ack *next;
+};
+
+static struct mt_file *mt_files = NULL;
+static struct mt_file **mt_files_tail = &mt_files;
+static struct mt_ack *mt_acks = NULL;
+static struct mt_ack **mt_acks_tail = &mt_acks;
+static struct ev_timer *mt_commit_timer;
+
+/*
+ *	Delete messages read from the SIM, one command at a time. They go
+ *	to the module back to back, as many in flight as the pipeline allows.
+ */
+
+static void mt_delete_each(struct modem *md, char *indexes)
+{
+	char cmd[24];
+	char *p, *e;
+	
+	for (p = indexes; *p; p = e) {
+		if ((e = strchr(p, ',')))
+			*e++ = 0;
+		else
+			e = p + strlen(p);
+		snprintf(cmd, sizeof(cmd), "AT+CMGD=%s", p);
+		hlog(LOG_DEBUG, "%s: Deleting message %s from SIM", md->device, p);
+		at_send(md->at, cmd, cmd_timeout, NULL, NULL);
+	}
+}
+
+static void mt_delete_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	char *indexes = arg;
+	
+	if (c->result == AT_ERROR && md->at) {
+		hlog(LOG_INFO, "%s: Module does not support AT+CMGD=1,1, deleting messages one at a time", md->device);
+		md->no_cmgd_bulk = 1;
+		mt_delete_each(md, indexes);
+	}
+	
+	hfree(indexes);
+}
+
+/*
+ *	Delete the messages listed from the SIM, all at once if the module
+ *	can do that and the listing was all that would go. Delete flag 1
+ *	removes the read messages only: the listing read all there were,
+ *	and the ones which have arrived after it are still unread. Takes
+ *	indexes.
+ */
+
+static void mt_delete(struct modem *md, char *indexes, int bulk)
+{
+	if (!bulk || md->no_cmgd_bulk) {
+		mt_delete_each(md, indexes);
+		hfree(indexes);
+		return;
+	}
+	
+	hlog(LOG_DEBUG, "%s: Deleting messages %s from SIM", md->device, indexes);
+	at_send(md->at, "AT+CMGD=1,1", cmd_timeout, mt_delete_cb, indexes);
+}
+
+/*
+ *	The .part files of a reassembled message
  */
 
-int issue_cmd_nomt(int f, char *cmd, char *msgid)
+static void mt_unlink_parts(char *msgid, char **files)
 {
- 	char buf[IBLEN];
 	int i;
 	
-	buf[0] = 0;
+	if (!files)
+		return;
+	
+	for (i = 0; files[i]; i++)
+		if (unlink(files[i]) && errno != ENOENT)
+			hlog(LOG_ERR, "[%s] Could not unlink part spool file %s: %s", msgid, files[i], strerror(errno));
+}
+
+static void mt_free_parts(char **files)
+{
+	int i;
 	
-	fdprintf(f, "%s\r\n", cmd);
-	i = readuntil(f, buf, IBLEN, expect_ok, expect_errors, cmd_timeout);
-	if (i > 0) {
-		if (string_in(buf, expect_errors)) {
-			hlog(LOG_ERR, "[%s] Error response to %s !", msgid, cmd);
-			i =  -2;
+	for (i = 0; files[i]; i++)
+		hfree(files[i]);
+	hfree(files);
+}
+
+/*
+ *	Sync the collected spool files, then give them to the handler and
+ *	acknowledge the messages to the modules. If the sync fails, the
+ *	files are removed and the messages are left unacknowledged, so
+ *	that the handler gets them once, when the network delivers them
+ *	again.
+ */
+
+void mt_commit(void)
+{
+	struct mt_file *mf;
+	struct mt_ack *a;
+	struct timespec now;
+	int fd, ok = 1;
+	
+	if (mt_commit_timer)
+		ev_timer_stop(mt_commit_timer);
+	
+	if (mt_files) {
+		if ((fd = open(spool_dir, O_RDONLY|O_CLOEXEC)) < 0) {
+			hlog(LOG_ERR, "Could not open spool directory %s: %s", spool_dir, strerror(errno));
+			ok = 0;
+		} else {
+			/* only the data of the collected files, and their names */
+			for (mf = mt_files; (mf) && ok; mf = mf->next)
+				if (fdatasync(fileno(mf->f))) {
+					hlog(LOG_ERR, "[%s] Could not sync spool file %s: %s", mf->msgid, mf->spoolf, strerror(errno));
+					ok = 0;
+				}
+			if (ok && fsync(fd)) {
+				hlog(LOG_ERR, "Could not sync spool directory %s: %s", spool_dir, strerror(errno));
+				ok = 0;
+			}
+			close(fd);
+		}
+		if (ok)
+			stats_mt_commits++;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while ((mf = mt_files)) {
+		mt_files = mf->next;
+		if (fclose(mf->f))
+			hlog(LOG_ERR, "[%s] Could not close spool file %s: %s", mf->msgid, mf->spoolf, strerror(errno));
+		if (ok && mf->part) {
+			/* waits in the spool for the other parts */
+		} else if (ok) {
+			stats_mt_committed++;
+			mf->tl[TL_COMMITTED] = now;
+			handler_submit(mf->msgid, mf->src, mf->spoolf, mf->tl);
+			mt_unlink_parts(mf->msgid, mf->part_files);
+		} else {
+			/* not acknowledged, the message comes again; parts which
+			 * were are still in their own files, for the next start
+			 */
+			hlog(LOG_ERR, "[%s] Spool sync failed, removing %s for the message to be received again", mf->msgid, mf->spoolf);
+			if (unlink(mf->spoolf))
+				hlog(LOG_ERR, "[%s] Could not unlink spool file %s: %s", mf->msgid, mf->spoolf, strerror(errno));
+		}
+		if (mf->part_files)
+			mt_free_parts(mf->part_files);
+		hfree(mf->msgid);
+		hfree(mf->src);
+		hfree(mf->spoolf);
+		hfree(mf);
+	}
+	mt_files_tail = &mt_files;
+	
+	while ((a = mt_acks)) {
+		mt_acks = a->next;
+		if (!ok)
+			hlog(LOG_ERR, "Spool sync failed, not acknowledging received message (%s)", a->cmd);
+		else if (a->md && a->md->at && a->indexes) {
+			mt_delete(a->md, a->indexes, a->bulk);
+			a->indexes = NULL;
+		} else if (a->md && a->md->at) {
+			hlog(LOG_DEBUG, "%s: %s", a->md->device, a->cmd);
+			if (a->urgent)
+				at_send_urgent(a->md->at, a->cmd, cmd_timeout, NULL, NULL);
+			else
+				at_send(a->md->at, a->cmd, cmd_timeout, NULL, NULL);
 		}
-	} else if (i < 1) {
-		hlog(LOG_ERR, "[%s] No OK response to %s: I/O error!", msgid, cmd);
-		i = -1;
-	} else if (i == 0) {
-		hlog(LOG_ERR, "[%s] Timeout for %s !", msgid, cmd);
-		i = -3;
+		if (a->indexes)
+			hfree(a->indexes);
+		hfree(a);
 	}
+	mt_acks_tail = &mt_acks;
+}
+
+static void mt_commit_timer_cb(struct ev_timer *t, void *arg)
+{
+	mt_commit();
+}
+
+static void mt_commit_soon(void)
+{
+	if (!mt_commit_timer)
+		mt_commit_timer = ev_timer_new(mt_commit_timer_cb, NULL);
+	if (ev_timer_left(mt_commit_timer) < 0)
+		ev_timer_set(mt_commit_timer, mt_commit_delay);
+}
+
+/* A spool file, written and renamed in place, waits for the sync */
+
+static void mt_commit_file(struct message *m, char *spoolf, FILE *f, int part)
+{
+	struct mt_file *mf = hmalloc(sizeof(*mf));
+	
+	mf->msgid = hstrdup(m->msgid);
+	mf->src = hstrdup(m->src);
+	mf->spoolf = spoolf;
+	mf->f = f;
+	mf->part = part;
+	mf->part_files = m->part_files;
+	m->part_files = NULL;
+	memcpy(mf->tl, m->tl, sizeof(mf->tl));
+	mf->next = NULL;
+	*mt_files_tail = mf;
+	mt_files_tail = &mf->next;
+	
+	mt_commit_soon();
+}
+
+/* A module command acknowledging a received message waits for the sync */
+
+static void mt_commit_ack(struct modem *md, char *cmd, int urgent)
+{
+	struct mt_ack *a = hmalloc(sizeof(*a));
+	
+	a->md = md;
+	snprintf(a->cmd, sizeof(a->cmd), "%s", cmd);
+	a->urgent = urgent;
+	a->indexes = NULL;
+	a->bulk = 0;
+	a->next = NULL;
+	*mt_acks_tail = a;
+	mt_acks_tail = &a->next;
+	
+	mt_commit_soon();
+}
+
+/* Messages listed from the SIM are deleted after the sync, with one
+ * command if bulk is set. Takes indexes.
+ */
+
+static void mt_commit_delete(struct modem *md, char *indexes, int bulk)
+{
+	struct mt_ack *a = hmalloc(sizeof(*a));
+	
+	a->md = md;
+	snprintf(a->cmd, sizeof(a->cmd), "AT+CMGD");
+	a->urgent = 0;
+	a->indexes = indexes;
+	a->bulk = bulk;
+	a->next = NULL;
+	*mt_acks_tail = a;
+	mt_acks_tail = &a->next;
+	
+	mt_commit_soon();
+}
+
+/* The connection to a module is gone, the network will deliver its
+ * unacknowledged messages again
+ */
+
+static void mt_commit_forget(struct modem *md)
+{
+	struct mt_ack *a;
 	
-	return i;
+	for (a = mt_acks; (a); a = a->next)
+		if (a->md == md)
+			a->md = NULL;
 }
 
 /*
- *	Fork a handler program for MT message
+ *	Write a MT message to the spool, to be given to the handler when
+ *	it has been synced
  */
  
 int fork_handler(struct message *m)
 {
 	char buf[IBLEN];
-	pid_t p;
-	int i;
+	int i, l;
 	char *tmpf;
 	char *spoolf;
 	int fd;
@@ -482,8 +1072,8 @@ int fork_handler(struct message *m)
 	sprintf(tmpf, "%s.tmp", spoolf);
 	
 	hlog(LOG_DEBUG, "[%s] Writing temporary spool file: %s", m->msgid, tmpf);
-	fd = open(tmpf, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP);
-	if (f < 0) {
+	fd = open(tmpf, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP);
+	if (fd < 0) {
 		hlog(LOG_ERR, "[%s] Could not create spool file %s: %s", m->msgid, tmpf, strerror(errno));
 		hfree(spoolf);
 		hfree(tmpf);
@@ -513,6 +1103,8 @@ int fork_handler(struct message *m)
 	fprintf(f, "TP-DCS: %d\n", m->dcs);
 	if (m->has_udh)
 		fprintf(f, "Has-UDH: %d\n", m->has_udh);
+	if (m->parts > 1)
+		fprintf(f, "Parts: %d/%d\n", m->parts_got, m->parts);
 	if (m->is_binary) {
 		fprintf(f, "Is-binary: %d\n", m->is_binary);
 		fprintf(f, "Length: %d\n", m->len);
@@ -521,8 +1113,11 @@ int fork_handler(struct message *m)
 	
 	if (m->len > 0) {
 		if (m->is_binary) {
-			bin2hexstring(m->content, m->len, buf);
-			i = fwrite(buf, strlen(buf), 1, f);
+			/* bin2hexstring() does one PDU worth at a time */
+			for (i = 1, l = 0; l < m->len && i == 1; l += 140) {
+				bin2hexstring(m->content + l, m->len - l, buf);
+				i = fwrite(buf, strlen(buf), 1, f);
+			}
 		} else
 			i = fwrite(m->content, m->len, 1, f);
 			
@@ -538,8 +1133,10 @@ int fork_handler(struct message *m)
 		}
 	}
 	
-	if (fclose(f)) {
-		hlog(LOG_ERR, "[%s] Could not close spool file %s after writing: %s", m->msgid, tmpf, strerror(errno));
+	/* the file stays open for syncing it later */
+	if (fflush(f)) {
+		hlog(LOG_ERR, "[%s] Could not write spool file %s: %s", m->msgid, tmpf, strerror(errno));
+		fclose(f);
 		if (unlink(tmpf))
 			hlog(LOG_ERR, "[%s] Could not unlink spool file %s: %s", m->msgid, tmpf, strerror(errno));
 		hfree(spoolf);
@@ -549,6 +1146,7 @@ int fork_handler(struct message *m)
 	
 	if (rename(tmpf, spoolf)) {
 		hlog(LOG_ERR, "[%s] Could not rename spool file %s to %s: %s", m->msgid, tmpf, spoolf, strerror(errno));
+		fclose(f);
 		if (unlink(tmpf))
 			hlog(LOG_ERR, "[%s] Could not unlink spool file %s: %s", m->msgid, tmpf, strerror(errno));
 		hfree(spoolf);
@@ -556,95 +1154,245 @@ int fork_handler(struct message *m)
 		return -1;
 	}
 	
-	if ((p = fork()) == 0) {
-		/* child */
-		for (i = 3; i < 128; i++)
-			close(i);
-		close(0);
-		hlog(LOG_DEBUG, "[%s] Executing handler with pid %d spoolfile %s", m->msgid, (int)getpid(), spoolf);
-		execl(outhandler, outhandler, m->msgid, m->src, spoolf, NULL);
-		hlog(LOG_ERR, "[%s] Could not execute handler %s: %s", m->msgid, outhandler, strerror(errno));
-		if (unlink(spoolf))
-			hlog(LOG_ERR, "[%s] Could not unlink spool file %s: %s", m->msgid, spoolf, strerror(errno));
-		exit(0);
-	}
-	
-	/* parent */
-	if (p < 0) {
-		hlog(LOG_ERR, "[%s] Fork failed for handler: %s", m->msgid, strerror(errno));
-		if (unlink(spoolf))
-			hlog(LOG_ERR, "[%s] Could not unlink spool file %s: %s", m->msgid, spoolf, strerror(errno));
-		hfree(spoolf);
-		hfree(tmpf);
-		return -1;
-	}
-	
-	hfree(spoolf);
 	hfree(tmpf);
+	tl_stamp(m->tl, TL_SPOOLED);
+	mt_commit_file(m, spoolf, f, 0);
 	
 	return 0;
 }
 
 /*
- *	Parse an ASCII PDU
+ *	Write a part of a concatenated MT message to a .part file, with the
+ *	PDU as it came, to be acknowledged when the file has been synced
  */
 
-#define MAX_PDU_BIN_LEN 500
-
-int mt_parse_pdu_ascii(struct message *m, char *pdu)
+int mt_spool_part(struct message *m, char *pdu, int len)
 {
-	char bin[MAX_PDU_BIN_LEN];
-	char ascii[MAX_PDU_BIN_LEN];
-	int binlen;
+	char *tmpf;
+	char *spoolf;
+	int fd;
+	FILE *f;
 	
-	/* length of data */
-	binlen = octet2bin(pdu);
-	if (binlen > MAX_PDU_BIN_LEN - 100) {
-		hlog(LOG_ERR, "[%s] Ouch, received message claims to have a %d bytes of content, discarding message!", m->msgid, binlen);
+	spoolf = hmalloc(strlen(spool_dir) + 1 + strlen(m->msgid) + 5 + 1);
+	sprintf(spoolf, "%s/%s.part", spool_dir, m->msgid);
+	tmpf = hmalloc(strlen(spoolf) + 4 + 1);
+	sprintf(tmpf, "%s.tmp", spoolf);
+	
+	fd = open(tmpf, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if (fd < 0) {
+		hlog(LOG_ERR, "[%s] Could not create part spool file %s: %s", m->msgid, tmpf, strerror(errno));
+		hfree(spoolf);
+		hfree(tmpf);
 		return -1;
 	}
 	
-	/* convert from hex to binary */
-	hexstring2bin(pdu + 2, binlen, bin, MAX_PDU_BIN_LEN);
-	
-	/* from binary to ascii */
-	binary2ascii(bin, binlen, ascii, MAX_PDU_BIN_LEN, 0);
-	
-	m->content = hstrdup(ascii);
-	m->len = binlen;
-	
-	ascii2escaped(ascii, strlen(ascii), bin, MAX_PDU_BIN_LEN);
-	hlog(LOG_DEBUG, "[%s] Text %d bytes: \"%s\"", m->msgid, binlen, bin);
+	if (!(f = fdopen(fd, "w"))) {
+		hlog(LOG_ERR, "[%s] Could not fdopen part spool file %s: %s", m->msgid, tmpf, strerror(errno));
+		close(fd);
+		if (unlink(tmpf))
+			hlog(LOG_ERR, "[%s] Could not unlink part spool file %s: %s", m->msgid, tmpf, strerror(errno));
+		hfree(spoolf);
+		hfree(tmpf);
+		return -1;
+	}
 	
-	return 0;
-}
-
-int mt_parse_pdu_binary(struct message *m, char *pdu)
-{
-	unsigned char bin[MAX_PDU_BIN_LEN];
-	int binlen;
-	int l;
+	fprintf(f, "Received: %ld\n%.*s\n", (long)m->received, len, pdu);
 	
-	binlen = octet2bin(pdu);
-	if (binlen > MAX_PDU_BIN_LEN - 100) {
-		hlog(LOG_ERR, "[%s] Ouch, received message claims to have a %d bytes of content, discarding message!", m->msgid, binlen);
+	/* the file stays open for syncing it later */
+	if (fflush(f) || rename(tmpf, spoolf)) {
+		hlog(LOG_ERR, "[%s] Could not write part spool file %s: %s", m->msgid, spoolf, strerror(errno));
+		fclose(f);
+		if (unlink(tmpf) && errno != ENOENT)
+			hlog(LOG_ERR, "[%s] Could not unlink part spool file %s: %s", m->msgid, tmpf, strerror(errno));
+		hfree(spoolf);
+		hfree(tmpf);
 		return -1;
 	}
-	for (l  = 0; l < binlen; l++)
-		bin[l] = octet2bin(pdu + (l<<1) + 2);
-	bin[l] = 0;
-	
-	hlog(LOG_DEBUG, "[%s] Binary %d bytes", m->msgid, binlen);
 	
-	m->content = hmalloc(binlen);
-	memcpy(m->content, bin, binlen);
-	m->len = binlen;
+	hfree(tmpf);
+	m->spoolfile = hstrdup(spoolf);
+	mt_commit_file(m, spoolf, f, 1);
 	
 	return 0;
 }
 
 /*
- *	Split a DELIVER type PDU
+ *	Read back the parts an earlier run left in the spool, waiting for
+ *	the rest of their messages
+ */
+
+void mt_recover_parts(void)
+{
+	DIR *d;
+	struct dirent *de;
+	struct message *m;
+	char buf[IBLEN];
+	char *fn;
+	FILE *f;
+	long received;
+	int l, c = 0;
+	
+	if (!(d = opendir(spool_dir))) {
+		hlog(LOG_ERR, "Could not open directory %s: %s", spool_dir, strerror(errno));
+		return;
+	}
+	
+	while ((de = readdir(d))) {
+		l = strlen(de->d_name);
+		if (l < 6 || strcmp(de->d_name + l - 5, ".part"))
+			continue;
+		
+		fn = hmalloc(strlen(spool_dir) + 1 + l + 1);
+		sprintf(fn, "%s/%s", spool_dir, de->d_name);
+		if (!(f = fopen(fn, "re"))) {
+			hlog(LOG_ERR, "Could not open part spool file %s: %s", fn, strerror(errno));
+			hfree(fn);
+			continue;
+		}
+		
+		m = alloc_message();
+		m->msgid = hstrdup(de->d_name);
+		m->msgid[l - 5] = 0;
+		m->spoolfile = fn;
+		
+		if (fscanf(f, "Received: %ld\n", &received) != 1 || !fgets(buf, sizeof(buf), f)) {
+			hlog(LOG_ERR, "[%s] Could not read part spool file %s, leaving it", m->msgid, fn);
+			fclose(f);
+			free_message(m);
+			continue;
+		}
+		fclose(f);
+		buf[strcspn(buf, "\n")] = 0;
+		m->received = received;
+		
+		if (mt_parse_pdu(m, buf) || m->parts < 2) {
+			hlog(LOG_ERR, "[%s] Could not parse the part in %s, leaving it", m->msgid, fn);
+			free_message(m);
+			continue;
+		}
+		
+		concat_add(m);
+		c++;
+	}
+	
+	if (closedir(d))
+		hlog(LOG_ERR, "Could not close directory %s: %s", spool_dir, strerror(errno));
+	
+	if (c)
+		hlog(LOG_NOTICE, "Read back %d parts of concatenated MT messages from the spool", c);
+}
+
+/*
+ *	Look for a concatenated message element in the UDH of a part,
+ *	returns the length of the UDH if there is one, 0 if not
+ */
+
+#define MAX_PDU_BIN_LEN 500
+
+int mt_parse_concat(struct message *m, unsigned char *ud, int len, int *ie)
+{
+	int ref, ref16, parts, seq;
+	
+	if ((*ie = udh_concat(ud, len, &ref, &ref16, &parts, &seq)) < 0)
+		return 0;
+	
+	if (parts < 2 || seq < 1 || seq > parts) {
+		hlog(LOG_WARNING, "[%s] Bad concatenation element: part %d of %d, not reassembling", m->msgid, seq, parts);
+		return 0;
+	}
+	
+	m->concat_ref = ref;
+	m->concat_ref16 = ref16;
+	m->parts = parts;
+	m->part_seq = seq;
+	hlog(LOG_DEBUG, "[%s] Part %d of %d, %d-bit reference %d", m->msgid, seq, parts, (ref16) ? 16 : 8, ref);
+	
+	return ud[0] + 1;
+}
+
+/*
+ *	Parse an ASCII PDU
+ */
+
+int mt_parse_pdu_ascii(struct message *m, char *pdu)
+{
+	char bin[MAX_PDU_BIN_LEN];
+	char ascii[MAX_PDU_BIN_LEN];
+	int binlen;
+	int udhlen, ie;
+	int skip = 0;
+	
+	/* length of data */
+	binlen = octet2bin(pdu);
+	if (binlen > MAX_PDU_BIN_LEN - 100) {
+		hlog(LOG_ERR, "[%s] Ouch, received message claims to have a %d bytes of content, discarding message!", m->msgid, binlen);
+		return -1;
+	}
+	
+	/* convert from hex to binary */
+	hexstring2bin(pdu + 2, binlen, bin, MAX_PDU_BIN_LEN);
+	
+	/* the header of a part of a concatenated message is not text */
+	if (m->has_udh && (udhlen = mt_parse_concat(m, (unsigned char *)bin, SEPTET_OCTETS(binlen), &ie)) > 0) {
+		skip = UDH_SEPTETS(udhlen);
+		m->has_udh = 0;
+	}
+	
+	/* from binary to ascii */
+	binary2ascii(bin, binlen, ascii, MAX_PDU_BIN_LEN, 0, skip);
+	
+	m->content = hstrdup(ascii);
+	m->len = strlen(ascii);
+	
+	if (hlog_on(LOG_DEBUG)) {
+		ascii2escaped(ascii, strlen(ascii), bin, MAX_PDU_BIN_LEN);
+		hlog(LOG_DEBUG, "[%s] Text %d bytes: \"%s\"", m->msgid, m->len, bin);
+	}
+	
+	return 0;
+}
+
+int mt_parse_pdu_binary(struct message *m, char *pdu)
+{
+	unsigned char bin[MAX_PDU_BIN_LEN];
+	int binlen;
+	int l;
+	int udhlen, ie, iel;
+	
+	binlen = octet2bin(pdu);
+	if (binlen > MAX_PDU_BIN_LEN - 100) {
+		hlog(LOG_ERR, "[%s] Ouch, received message claims to have a %d bytes of content, discarding message!", m->msgid, binlen);
+		return -1;
+	}
+	for (l  = 0; l < binlen; l++)
+		bin[l] = octet2bin(pdu + (l<<1) + 2);
+	bin[l] = 0;
+	
+	/* take the concatenation element out of the UDH, keep the rest */
+	if (m->has_udh && (udhlen = mt_parse_concat(m, bin, binlen, &ie)) > 0) {
+		iel = bin[ie + 1] + 2;
+		if (udhlen == iel + 1) {
+			memmove(bin, bin + udhlen, binlen - udhlen);
+			binlen -= udhlen;
+			m->has_udh = 0;
+		} else {
+			memmove(bin + ie, bin + ie + iel, binlen - ie - iel);
+			binlen -= iel;
+			bin[0] -= iel;
+		}
+	}
+	
+	hlog(LOG_DEBUG, "[%s] Binary %d bytes", m->msgid, binlen);
+	
+	m->content = hmalloc(binlen);
+	memcpy(m->content, bin, binlen);
+	m->len = binlen;
+	
+	return 0;
+}
+
+/*
+ *	Split a DELIVER type PDU
  */
 
 int mt_split_pdu_deliver(struct message *m, char *pdu)
@@ -686,7 +1434,7 @@ int mt_split_pdu_deliver(struct message *m, char *pdu)
 		hexstring2bin(pdu, l / 2 +1, binsender, sizeof(binsender));
 		
 		/* from binary to ascii */
-		binary2ascii(binsender, l / 2 +1, sender, sizeof(sender), 1);
+		binary2ascii(binsender, l / 2 +1, sender, sizeof(sender), 1, 0);
 		
 	} else {
 		/* Non-alphanumeric, so should be numeric */
@@ -861,31 +1609,38 @@ int mt_parse_pdu(struct message *m, char *pdu)
 }
 
 /*
- *	Handle a received PDU
+ *	Pass a reassembled message to the handler. If it can not be
+ *	spooled, its parts stay in their files for the next start.
+ */
+
+void mt_deliver(struct message *m)
+{
+	if (fork_handler(m))
+		stats_mt_fail_handle++;
+	
+	free_message(m);
+}
+
+/*
+ *	Handle a received PDU. *kept (if not NULL) is set if the message
+ *	was left for the module to give again.
  */
 
-char *mt_handle_pdu(char *p, int f)
+char *mt_handle_pdu(char *p, struct modem *md, int *kept)
 {
-	char *s, *c, *e;
+	char *s, *e;
 	struct message *m;
-	int must_ack = 0;
+	int must_ack = 0, failed;
+	char *list = NULL;
 	char buf[IBLEN];
 	char cmd[24];
+	char part[32];
+	struct timespec seen;
 	
-	stats_mt++;
+	clock_gettime(CLOCK_MONOTONIC, &seen);
 	
 	if ((s = strstr(p, "CMGL:"))) {
-		if ((c = strstr(s, ": "))) {
-			c += 2;
-			snprintf(cmd, 20, "AT+CMGD=%s", c);
-			if ((e = strchr(cmd, ','))) {
-				*e = 0;
-				hlog(LOG_DEBUG, "Deleting message %s from SIM", cmd+8);
-				issue_cmd_nomt(f, cmd, "delmt");
-			} else {
-				hlog(LOG_ERR, "Ouch! Received CMGL without a comma after message index! Could not delete!");
-			}
-		}
+		list = s;
 	} else if ((s = strstr(p, "CDS:"))) {
 	} else if ((s = strstr(p, "CBM:"))) {
 		must_ack = 1;
@@ -912,332 +1667,268 @@ char *mt_handle_pdu(char *p, int f)
 		return p+3;
 	}
 	
+	/* While the handlers are behind, leave the message unacknowledged
+	 * or on the SIM. The network delivers it again later, and the
+	 * SIM is listed again on the next poll.
+	 */
+	if ((must_ack || list) && handler_backlogged()) {
+		hlog(LOG_INFO, "Handlers are behind, leaving a received message %s",
+			(list) ? "on the SIM" : "unacknowledged");
+		stats_mt_deferred++;
+		if (kept)
+			*kept = 1;
+		return e + 1;
+	}
+	
+	stats_mt++;
+	md->stats_mt++;
+	
+	/* the message is acknowledged after its spool file has been
+	 * synced, messages listed from the SIM are deleted by the caller
+	 */
+	cmd[0] = 0;
+	if (must_ack)
+		strcpy(cmd, "AT+CNMA");
+	
 	m = alloc_message();
 	m->msgid = hstrdup(genmsgid("mt"));
 	m->received = time(NULL);
-	
-	if (must_ack) {
-		hlog(LOG_DEBUG, "[%s] Acknowledging received message to terminal", m->msgid);
-		issue_cmd_nomt(f, "AT+CNMA", m->msgid);
-	}
+	m->tl[TL_SEEN] = seen;
 	
 	if (mt_parse_pdu(m, s)) {
 		hlog(LOG_ERR, "[%s] MESSAGE MT RESULT:FAILED Failed to parse a MT PDU, message discarded.", m->msgid);
 		free_message(m);
 		stats_mt_fail_parse++;
 		stats_mt_fail++;
+		if (cmd[0])
+			mt_commit_ack(md, cmd, must_ack);
 		return e+1;
 	}
+	tl_stamp(m->tl, TL_PARSED);
 	
-	if (m->is_binary) {
+	if (m->parts > 1)
+		snprintf(part, sizeof(part), " part %d/%d", m->part_seq, m->parts);
+	else
+		part[0] = 0;
+	
+	if (!hlog_on(LOG_NOTICE)) {
+		/* no need to escape the content */
+	} else if (m->is_binary) {
 		bin2hexstring(m->content, m->len, buf);
-		hlog(LOG_NOTICE, "[%s] MESSAGE MT RESULT:OK from %s sent-at %s %s type binary length %d content %s",
-			m->msgid, m->src, m->date, m->time, m->len, buf);
+		hlog(LOG_NOTICE, "[%s] MESSAGE MT RESULT:OK from %s sent-at %s %s type binary%s length %d content %s",
+			m->msgid, m->src, m->date, m->time, part, m->len, buf);
 	} else {
 		ascii2escaped(m->content, m->len, buf, IBLEN);
-		hlog(LOG_NOTICE, "[%s] MESSAGE MT RESULT:OK from %s sent-at %s %s type text length %d content \"%s\"",
-			m->msgid, m->src, m->date, m->time, m->len, buf);
+		hlog(LOG_NOTICE, "[%s] MESSAGE MT RESULT:OK from %s sent-at %s %s type text%s length %d content \"%s\"",
+			m->msgid, m->src, m->date, m->time, part, m->len, buf);
 	}
 	
 	stats_mt_ok++;
 	
-	if (fork_handler(m))
+	/* the handler gets a concatenated message when all the parts are
+	 * in, until then each part is kept in a file of its own. One which
+	 * could not be written is left unacknowledged, or on the SIM.
+	 */
+	if (m->parts > 1)
+		failed = mt_spool_part(m, s, e - s);
+	else
+		failed = fork_handler(m);
+	if (failed) {
+		hlog(LOG_ERR, "[%s] Could not spool the message, leaving it %s", m->msgid,
+			(list) ? "on the SIM" : "unacknowledged");
 		stats_mt_fail_handle++;
-		
-	free_message(m);
+		free_message(m);
+		if (kept)
+			*kept = 1;
+		return e + 1;
+	}
+	if (m->parts > 1)
+		concat_add(m);
+	else
+		free_message(m);
+	
+	if (cmd[0])
+		mt_commit_ack(md, cmd, must_ack);
 	
 	return e + 1;
 }
 
 /*
- *	Check if the module responds to AT
+ *	Concatenated messages: a message which does not fit in one SMS
+ *	is split to parts, and each part starts with a user data header
+ *	carrying the reference number, the number of parts and the
+ *	sequence number of the part.
  */
- 
-int ping_module(int f)
+
+#define MO_SEPTETS	160	/* septets of user data in one message */
+#define MO_OCTETS	140	/* octets of user data in one message */
+#define MO_MAX_PARTS	255	/* parts in a concatenated message */
+
+#define CONCAT_UDH8	6	/* UDH length with an 8-bit reference, UDHL included */
+#define CONCAT_UDH16	7	/* UDH length with a 16-bit reference */
+
+int concat_ref_counter = 0;	/* last concatenation reference used */
+
+/*
+ *	Number of septets a character takes
+ */
+
+static int mo_char_septets(char c)
 {
-	char buf[IBLEN];
-	int i;
+	if (convert_charset && ext_convert(c, CS_ISO, CS_SMS) != ' ')
+		return 2;	/* ESC + extended character */
 	
-	hlog(LOG_DEBUG, "Checking if the module is responding ...");
-	if (hwrite(f, "\r\n") < 2)
-		return -2;
-	if (empty_read_buffer(f, 1))
-		return -2;
-	if (hwrite(f, "ATE0\r\n") < 6)
-		return -2;
-	i = readuntil(f, buf, IBLEN, expect_ok, expect_errors, cmd_timeout);
-	if (i == -1) {
-		hlog(LOG_ERR, "Connection closed after sending ATE0");
-		return -2;
-	} else if (i == 0) {
-		hlog(LOG_ERR, "Module did not respond to ATE0 in %d ms", cmd_timeout);
-		return -2;
-	}
-	if (string_in(buf, expect_ok))
-		return 0;
-		
-	hlog(LOG_ERR, "Module did not respond to ATE0 with an OK");
-	return -2;
+	return 1;
 }
 
 /*
- *	Check if the module needs a PIN code, send it if needed
+ *	Split a message to parts if it does not fit in one, recording
+ *	the offset of each part in the content
  */
 
-int send_pin(int f, int reset_if_ready)
+void mo_segment(struct message *m)
 {
-	char buf[IBLEN];
-	int i;
+	int udhlen, room, total, used, l, i, n;
 	
-	hlog(LOG_DEBUG, "Checking if the module has the PIN code");
-	if (hwrite(f, "AT+CPIN?\r\n") < 0)
-		return -1;
-	readuntil(f, buf, IBLEN, expect_ok, expect_errors, cmd_timeout);
-	if (string_in(buf, expect_errors)) {
-		hlog(LOG_CRIT, "Module said \"ERROR\" for AT+CPIN?, no SIM?", pin);
-		return 1;
-	}
-	if (!(string_in(buf, expect_ok))) {
-		hlog(LOG_CRIT, "Module did not respond with an OK to AT+CPIN?");
-		return -2;
-	}
-	if (strstr(buf, "CPIN: SIM PIN")) {
-		hlog(LOG_DEBUG, "Sending SIM PIN");
-		fdprintf(f, "AT+CPIN=%s\r\n", pin);
-		i = readuntil(f, buf, IBLEN, expect_ok, expect_errors, register_timeout);
-		if (string_in(buf, expect_errors)) {
-			hlog(LOG_CRIT, "Module said \"ERROR\" for AT+CPIN=%s, wrong PIN?", pin);
-			return 1;
-		} else if (string_in(buf, expect_ok)) {
-			hlog(LOG_INFO, "SIM PIN code inserted");
-			return 0;
-		} else if (i == -1) {
-			hlog(LOG_CRIT, "Module timed out after AT+CPIN=%s, possibly network registration is taking a long time or fails?", pin);
-			return -1;
-		} else {
-			hlog(LOG_CRIT, "Unknown response for AT+CPIN=%s, bug or bad PIN?", pin);
-			return 1;
-		}
-	} else if (strstr(buf, "CPIN: READY")) {
-		hlog(LOG_INFO, "Module has the required PIN codes");
-		if (reset_if_ready) {
-			hlog(LOG_INFO, "Trying to enable network registration with AT+COPS=2, AT+COPS=0");
-			if ((i = issue_cmd_nomt(f, "AT+COPS=2", "send_pin")) < 0)
-				return i;
-			sleep(10);
-			if ((i = issue_cmd_nomt(f, "AT+COPS=0", "send_pin")) < 0)
-				return i;
-			sleep(5);
-			hlog(LOG_INFO, "Attempt to enable network registration has been made.");
-			return -1;
+	m->parts = 1;
+	m->parts_sent = 0;
+	
+	if (m->is_binary) {
+		if (m->len <= MO_OCTETS)
+			return;
+		if (m->has_udh) {
+			/* the header of the user can not be merged with ours */
+			hlog(LOG_ERR, "[%s] Binary content with a UDH is %d bytes, can not split it, truncating to %d bytes!",
+				m->msgid, m->len, MO_OCTETS);
+			m->len = MO_OCTETS;
+			return;
 		}
 	} else {
-		hlog(LOG_CRIT, "Module is not READY and does not want SIM PIN, maybe wants PUK?");
-		return 1;
+		for (total = 0, i = 0; i < m->len && total <= MO_SEPTETS; i++)
+			total += mo_char_septets(m->content[i]);
+		if (total <= MO_SEPTETS)
+			return;
 	}
-	return 0;
-}	
-
-/*
- *	Issue a command to the module, wait for normal OK or error or timeout
- *	Also handle incoming messages if such appear
- *
- * returns:
- *	0 on OK
- *	-1 on I/O error
- *	-2 on error message received
- *	-3 on timeut
- */
-
-int issue_cmd(int f, char *cmd, char *msgid)
-{
- 	char buf[IBLEN];
-	int i;
-	char *p;
 	
-	fdprintf(f, "%s\r\n", cmd);
-
-rewait:	
-	buf[0] = 0;
-	i = readuntil(f, buf, IBLEN, expect_ok_or_mt, expect_errors, cmd_timeout);
-	if (i > 0) {
-		if (string_in(buf, expect_errors)) {
-			hlog(LOG_ERR, "[%s] Error response to %s !", msgid, cmd);
-			i =  -2;
-		} else if (string_in(buf, expect_mt)) {
-			hlog(LOG_DEBUG, "[%s] Received MT PDU in response to command %s. Reading the rest and handling.", msgid, cmd);
-			p = buf + i;
-			i = readuntil(f, p, buf + IBLEN - p, expect_linefeed, expect_errors, cmd_timeout);
-			if (i < 0) {
-				hlog(LOG_ERR, "I/O error on module while reading MT");
-				return -1;
-			}
-			p += i;
-			i = readuntil(f, p, buf + IBLEN - p, expect_linefeed, expect_errors, cmd_timeout);
-			if (i < 0) {
-				hlog(LOG_ERR, "I/O error on module while reading MT");
-				return -1;
-			}
-			p = buf;
-			while ((p = strstr(p, "CMT:")))
-				p = mt_handle_pdu(p, f);
-			p = buf;
-			while ((p = strstr(p, "CBM:")))
-				p = mt_handle_pdu(p, f);
-			p = buf;
-			while ((p = strstr(p, "CDS:")))
-				p = mt_handle_pdu(p, f);
-			goto rewait;
+	m->concat_ref16 = concat_ref16;
+	udhlen = (m->concat_ref16) ? CONCAT_UDH16 : CONCAT_UDH8;
+	
+	if (m->is_binary) {
+		room = MO_OCTETS - udhlen;
+		if (m->dcs >> 6 == 0 && (m->dcs >> 2 & 3) == 2)
+			room &= ~1;	/* do not split an UCS2 character */
+	} else
+		room = MO_SEPTETS - UDH_SEPTETS(udhlen);
+	
+	m->part_ofs = hmalloc((MO_MAX_PARTS + 1) * sizeof(int));
+	m->part_ofs[0] = 0;
+	n = 0;
+	used = 0;
+	
+	for (i = 0; i < m->len; i++) {
+		/* an extended character and its ESC stay in the same part */
+		l = (m->is_binary) ? 1 : mo_char_septets(m->content[i]);
+		if (used + l > room) {
+			if (n + 1 == MO_MAX_PARTS)
+				break;
+			m->part_ofs[++n] = i;
+			used = 0;
 		}
-	} else if (i < 1) {
-		hlog(LOG_ERR, "[%s] No OK response to %s: I/O error!", msgid, cmd);
-		i = -1;
-	} else if (i == 0) {
-		hlog(LOG_ERR, "[%s] Timeout for %s !", msgid, cmd);
-		i = -3;
+		used += l;
+	}
+	m->part_ofs[++n] = i;
+	
+	if (i < m->len) {
+		hlog(LOG_ERR, "[%s] Content is too long for %d parts, truncating to %d %s!",
+			m->msgid, MO_MAX_PARTS, i, (m->is_binary) ? "bytes" : "characters");
+		m->len = i;
 	}
 	
-	return i;
+	m->parts = n;
+	m->part_ofs = hrealloc(m->part_ofs, (n + 1) * sizeof(int));
+	
+	concat_ref_counter++;
+	m->concat_ref = concat_ref_counter & ((m->concat_ref16) ? 0xffff : 0xff);
 	
+	hlog(LOG_DEBUG, "[%s] Split to %d parts, %d-bit reference %d", m->msgid, m->parts,
+		(m->concat_ref16) ? 16 : 8, m->concat_ref);
 }
 
 /*
- *	Wait for network registration
+ *	Build the UDH of the part of a concatenated message which
+ *	is to be sent next, returns its length
  */
 
-int wait_registration(int f)
+int mo_concat_udh(struct message *m, unsigned char *udh)
 {
-	char buf[IBLEN];
-	int i;
-	
-	hlog(LOG_DEBUG, "Enabling extended error reporting");
-	if ((i = issue_cmd(f, "AT+CMEE=2", "init")) < 0)
-		return i;
-	
-	hlog(LOG_DEBUG, "Enabling unsolicited registration status messages");
-	if ((i = issue_cmd(f, "AT+CREG=1", "init")) < 0)
-		return i;
-	
-	hlog(LOG_DEBUG, "Selecting SMS message format: PDU");
-	if ((i = issue_cmd(f, "AT+CMGF=0", "init")) < 0)
-		return i;
-	
-	hlog(LOG_DEBUG, "Enabling GSM 07.05 Phase 2+ mode");
-	issue_cmd(f, "AT+CSMS=1", "init");
-	/*
-	if ((i = issue_cmd(f, "AT+CSMS=1", "init")) < 0)
-		return i;
-	*/
-	
-	hlog(LOG_DEBUG, "Enabling unsolicited SMS message indications");
-	if ((i = issue_cmd(f, "AT+CNMI=1,2,0,0", "init")) < 0)
-		return i;
-	
-	while (1) {
-		hlog(LOG_DEBUG, "Checking if module is registered to a network");
-		if (hwrite(f, "AT+CREG?\r\n") < 0)
-			return -1;
-		if (readuntil(f, buf, IBLEN, expect_ok, expect_errors, cmd_timeout) < 1) {
-			hlog(LOG_ERR, "No response to AT+CREG? !");
-			return -2;
-		}
-		if (!(string_in(buf, expect_ok))) {
-			hlog(LOG_ERR, "No OK response to AT+CREG? !");
-			return -2;
-		}
-		
-		if (strstr(buf, "CREG: 1,0")) {
-			hlog(LOG_INFO, "Module not trying to register, checking if PIN is needed");
-			if (send_pin(f, 1) > 0)
-				return 4;
-		} else if (strstr(buf, "CREG: 1,2")) {
-			hlog(LOG_INFO, "Module is searching for a network to register on");
-			state_change(STATE_DOWN_NONETWORK, "Module is searching for a network to register on");
-		} else if (strstr(buf, "CREG: 1,1")) {
-			hlog(LOG_INFO, "Module registered, home network");
-			return 0;
-		} else if (strstr(buf, "CREG: 1,5")) {
-			hlog(LOG_INFO, "Module registered, roaming");
-			return 0;
-		} else {
-			hlog(LOG_INFO, "Not registered, waiting");
-			state_change(STATE_DOWN_NONETWORK, "Module is not registered to a network, waiting");
-		}
-		
-		sleep(5);
-	}
+	if (m->concat_ref16) {
+		udh[0] = CONCAT_UDH16 - 1;
+		udh[1] = 0x08;	/* IEI: concatenated SMS, 16-bit reference */
+		udh[2] = 4;
+		udh[3] = m->concat_ref >> 8;
+		udh[4] = m->concat_ref & 0xff;
+		udh[5] = m->parts;
+		udh[6] = m->parts_sent + 1;
+		return CONCAT_UDH16;
+	}
+	
+	udh[0] = CONCAT_UDH8 - 1;
+	udh[1] = 0x00;	/* IEI: concatenated SMS, 8-bit reference */
+	udh[2] = 3;
+	udh[3] = m->concat_ref;
+	udh[4] = m->parts;
+	udh[5] = m->parts_sent + 1;
+	return CONCAT_UDH8;
 }
 
 /*
- *	Encode
+ *	Encode text to packed septets in hex, after an optional UDH.
+ *	Returns the number of septets, the UDH and its fill bits included.
  */
 
-int mo_encode_ascii(char *ascii, char *pdu)
+int mo_encode_ascii(char *ascii, int asciiLength, unsigned char *udh, int udhlen, char *pdu)
 {
-	char tmp[500];
-	char octet[10];
-	int pdubitposition;
-	int pdubyteposition;
-	int asciiLength;
+	static const char hexdigits[] = "0123456789ABCDEF";
+	unsigned char septets[MO_SEPTETS + 10];
+	unsigned char octets[SEPTET_OCTETS(MO_SEPTETS + 10)];
 	int character;
-	int bit;
-	int pdubitnr;
+	int septetcount;
+	int i, l;
 	char converted;
-	int ext_characters = 0;
-	int counted_characters = 0;
 	
-	asciiLength = strlen(ascii);
+	/* the UDH takes the place of the first septets, the fill bits stay zero */
+	septetcount = (udhlen) ? UDH_SEPTETS(udhlen) : 0;
+	memset(septets, 0, septetcount);
 	
-	bzero(tmp, sizeof(tmp));
-	
-	for (character = 0; ((character + ext_characters) < 160) && (character < asciiLength); character++)  {
+	for (character = 0; septetcount < MO_SEPTETS && character < asciiLength; character++) {
 		if (convert_charset) {
 			// Is the character an extended character?
 			converted = ext_convert(ascii[character], CS_ISO, CS_SMS);
 			if (converted != ' ') {
-				counted_characters++;
 				// It is an extended character. Insert ESC first.
-				for (bit=0; bit < 7; bit++) {
-					pdubitnr = 7* (character + ext_characters) + bit;
-					pdubyteposition = pdubitnr / 8;
-					pdubitposition = pdubitnr % 8;
-					if (0x1B & (1 << bit))
-						tmp[pdubyteposition] = tmp[pdubyteposition] | (1 << pdubitposition);
-					else
-						tmp[pdubyteposition] = tmp[pdubyteposition] & ~(1 << pdubitposition);
-				}
-				ext_characters++;
+				septets[septetcount++] = 0x1B;
 			} else // Is is a regular character
 				converted = convert(ascii[character], CS_ISO, CS_SMS);
 		} else
 			converted = ascii[character];
 		
-		counted_characters++;
-		for (bit=0; bit < 7; bit++) {
-			pdubitnr = 7* (character + ext_characters) + bit;
-			pdubyteposition = pdubitnr / 8;
-			pdubitposition = pdubitnr % 8;
-			if (converted & (1 << bit))
-				tmp[pdubyteposition] = tmp[pdubyteposition] | (1 << pdubitposition);
-			else
-				tmp[pdubyteposition] = tmp[pdubyteposition] & ~(1 << pdubitposition);
-		}
-		
+		septets[septetcount++] = converted;
 	}
 	
-	tmp[pdubyteposition + 1] = 0;
-	pdu[0] = 0;
+	l = septet_pack(septets, septetcount, octets);
+	memcpy(octets, udh, udhlen);
 	
-	for (character = 0; character <= pdubyteposition; character++) {
-		sprintf(octet, "%02X", (unsigned char)tmp[character]);
-		strcat(pdu, octet);
+	for (i = 0; i < l; i++) {
+		*pdu++ = hexdigits[octets[i] >> 4];
+		*pdu++ = hexdigits[octets[i] & 15];
 	}
+	*pdu = 0;
 	
-	return counted_characters;
+	return septetcount;
 }
 
 /*
- *	Set up a PDU
+ *	Set up a PDU, for the next part if the message is concatenated
  */
 int mo_create_pdu(struct message *m, char *pdu)
 {
@@ -1248,6 +1939,9 @@ int mo_create_pdu(struct message *m, char *pdu)
 	char tmp[53];
 	char tmp2[500];
 	char *dstp;
+	unsigned char udh[CONCAT_UDH16];
+	int udhlen = 0;
+	int start, end;
 	
 	hlog(LOG_DEBUG, "[%s] Setting up a PDU", m->msgid);
 	
@@ -1284,6 +1978,16 @@ int mo_create_pdu(struct message *m, char *pdu)
 		}
 	}
 	
+	if (m->parts > 1) {
+		udhlen = mo_concat_udh(m, udh);
+		flags |= 1 << 6; /* user data header */
+		start = m->part_ofs[m->parts_sent];
+		end = m->part_ofs[m->parts_sent + 1];
+	} else {
+		start = 0;
+		end = m->len;
+	}
+	
 	if (m->request_report)
 		flags |= 1 << 5;
 	
@@ -1293,12 +1997,15 @@ int mo_create_pdu(struct message *m, char *pdu)
 		coding = m->dcs;
 	
 	if (m->is_binary) {
-		bin2hexstring(m->content, m->len, tmp2);
-		len = m->len;
+		bin2hexstring((char *)udh, udhlen, tmp2);
+		bin2hexstring(m->content + start, end - start, tmp2 + udhlen * 2);
+		len = udhlen + end - start;
+		if (len > MO_OCTETS)
+			len = MO_OCTETS;
 	} else
-		len = mo_encode_ascii(m->content, tmp2);
+		len = mo_encode_ascii(m->content + start, end - start, udh, udhlen, tmp2);
 	
-	hlog(LOG_DEBUG, "[%s] pid %d dcs %d%s", m->msgid, m->pid, coding, (m->has_udh) ? " UDH" : "");
+	hlog(LOG_DEBUG, "[%s] pid %d dcs %d%s", m->msgid, m->pid, coding, (flags & 1 << 6) ? " UDH" : "");
 	
 	sprintf(pdu, "00%02X00%02X%02X%s%02X%02XAA%02X", flags, (unsigned int)strlen(dstp), toa, tmp, m->pid, coding, (unsigned int)len);
 	strcat(pdu, tmp2);
@@ -1307,191 +2014,360 @@ int mo_create_pdu(struct message *m, char *pdu)
 }
 
 /*
- *	Send a MO message
+ *	Find the next retry deadline in the MO queue, and set the retry
+ *	timer to go off then
  */
 
-int mo_transmit(int f, struct message *m)
+void schedule_retries(void)
 {
-	char pdu[IBLEN];
-	char buf[IBLEN];
-	char *p;
-	int i;
-	int retval;
+	struct message *q;
 	
-	stats_mo_tries++;
-	m->tries++;
-	
-	if (m->is_binary) {
-		bin2hexstring(m->content, m->len, pdu);
-		hlog(LOG_NOTICE, "[%s] MESSAGE MO to %s try %d type binary length %d content %s",
-			m->msgid, m->dst, m->tries, m->len, pdu);
-	} else {
-		ascii2escaped(m->content, m->len, pdu, IBLEN);
-		hlog(LOG_NOTICE, "[%s] MESSAGE MO to %s try %d type text length %d content \"%s\"",
-			m->msgid, m->dst, m->tries, m->len, pdu);
-	}
-	
-	mo_create_pdu(m, pdu);
-	
-	hlog(LOG_DEBUG, "[%s] Sending PDU length to module", m->msgid);
-	fdprintf(f, "AT+CMGS=%d\r\n", strlen(pdu) / 2 - 1);
-	
-rewait_mo_recnum:
-	
-	i = readuntil(f, buf, IBLEN, expect_mo_transmit, expect_errors, cmd_timeout);
-	if (i > 0) {
-		if (string_in(buf, expect_mt)) {
-			hlog(LOG_INFO, "[%s] Got MT message in response to AT+CMGS! Reading the rest and handling.", m->msgid);
-			p = buf + i;
-			i = readuntil(f, p, buf + IBLEN - p, expect_linefeed, expect_errors, cmd_timeout);
-			if (i < 0) {
-				hlog(LOG_ERR, "I/O error on module while reading MT");
-				retval = -1;
-				goto ret;
-			}
-			p += i;
-			i = readuntil(f, p, buf + IBLEN - p, expect_linefeed, expect_errors, cmd_timeout);
-			if (i < 0) {
-				hlog(LOG_ERR, "I/O error on module while reading MT");
-				retval = -1;
-				goto ret;
-			}
-			
-			
-			p = buf;
-			while ((p = strstr(p, "CMT:")))
-				p = mt_handle_pdu(p, f);
-			p = buf;
-			while ((p = strstr(p, "CBM:")))
-				p = mt_handle_pdu(p, f);
-			p = buf;
-			while ((p = strstr(p, "CDS:")))
-				p = mt_handle_pdu(p, f);
-				
-			goto rewait_mo_recnum;
-		}
-		if (string_in(buf, expect_errors)) {
-			hlog(LOG_ERR, "[%s] Error response to AT+CMGS!", m->msgid);
-			retval = -2;
-			goto ret;
-		}
-	} else if (i < 1) {
-		hlog(LOG_ERR, "[%s] No OK response to AT+CMGS: I/O error!", m->msgid);
-		retval = -1;
-		goto ret;
-	} else if (i == 0) {
-		hlog(LOG_ERR, "[%s] Timeout for AT+CMGS !", m->msgid);
-		retval = -3;
-		goto ret;
+	if (!(q = mo_queue_first())) {
+		ev_timer_stop(retry_timer);
+		return;
 	}
 	
-	hlog(LOG_DEBUG, "[%s] Sending PDU to module", m->msgid);
-	fdprintf(f, "%s\x1A", pdu);
-	
-rewait_mo_pdu:
-
-	i = readuntil(f, buf, IBLEN, expect_ok_or_mt, expect_errors, transmit_timeout);
-	if (i > 0) {
-		if (string_in(buf, expect_mt)) {
-			hlog(LOG_INFO, "[%s] Got MT message in response to MO PDU! Reading the rest and handling.", m->msgid);
-			p = buf + i;
-			i = readuntil(f, p, buf + IBLEN - p, expect_linefeed, expect_errors, cmd_timeout);
-			if (i < 0) {
-				hlog(LOG_ERR, "I/O error on module while reading MT");
-				retval = -1;
-				goto ret;
-			}
-			p += i;
-			i = readuntil(f, p, buf + IBLEN - p, expect_linefeed, expect_errors, cmd_timeout);
-			if (i < 0) {
-				hlog(LOG_ERR, "I/O error on module while reading MT");
-				retval = -1;
-				goto ret;
-			}
-			
-			p = buf;
-			while ((p = strstr(p, "CMT:")))
-				p = mt_handle_pdu(p, f);
-			p = buf;
-			while ((p = strstr(p, "CBM:")))
-				p = mt_handle_pdu(p, f);
-			p = buf;
-			while ((p = strstr(p, "CDS:")))
-				p = mt_handle_pdu(p, f);
-				
-			goto rewait_mo_pdu;
-		} else if (string_in(buf, expect_errors)) {
-			hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:FAILED time:%d try:%d Error response to AT+CMGS !", m->msgid, time(NULL) - m->received, m->tries);
-			retval = -2;
-			goto ret;
-		} else if (string_in(buf, expect_ok)) {
-			hlog(LOG_NOTICE, "[%s] MESSAGE MO RESULT:OK time:%d try:%d", m->msgid, time(NULL) - m->received, m->tries);
-			retval = 0;
-			goto ret;
-		}
-		hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:FAILED time:%d try:%d Unknown response to AT+CMGS !", m->msgid, time(NULL) - m->received, m->tries);
-		retval = -2;
-	} else if (i < 1) {
-		hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:FAILED time:%d try:%d No OK response to AT+CMGS: I/O error!", m->msgid, time(NULL) - m->received, m->tries);
-		retval = -1;
-	} else if (i == 0) {
-		hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:FAILED time:%d try:%d Timeout for AT+CMGS !", m->msgid, time(NULL) - m->received, m->tries);
-		retval = -3;
-	}
-	
-ret:
-	if (retval)
-		stats_mo_try_fail++;
-	else
-		stats_mo_ok++;
-	
-	return retval;
+	ev_timer_set(retry_timer, (q->next_try - time(NULL)) * 1000);
 }
 
 /*
- *	Check for queued messages, send the ones that need to be sent,
- *	return number of messages attempted
+ *	Something changed so that MO messages might be sendable: a module
+ *	became available or new messages appeared
  */
 
-int send_retries(int f, struct message *q)
+void mo_kick(void)
 {
-	struct message *next;
-	int c = 0;
-	time_t now;
-	
-	time(&now);
-	while (q) {
-		next = q->next; /* store the next item in case we free this one */
-		
-		if (q->next_try <= now) {
-			c++;
-			/* attempt delivery */
-			state_change(STATE_UP_SENDING_MO, "Sending MO retry for [%s]", q->msgid);
-			if (mo_transmit(f, q)) {
-				/* failed */
-				if (q->tries >= mo_queue_max_tries) {
-					/* too many times, drop! */
-					hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:DROPPED time:%d try:%d Retry count exceeded!", q->msgid, time(NULL) - q->received, q->tries);
-					unqueue_message(q);
-					free_message(q);
-					stats_mo_dropped++;
-				} else {
-					/* calculate next retry time */
-					q->retry_time *= mo_queue_retry_mult;
-					if (q->retry_time > mo_queue_max_retryt)
-						q->retry_time = mo_queue_max_retryt;
-					q->next_try = time(NULL) + q->retry_time;
-					hlog(LOG_DEBUG, "[%s] QUEUE: Retry failed, queuing message for %d seconds", q->msgid, q->retry_time);
-				}
-			} else {
-				/* retry succeed, free it */
-				hlog(LOG_DEBUG, "[%s] QUEUE: Retry succeeded, removing from queue", q->msgid);
-				unqueue_message(q);
-				free_message(q);
-			}
+	ev_timer_set(spool_timer, 0);
+	schedule_retries();
+}
+
+/*
+ *	Something went wrong with a module, have the main loop take care
+ *	of it. Only the first problem counts.
+ */
+
+void modem_trouble(struct modem *md, int op, int delay, const char *reason)
+{
+	if (!md->at || md->op_status != OP_RUNNING)
+		return;
+	
+	md->op_status = op;
+	md->op_delay = delay;
+	md->op_reason = reason;
+}
+
+/*
+ *	Send a MO message
+ */
+
+void mo_sent(struct modem *md, struct message *m, int i);
+void mo_transmit(struct modem *md, struct message *m);
+
+void mo_transmit_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	struct message *m = arg;
+	char part[32];
+	char what[80];
+	int done;
+	
+	if (m->parts > 1)
+		snprintf(part, sizeof(part), " part:%d/%d", m->parts_sent + 1, m->parts);
+	else
+		part[0] = 0;
+	
+	/* the first try of a message shows the spool pickup, the last part the total */
+	m->tl[TL_CMGS] = c->sent;
+	m->tl[TL_PROMPT] = c->prompted;
+	tl_stamp(m->tl, TL_RESULT);
+	done = (c->result == AT_OK && m->parts_sent + 1 >= m->parts);
+	snprintf(what, sizeof(what), "MO try:%d%s result:%s", m->tries, part, (c->result == AT_OK) ? "OK" : "FAILED");
+	tl_report(m->msgid, what, m->tl, (m->tries == 1 && m->parts_sent == 0) ? TS_MO_SPOOL : TS_MO_QUEUE,
+		(done) ? TS_MO_TOTAL : TS_MO_SUBMIT);
+	/* the next part or try waits for a module from here */
+	m->tl[TL_QUEUED] = m->tl[TL_RESULT];
+	
+	if (c->result == AT_OK && m->parts_sent + 1 < m->parts) {
+		/* a part of a concatenated message went, send the next one right away */
+		hlog(LOG_INFO, "[%s] MESSAGE MO PART OK time:%d try:%d%s", m->msgid, time(NULL) - m->received, m->tries, part);
+		m->parts_sent++;
+		m->tries = 0;
+		m->retry_time = 0;
+		journal_update(m);
+		if (md->op_status == OP_RUNNING) {
+			mo_transmit(md, m);
+			return;
+		}
+		/* the module is going away, the rest go later */
+		mo_sent(md, m, AT_IO);
+		return;
+	}
+	
+	switch (c->result) {
+	case AT_OK:
+		hlog(LOG_NOTICE, "[%s] MESSAGE MO RESULT:OK time:%d try:%d%s", m->msgid, time(NULL) - m->received, m->tries, part);
+		break;
+	case AT_ERROR:
+		hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:FAILED time:%d try:%d%s Error response to AT+CMGS !", m->msgid, time(NULL) - m->received, m->tries, part);
+		break;
+	case AT_TIMEOUT:
+		hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:FAILED time:%d try:%d%s Timeout for AT+CMGS%s !", m->msgid, time(NULL) - m->received, m->tries, part,
+			(c->state == AT_DATA_SENT) ? "" : " prompt");
+		break;
+	default:
+		hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:FAILED time:%d try:%d%s No OK response to AT+CMGS: I/O error!", m->msgid, time(NULL) - m->received, m->tries, part);
+	}
+	
+	if (c->result == AT_OK) {
+		stats_mo_ok++;
+		md->stats_mo_ok++;
+	} else {
+		stats_mo_try_fail++;
+		md->stats_mo_try_fail++;
+	}
+	
+	mo_sent(md, m, c->result);
+}
+
+void mo_transmit(struct modem *md, struct message *m)
+{
+	char pdu[IBLEN];
+	char cmd[32];
+	char part[32];
+	int start, len;
+	
+	stats_mo_tries++;
+	m->tries++;
+	tl_clear(m->tl, TL_TRY, TL_RESULT);
+	
+	if (m->parts > 1) {
+		start = m->part_ofs[m->parts_sent];
+		len = m->part_ofs[m->parts_sent + 1] - start;
+		snprintf(part, sizeof(part), " part %d/%d", m->parts_sent + 1, m->parts);
+	} else {
+		start = 0;
+		len = m->len;
+		part[0] = 0;
+	}
+	
+	if (!hlog_on(LOG_NOTICE)) {
+		/* no need to escape the content */
+	} else if (m->is_binary) {
+		bin2hexstring(m->content + start, len, pdu);
+		hlog(LOG_NOTICE, "[%s] MESSAGE MO to %s try %d%s via %s type binary length %d content %s",
+			m->msgid, m->dst, m->tries, part, md->device, len, pdu);
+	} else {
+		ascii2escaped(m->content + start, len, pdu, IBLEN);
+		hlog(LOG_NOTICE, "[%s] MESSAGE MO to %s try %d%s via %s type text length %d content \"%s\"",
+			m->msgid, m->dst, m->tries, part, md->device, len, pdu);
+	}
+	
+	tl_stamp(m->tl, TL_TRY);
+	mo_create_pdu(m, pdu);
+	tl_stamp(m->tl, TL_PDU);
+	
+	/* the PDU goes out when the module gives the prompt */
+	hlog(LOG_DEBUG, "[%s] Sending PDU to module", m->msgid);
+	snprintf(cmd, sizeof(cmd), "AT+CMGS=%d", (int)strlen(pdu) / 2 - 1);
+	at_send_data(md->at, cmd, pdu, cmd_timeout, transmit_timeout, mo_transmit_cb, m);
+}
+
+/*
+ *	Pick a module to send a MO message with: the one which got a MO
+ *	least recently, of those which are registered and idle
+ */
+
+struct modem *pick_modem(void)
+{
+	struct modem *md, *best = NULL;
+	
+	for (md = modems; (md); md = md->next)
+		if (md->state == STATE_UP_SLEEPING && md->op_status == OP_RUNNING
+		    && (!best || md->mo_seq < best->mo_seq))
+			best = md;
+	
+	if (best)
+		best->mo_seq = ++mo_seq;
+	
+	return best;
+}
+
+/*
+ *	Start sending a MO message using a module
+ */
+
+void mo_cmms_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	
+	if (c->result == AT_ERROR) {
+		hlog(LOG_INFO, "%s: Module does not support AT+CMMS, not keeping the link open between messages", md->device);
+		md->no_cmms = 1;
+	}
+}
+
+/*
+ *	Milliseconds elapsed since a CLOCK_MONOTONIC time
+ */
+
+long ms_since(struct timespec *t)
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/*
+ *	Stop sending MO messages back to back on a module
+ */
+
+void mo_drain_end(struct modem *md)
+{
+	long ms;
+	
+	if (!md->draining)
+		return;
+	
+	md->draining = 0;
+	ms = ms_since(&md->drain_start);
+	stats_mo_drains++;
+	stats_mo_drained += md->drain_sent;
+	stats_mo_drain_ms += ms;
+	hlog(LOG_DEBUG, "%s: Sent %ld MO messages back to back in %ld ms", md->device, md->drain_sent, ms);
+	
+	/* let the network release the link */
+	if (md->at && md->op_status == OP_RUNNING && !md->no_cmms)
+		at_send(md->at, "AT+CMMS=0", cmd_timeout, NULL, NULL);
+}
+
+/*
+ *	A MO went: if there are more waiting, keep the module sending them
+ *	one after another for up to drain_slice ms with the link to the
+ *	network held open, and only then poll it. Incoming messages
+ *	given as URCs are handled in between as usual.
+ */
+
+void mo_drain(struct modem *md, int ok)
+{
+	if (drain_slice > 0 && md->op_status == OP_RUNNING && mo_work_waiting()) {
+		if (!md->draining) {
+			md->draining = 1;
+			md->drain_sent = 0;
+			clock_gettime(CLOCK_MONOTONIC, &md->drain_start);
+			hlog(LOG_DEBUG, "%s: MO messages waiting, sending them back to back", md->device);
+			if (!md->no_cmms)
+				at_send(md->at, "AT+CMMS=2", cmd_timeout, mo_cmms_cb, NULL);
+		}
+		if (ok)
+			md->drain_sent++;
+		if (ms_since(&md->drain_start) < drain_slice)
+			return;
+	}
+	
+	/* out of messages or time, poll now */
+	mo_drain_end(md);
+	ev_timer_set(md->poll_timer, 0);
+}
+
+void mo_send(struct modem *md, struct message *m)
+{
+	state_change(md, STATE_UP_SENDING_MO, "Sending MO [%s]", m->msgid);
+	m->sending = 1;
+	requeue_message(m);
+	
+	/* keep the link to the network open between the parts */
+	if (m->parts - m->parts_sent > 1 && !md->no_cmms && !md->draining)
+		at_send(md->at, "AT+CMMS=1", cmd_timeout, mo_cmms_cb, NULL);
+	
+	mo_transmit(md, m);
+}
+
+/*
+ *	A MO transmission is done. Queue the message for a retry if it
+ *	failed. If the module failed, the message is retried right
+ *	away on another one, if there are others.
+ */
+
+void mo_sent(struct modem *md, struct message *m, int i)
+{
+	m->sending = 0;
+	if (md->state == STATE_UP_SENDING_MO)
+		state_change(md, STATE_UP_SLEEPING, "Waiting for something to happen");
+	
+	if (i == AT_OK) {
+		if (m->qidx) {
+			hlog(LOG_DEBUG, "[%s] QUEUE: Retry succeeded, removing from queue", m->msgid);
+			unqueue_message(m);
+		}
+		journal_done(m, 1);
+		free_message(m);
+	} else if (m->tries >= mo_queue_max_tries) {
+		/* too many times, drop! */
+		hlog(LOG_ERR, "[%s] MESSAGE MO RESULT:DROPPED time:%d try:%d Retry count exceeded!", m->msgid, time(NULL) - m->received, m->tries);
+		if (m->qidx)
+			unqueue_message(m);
+		journal_done(m, 0);
+		free_message(m);
+		stats_mo_dropped++;
+	} else {
+		if (i == AT_IO || i == AT_TIMEOUT)
+			/* it's the module which is not well */
+			modem_trouble(md, OP_RECONNECT, 1, "Module failed while sending MO");
+		
+		if ((i == AT_IO || i == AT_TIMEOUT) && modem_count > 1) {
+			/* give it to another module right away */
+			m->next_try = time(NULL);
+			hlog(LOG_DEBUG, "[%s] QUEUE: Moving message to another module", m->msgid);
+		} else {
+			/* calculate next retry time */
+			if (m->retry_time)
+				m->retry_time *= mo_queue_retry_mult;
+			else
+				m->retry_time = mo_queue_init_retryt;
+			if (m->retry_time > mo_queue_max_retryt)
+				m->retry_time = mo_queue_max_retryt;
+			m->next_try = time(NULL) + m->retry_time;
+			hlog(LOG_DEBUG, "[%s] QUEUE: %s, queuing message for %d seconds", m->msgid,
+				(m->qidx) ? "Retry failed" : "First try failed", m->retry_time);
 		}
+		journal_update(m);
 		
-		q = next;
+		if (m->qidx)
+			requeue_message(m);
+		else
+			queue_message(m);
+	}
+	
+	/* poll right after a MO unless there are more to send, and look for them */
+	if (md->at)
+		mo_drain(md, i == AT_OK);
+	mo_kick();
+}
+
+/*
+ *	Send the queued messages which are due using the modules which
+ *	are free, return number of messages attempted. Messages being
+ *	sent sink to the bottom of the queue, so the due ones are taken
+ *	from the top until one is not due yet. A message failing right
+ *	away may come back to the top, so don't try more than the queue
+ *	had to begin with.
+ */
+
+int send_retries(void)
+{
+	struct message *q;
+	struct modem *md;
+	long c = 0, max = stats_mo_queue_len;
+	time_t now;
+	
+	time(&now);
+	while (c < max && (q = mo_queue_first()) && q->next_try <= now) {
+		if (!(md = pick_modem()))
+			break;
+		c++;
+		/* attempt delivery */
+		mo_send(md, q);
 	}
 	
 	if (c)
@@ -1504,17 +2380,15 @@ int send_retries(int f, struct message *q)
  *	Handle an SMS spool file
  */
  
-int handle_spoolfile(int f, char *fn)
+int handle_spoolfile(struct modem *md, char *fn, struct timespec *seen)
 {
 	FILE *sf;
 	struct message *m;
 	char s[IBLEN];
-	int l, i;
-	char bin[IBLEN], *p;
+	int l, i, size;
+	char *content, *p;
 	
-	state_change(STATE_UP_SENDING_MO, "Sending MO from %s", fn);
-	
-	if (!(sf = fopen(fn, "r"))) {
+	if (!(sf = fopen(fn, "re"))) {
 		hlog(LOG_ERR, "Could not open %s for reading: %s", fn, strerror(errno));
 		if (unlink(fn))
 			hlog(LOG_ERR, "Could not unlink %s: %s", fn, strerror(errno));
@@ -1524,6 +2398,7 @@ int handle_spoolfile(int f, char *fn)
 	m = alloc_message();
 	m->msgid = hstrdup(genmsgid("mo"));
 	m->received = time(NULL);
+	m->tl[TL_SEEN] = *seen;
 	m->spoolfile = hstrdup(fn);
 	hlog(LOG_DEBUG, "[%s] Reading MO spool file %s", m->msgid, fn);
 	
@@ -1560,42 +2435,47 @@ int handle_spoolfile(int f, char *fn)
 			hlog(LOG_WARNING, "[%s] %s: Ignoring unsupported header: \"%s\"", m->msgid, fn, s);
 		}
 	}
-	l = fread(s, 1, IBLEN-1, sf);
-	if (l >= 0)
-		s[l] = 0;
+	/* the rest is content, however long */
+	size = IBLEN;
+	l = 0;
+	content = hmalloc(size);
+	while ((i = fread(content + l, 1, size - l - 1, sf)) > 0) {
+		l += i;
+		if (l == size - 1) {
+			size *= 2;
+			content = hrealloc(content, size);
+		}
+	}
+	content[l] = 0;
 	
 	if (m->is_binary) {
-		while ((p = strchr(s, '\n'))) *p = '\0';
-		while ((p = strchr(s, '\r'))) *p = '\0';
-		l = strlen(s);
+		l = strcspn(content, "\r\n");
 		if (l % 2)
 			hlog(LOG_ERR, "[%s] %s: Hex-encoded binary content length is odd! Losing one nybble.", m->msgid, fn);
 		m->len = l / 2;
-		/* convert from hex to binary */
+		/* convert from hex to binary, in place */
 		for (i  = 0; i < m->len; i++)
-			bin[i] = octet2bin(&s[i*2]);
-		m->content = hmalloc(m->len);
-		memcpy(m->content, bin, m->len);
+			content[i] = octet2bin(&content[i*2]);
+		m->content = hrealloc(content, (m->len) ? m->len : 1);
 	} else {
-		m->content = strdup(s);
+		m->content = content;
 		m->len = strlen(m->content);
 	}
 	
+	mo_segment(m);
+	journal_enqueue(m);
+	tl_stamp(m->tl, TL_PARSED);
+	m->tl[TL_QUEUED] = m->tl[TL_PARSED];
+	
 	if (fclose(sf))
 		hlog(LOG_ERR, "[%s] Could not close %s after reading: %s", m->msgid, fn, strerror(errno));
 	
 	stats_mo++;
 	
-	if (mo_transmit(f, m)) {
-		m->retry_time = mo_queue_init_retryt;
-		m->next_try = time(NULL) + m->retry_time;
-		hlog(LOG_DEBUG, "[%s] QUEUE: First try failed, queuing message for %d seconds", m->msgid, m->retry_time);
-		queue_message(m);
-	} else
-		free_message(m);
+	mo_send(md, m);
 	
-	if (unlink(fn))
-		hlog(LOG_ERR, "[%s] Could not unlink %s: %s", m->msgid, fn, strerror(errno));
+	/* the spool file goes when the message is safe in the journal */
+	journal_unlink(fn);
 	
 	return 0;
 }
@@ -1615,19 +2495,121 @@ int select_spoolf(char *fn)
 }
 
 /*
- *	Check input SMS spool
+ *	Spool files known to be waiting, oldest first, so that they are
+ *	sent in the order they were written. A directory scan sorts them
+ *	by modification time, and the inotify watch adds new files to the
+ *	end as they appear. The whole directory is only scanned at startup,
+ *	when the watch lost events, or periodically if there is no watch.
  */
 
-int check_spool(int f)
+struct spool_pending {
+	struct spool_pending *next;
+	char *fn;			/* full path */
+	time_t mtime;			/* when the file was written */
+	struct timespec seen;		/* when it was noticed */
+};
+
+struct spool_pending *spool_pending = NULL;
+struct spool_pending **spool_pending_tail = &spool_pending;
+int spool_rescan = 1;			/* the directory needs to be scanned */
+
+struct spool_pending *spool_pending_new(char *name, time_t mtime)
 {
-	int c = 0;
-	char *s;
+	struct spool_pending *p;
+	
+	p = hmalloc(sizeof(*p));
+	p->fn = hmalloc(strlen(spool_dir) + 2 + strlen(name));
+	sprintf(p->fn, "%s/%s", spool_dir, name);
+	p->mtime = mtime;
+	clock_gettime(CLOCK_MONOTONIC, &p->seen);
+	p->next = NULL;
+	
+	return p;
+}
+
+void spool_pending_add(struct spool_pending *p)
+{
+	*spool_pending_tail = p;
+	spool_pending_tail = &p->next;
+	stats_spool_backlog++;
+}
+
+/*
+ *	Age of the oldest file waiting in the spool, in seconds
+ */
+
+long spool_oldest_age(void)
+{
+	time_t now;
+	
+	if (!spool_pending)
+		return 0;
+	
+	time(&now);
+	return (now > spool_pending->mtime) ? now - spool_pending->mtime : 0;
+}
+
+/*
+ *	Take the next file off the pending list, return a hmalloc'd path,
+ *	and when it was noticed in seen if that is not NULL
+ */
+
+char *spool_pending_get(struct timespec *seen)
+{
+	struct spool_pending *p;
+	char *fn;
+	
+	if (!(p = spool_pending))
+		return NULL;
+	
+	if (!(spool_pending = p->next))
+		spool_pending_tail = &spool_pending;
+	stats_spool_backlog--;
+	if (seen)
+		*seen = p->seen;
+	fn = p->fn;
+	hfree(p);
+	
+	return fn;
+}
+
+void spool_pending_clear(void)
+{
+	char *fn;
+	
+	while ((fn = spool_pending_get(NULL)))
+		hfree(fn);
+}
+
+/*
+ *	Order spool files by modification time, then by name
+ */
+
+int spool_pending_cmp(const void *a, const void *b)
+{
+	const struct spool_pending *pa = *(const struct spool_pending **)a;
+	const struct spool_pending *pb = *(const struct spool_pending **)b;
+	
+	if (pa->mtime != pb->mtime)
+		return (pa->mtime < pb->mtime) ? -1 : 1;
+	
+	return strcmp(pa->fn, pb->fn);
+}
+
+/*
+ *	Scan the spool directory, replacing the pending list
+ */
+
+int scan_spool(void)
+{
+	int c = 0, size = 0, i;
 	DIR *d;
 	struct dirent *de;
 	struct stat sb;
-#ifdef DISABLE_UNSOL_WHILE_SENDING_MO /* this didn't help - this made things worse */
-	int polling = 1;
-#endif
+	struct spool_pending **files = NULL;
+	
+	spool_rescan = 0;
+	spool_pending_clear();
 	
 	if (!(d = opendir(spool_dir))) {
 		hlog(LOG_ERR, "Could not open directory %s: %s", spool_dir, strerror(errno));
@@ -1635,51 +2617,104 @@ int check_spool(int f)
 	}
 	
 	errno = 0;
-	while ((de = readdir(d)))
-		if (select_spoolf(de->d_name)) {
-			c++;
-			hlog(LOG_INFO, "Found SMS spool file: %s", de->d_name);
-			s = hmalloc(strlen(spool_dir) + 2 + strlen(de->d_name));
-			sprintf(s, "%s/%s", spool_dir, de->d_name);
-			if (stat(s, &sb)) {
+	while ((de = readdir(d))) {
+		if (!select_spoolf(de->d_name))
+			continue;
+		/* the ones which can't be stat()ed go first, to be cleaned up */
+		if (fstatat(dirfd(d), de->d_name, &sb, 0))
+			sb.st_mtime = 0;
+		if (c == size) {
+			size = (size) ? size * 2 : 64;
+			files = hrealloc(files, size * sizeof(*files));
+		}
+		files[c++] = spool_pending_new(de->d_name, sb.st_mtime);
+		errno = 0;
+	}
+	
+	if (errno)
+		hlog(LOG_ERR, "Error while reading directory %s: %s", spool_dir, strerror(errno));
+		
+	if (closedir(d))
+		hlog(LOG_ERR, "Could not close directory %s: %s", spool_dir, strerror(errno));
+	
+	if (c) {
+		qsort(files, c, sizeof(*files), spool_pending_cmp);
+		for (i = 0; i < c; i++)
+			spool_pending_add(files[i]);
+		hfree(files);
+		hlog(LOG_DEBUG, "Spool directory scan found %d files, oldest %ld s", c, spool_oldest_age());
+	}
+	
+	return c;
+}
+
+/*
+ *	Check input SMS spool, send the next file on the pending list
+ */
+
+int check_spool(struct modem *md)
+{
+	char *s;
+	struct stat sb;
+	struct timespec seen;
+	
+	if (spool_rescan || (!spool_pending && spool_watch_fd < 0))
+		if (scan_spool() < 0)
+			return -1;
+	
+	while ((s = spool_pending_get(&seen))) {
+		if (journal_unlinking(s)) {
+			/* already taken, waiting for the journal sync */
+			hfree(s);
+			continue;
+		}
+		if (stat(s, &sb)) {
+			/* noticed twice, or removed by someone else */
+			if (errno != ENOENT) {
 				hlog(LOG_ERR, "Could not stat %s: %s - Deleting!", s, strerror(errno));
 				if (unlink(s))
 					hlog(LOG_ERR, "Could not unlink spool file %s: %s", s, strerror(errno));
-			} else {
-				if (S_ISREG(sb.st_mode)) {
-#ifdef DISABLE_UNSOL_WHILE_SENDING_MO
-					if (polling) {
-						polling = 0;
-						hlog(LOG_DEBUG, "Disabling unsolicited SMS message indications");
-						issue_cmd(f, "AT+CNMI=0,0,0,0", "mofeed");
-					}
-#endif
-					handle_spoolfile(f, s);
-					hfree(s);
-					break;
-				} else {
-					hlog(LOG_ERR, "Spool file %s: Is not a regular file! Deleting!", s, strerror(errno));
-					if (unlink(s))
-						hlog(LOG_ERR, "Could not unlink spool file %s: %s", s, strerror(errno));
-				}
 			}
 			hfree(s);
+			continue;
+		}
+		if (!S_ISREG(sb.st_mode)) {
+			hlog(LOG_ERR, "Spool file %s: Is not a regular file! Deleting!", s);
+			if (unlink(s))
+				hlog(LOG_ERR, "Could not unlink spool file %s: %s", s, strerror(errno));
+			hfree(s);
+			continue;
 		}
-	
+		
+		hlog(LOG_INFO, "Found SMS spool file: %s", s);
+#ifdef DISABLE_UNSOL_WHILE_SENDING_MO /* this didn't help - this made things worse */
+		hlog(LOG_DEBUG, "Disabling unsolicited SMS message indications");
+		at_send(md->at, "AT+CNMI=0,0,0,0", cmd_timeout, NULL, NULL);
+#endif
+		handle_spoolfile(md, s, &seen);
+		hfree(s);
 #ifdef DISABLE_UNSOL_WHILE_SENDING_MO
-	if (!polling) {
 		hlog(LOG_DEBUG, "Enabling unsolicited SMS message indications");
-		issue_cmd(f, "AT+CNMI=1,2,0,0", "mofeed");
-	}
+		at_send(md->at, "AT+CNMI=1,2,0,0", cmd_timeout, NULL, NULL);
 #endif
+		return 1;
+	}
 	
-	if (errno)
-		hlog(LOG_ERR, "Error while reading directory %s: %s", spool_dir, strerror(errno));
-		
-	if (closedir(d))
-		hlog(LOG_ERR, "Could not close directory %s: %s", spool_dir, strerror(errno));
+	return 0;
+}
+
+/*
+ *	Are there MO messages which could be sent right now
+ */
+
+int mo_work_waiting(void)
+{
+	struct message *q;
 	
-	return c;
+	if (spool_pending || spool_rescan)
+		return 1;
+	
+	return ((q = mo_queue_first()) && q->next_try <= time(NULL));
 }
 
 /*
@@ -1706,130 +2741,688 @@ char *next_key(char **where)
 }
 
 /*
- *	Poll signal strength from module
+ *	Poll signal strength from module: AT^MONI and AT+COPS? go out
+ *	together, and the network status is put together when both are done
  */
 
-int poll_signal(int f)
+void poll_moni_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
 {
-	char buf[IBLEN];
+	struct modem *md = ch->arg;
 	char *p, *e;
 	char *chan, *rs, *dbm, *plmn, *lac, *cell, *rxlev;
 	
-#ifndef DISABLED_FOR_SOME_REASON
-	if (net_status) {
-		hfree(net_status);
-		net_status = NULL;
-	}
-	
-	if (hwrite(f, "AT^MONI\r\n") < 1) {
-		hlog(LOG_ERR, "I/O error on module, reconnecting");
-		return -2;
+	if (c->result == AT_IO || c->result == AT_TIMEOUT) {
+		hlog(LOG_ERR, "%s: No response to AT^MONI, reconnecting", md->device);
+		modem_trouble(md, OP_RECONNECT, 1, "Module connection failed");
+		return;
 	}
 	
-	if (readuntil(f, buf, IBLEN, expect_ok, expect_errors, cmd_timeout) < 1) {
-		hlog(LOG_ERR, "No response to AT^MONI, reconnecting");
-		return -2;
+	if (c->result == AT_ERROR) {
+		hlog(LOG_ERR, "%s: Module responded with an ERROR for AT^MONI, checking registration", md->device);
+		md->poll_fail = 1;
+		return;
 	}
 	
-	if (string_in(buf, expect_errors)) {
-		hlog(LOG_ERR, "Module responded with an ERROR for AT^MONI");
-		if (wait_registration(f)) {
-			state_change(STATE_DOWN_FAILQUIT, "Fatal error while checking for network status, giving up");
-			return -1;
-		}
-	} else {
-		/* check for queued or unsolicited messages in buffer */
-		p = buf;
-		while ((p = strstr(p, "CMT:")))
-			p = mt_handle_pdu(p, f);
-		p = buf;
-		while ((p = strstr(p, "CBM:")))
-			p = mt_handle_pdu(p, f);
-		p = buf;
-		while ((p = strstr(p, "CDS:")))
-			p = mt_handle_pdu(p, f);
-		
-		if ((
-		    (p = strstr(buf, "\nchann rs  dBm  PLMN  LAC cell NCC BCC PWR RXLev  C1 "))
-		 || (p = strstr(buf, "\nchann rs  dBm  PLMN   LAI cell NCC BCC PWR RXlev C1 "))
-		    ) && (p = strchr(++p, '\n'))) {
-			p++;
-			if ((e = strchr(p, '\n'))) {
-				*e = 0;
-				if (strlen(p) < 52) {
-					//hlog(LOG_DEBUG, "MONI: Not connected to a network");
-				} else {
-					chan = rs = dbm = plmn = lac = cell = 0;
-					//hlog(LOG_DEBUG, "MONI: %s", p);
-					chan = next_key(&p);
-					rs = next_key(&p);
-					dbm = next_key(&p);
-					plmn = next_key(&p);
-					lac = next_key(&p);
-					cell = next_key(&p);
-					hfree(next_key(&p));
-					hfree(next_key(&p));
-					hfree(next_key(&p));
-					rxlev = next_key(&p);
-					/*hlog(LOG_DEBUG, "MONI: chan %s rs %s dbm %s plmn %s lac %s cell %s rxlev %s",
-						chan, rs, dbm, plmn, lac, cell, rxlev);
-					*/
-					if (chan && rs && dbm && plmn && lac && cell && rxlev) {
-						net_status = str_append(net_status, "channel:%s PLMN:%s LAC:%s cell:%s rs:%s/63 dBm:%s/%s",
-							chan, plmn, lac, cell, rs, dbm, rxlev);
-					}
-					if (chan) hfree(chan);
-					if (rs) hfree(rs);
-					if (dbm) hfree(dbm);
-					if (plmn) hfree(plmn);
-					if (lac) hfree(lac);
-					if (cell) hfree(cell);
-					if (rxlev) hfree(rxlev);
+	if ((
+	    (p = strstr(c->resp, "chann rs  dBm  PLMN  LAC cell NCC BCC PWR RXLev  C1 "))
+	 || (p = strstr(c->resp, "chann rs  dBm  PLMN   LAI cell NCC BCC PWR RXlev C1 "))
+	    ) && (p = strchr(p, '\n'))) {
+		p++;
+		if ((e = strchr(p, '\n'))) {
+			*e = 0;
+			if (strlen(p) < 52) {
+				//hlog(LOG_DEBUG, "MONI: Not connected to a network");
+			} else {
+				chan = rs = dbm = plmn = lac = cell = 0;
+				//hlog(LOG_DEBUG, "MONI: %s", p);
+				chan = next_key(&p);
+				rs = next_key(&p);
+				dbm = next_key(&p);
+				plmn = next_key(&p);
+				lac = next_key(&p);
+				cell = next_key(&p);
+				hfree(next_key(&p));
+				hfree(next_key(&p));
+				hfree(next_key(&p));
+				rxlev = next_key(&p);
+				/*hlog(LOG_DEBUG, "MONI: chan %s rs %s dbm %s plmn %s lac %s cell %s rxlev %s",
+					chan, rs, dbm, plmn, lac, cell, rxlev);
+				*/
+				if (chan && rs && dbm && plmn && lac && cell && rxlev) {
+					md->net_status = str_append(md->net_status, "channel:%s PLMN:%s LAC:%s cell:%s rs:%s/63 dBm:%s/%s",
+						chan, plmn, lac, cell, rs, dbm, rxlev);
 				}
+				if (chan) hfree(chan);
+				if (rs) hfree(rs);
+				if (dbm) hfree(dbm);
+				if (plmn) hfree(plmn);
+				if (lac) hfree(lac);
+				if (cell) hfree(cell);
+				if (rxlev) hfree(rxlev);
 			}
 		}
 	}
+}
+
+void poll_cnmi_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
 	
-	if (!net_status)
-		return -3;
-		
-	if (hwrite(f, "AT+COPS?\r\n") < 1) {
-		hlog(LOG_ERR, "I/O error on module, reconnecting");
-		return -2;
+	if (c->result != AT_OK) {
+		hlog(LOG_ERR, "%s: Could not enable unsolicited SMS message indications", md->device);
+		modem_trouble(md, OP_RECONNECT, 1, "Module connection failed");
+		return;
 	}
 	
-	if (readuntil(f, buf, IBLEN, expect_ok, expect_errors, cmd_timeout) < 1) {
-		hlog(LOG_ERR, "No response to AT+COPS?, reconnecting");
-		return -2;
+	state_change(md, STATE_UP_SLEEPING, "Waiting for something to happen");
+	
+	/* things might have been held back while polling */
+	mo_kick();
+}
+
+void poll_cops_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	char *p, *e;
+	
+	if (md->op_status != OP_RUNNING)
+		return;
+	
+	if (md->poll_fail) {
+		modem_trouble(md, OP_REREGISTER, 0, "Network status check failed");
+		return;
 	}
 	
-	if (string_in(buf, expect_errors)) {
-		hlog(LOG_ERR, "Module responded with an ERROR for AT+COPS?");
-		if (wait_registration(f)) {
-			state_change(STATE_DOWN_FAILQUIT, "Fatal error while checking for GSM network selection, giving up");
-			return -1;
-		}
+	if (!md->net_status) {
+		state_change(md, STATE_DOWN_NONETWORK, "No GSM network connection");
+		return;
+	}
+	
+	if (c->result == AT_IO || c->result == AT_TIMEOUT) {
+		hlog(LOG_ERR, "%s: No response to AT+COPS?, reconnecting", md->device);
+		modem_trouble(md, OP_RECONNECT, 1, "Module connection failed");
+		return;
+	}
+	
+	if (c->result == AT_ERROR) {
+		hlog(LOG_ERR, "%s: Module responded with an ERROR for AT+COPS?, checking registration", md->device);
+		modem_trouble(md, OP_REREGISTER, 0, "Network selection check failed");
+		return;
+	}
+	
+	if ((p = strstr(c->resp, "COPS: "))
+		&& (p = strchr(p, '"'))
+		&& (e = strchr(++p, '"'))) {
+		*e = 0;
+		md->net_status = str_append(md->net_status, " Operator:\"%s\"", p);
+	}
+	
+	at_send(md->at, "AT+CNMI=1,2,0,0", cmd_timeout, poll_cnmi_cb, NULL);
+}
+
+void poll_signal(struct modem *md)
+{
+	if (md->net_status) {
+		hfree(md->net_status);
+		md->net_status = NULL;
+	}
+	md->poll_fail = 0;
+	
+	at_send(md->at, "AT^MONI", cmd_timeout, poll_moni_cb, NULL);
+	at_send(md->at, "AT+COPS?", cmd_timeout, poll_cops_cb, NULL);
+}
+
+/*
+ *	Handle MT messages and status reports found in a buffer
+ */
+
+void handle_mt_buffer(char *buf, struct modem *md)
+{
+	char *p;
+	
+	p = buf;
+	while ((p = strstr(p, "CMT:")))
+		p = mt_handle_pdu(p, md, NULL);
+	p = buf;
+	while ((p = strstr(p, "CBM:")))
+		p = mt_handle_pdu(p, md, NULL);
+	p = buf;
+	while ((p = strstr(p, "CDS:")))
+		p = mt_handle_pdu(p, md, NULL);
+}
+
+/*
+ *	Poll the module for stored messages and network status
+ */
+
+void poll_cmgl_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	char *p, *indexes = NULL;
+	int i, stat, kept, bulk;
+	
+	if (c->result == AT_IO || c->result == AT_TIMEOUT) {
+		hlog(LOG_ERR, "%s: No response to AT+CMGL, reconnecting", md->device);
+		modem_trouble(md, OP_RECONNECT, 1, "Module connection failed");
+		return;
+	}
+	
+	if (c->result == AT_ERROR) {
+		hlog(LOG_ERR, "%s: Module responded with an ERROR for AT+CMGL, checking registration in 20s", md->device);
+		modem_trouble(md, OP_REREGISTER, 20, "Message listing failed");
+		return;
+	}
+	
+	/* handle the whole listing, then delete what was taken from it */
+	if (!handler_backlogged()) {
+		indexes = hmalloc(strlen(c->resp) + 1);
+		indexes[0] = 0;
+	}
+	/* one AT+CMGD=1,1 does, if every message listed is deleted, and
+	 * they all are received ones which the listing marked read
+	 */
+	bulk = 1;
+	p = c->resp;
+	while ((p = strstr(p, "CMGL:"))) {
+		if (sscanf(p + 5, "%d,%d", &i, &stat) != 2 || i < 0)
+			i = stat = -1;
+		kept = 0;
+		p = mt_handle_pdu(p, md, &kept);
+		if ((indexes) && i >= 0 && !kept)
+			sprintf(indexes + strlen(indexes), "%s%d", (indexes[0]) ? "," : "", i);
+		else
+			bulk = 0;
+		if (stat != 0 && stat != 1)
+			bulk = 0;
+	}
+	if ((indexes) && indexes[0])
+		mt_commit_delete(md, indexes, bulk);
+	else if (indexes)
+		hfree(indexes);
+	if (strstr(c->resp, "CMGL:")) {
+		/* If we got any messages using CMGL, we might not be receiving
+		 * unsolicited messages any more. Ack just to be sure.
+		 */
+		at_send(md->at, "AT+CNMA=1", cmd_timeout, NULL, NULL);
+	}
+	
+#ifndef DISABLED_FOR_SOME_REASON
+	poll_signal(md);
+#else
+	state_change(md, STATE_UP_SLEEPING, "Waiting for something to happen");
+	mo_kick();
+#endif
+}
+
+void poll_module(struct modem *md)
+{
+	if (md->state >= STATE_UP)
+		state_change(md, STATE_UP_POLLING, "Polling module");
+	/* check for MT */
+	hlog(LOG_DEBUG, "%s: Polling module", md->device);
+	
+	/* poll the device for queued messages every poll_time */
+	at_send(md->at, "AT+CMGL=4", cmd_timeout, poll_cmgl_cb, NULL);
+}
+
+/*
+ *	Module connection management
+ */
+
+/* Close the connection to a module */
+
+void modem_close(struct modem *md)
+{
+	struct at_chan *ch = md->at;
+	
+	ev_timer_stop(md->poll_timer);
+	ev_timer_stop(md->conn_timer);
+	md->cops_reset = 0;
+	
+	if (ch) {
+		/* aborted commands see that the module is gone */
+		md->at = NULL;
+		at_close(ch);
+	}
+	mo_drain_end(md);
+	mt_commit_forget(md);
+	
+	if (md->fd >= 0) {
+		close_device(md->fd);
+		md->fd = -1;
+	}
+}
+
+/* Close the connection to a module, and try again later */
+
+void modem_retry(struct modem *md, int delay, const char *reason)
+{
+	modem_close(md);
+	state_change(md, STATE_DOWN_RETRYSLEEP, "%s, sleeping %d seconds before retry", reason, delay);
+	hlog(LOG_INFO, "%s: %s, sleeping %d seconds before retry", md->device, reason, delay);
+	ev_timer_set(md->conn_timer, delay * 1000);
+}
+
+/* Give up on a module */
+
+void modem_fail(struct modem *md, int code, const char *reason)
+{
+	modem_close(md);
+	state_change(md, STATE_DOWN_FAILQUIT, "%s, giving up", reason);
+	hlog(LOG_CRIT, "%s: %s, giving up", md->device, reason);
+	exit_code = code;
+}
+
+/* The module is registered, start operating */
+
+void modem_up(struct modem *md)
+{
+	state_change(md, STATE_UP_SLEEPING, "Connected, entering operational mode");
+	hlog(LOG_NOTICE, PROGNAME " " VERSION " connected to %s, entering operational mode.", md->device);
+	
+	ev_timer_set(md->poll_timer, 0);
+	mo_kick();
+}
+
+/*
+ *	Check if the module needs a PIN code, send it if needed.
+ *	When checking a module which does not try to register (pin_reset),
+ *	a fatal error is an error while waiting for registration.
+ */
+
+void pin_fatal(struct modem *md)
+{
+	if (md->pin_reset)
+		modem_trouble(md, 5, 0, "Fatal error while waiting for registration");
+	else
+		modem_trouble(md, 4, 0, "Fatal error while sending PIN code");
+}
+
+void pin_done(struct modem *md)
+{
+	if (md->pin_reset) {
+		/* check registration again in a while */
+		md->pin_reset = 0;
+		ev_timer_set(md->conn_timer, 5000);
 	} else {
-		/* check for queued or unsolicited messages in buffer */
-		p = buf;
-		while ((p = strstr(p, "CMT:")))
-			p = mt_handle_pdu(p, f);
-		p = buf;
-		while ((p = strstr(p, "CBM:")))
-			p = mt_handle_pdu(p, f);
-		p = buf;
-		while ((p = strstr(p, "CDS:")))
-			p = mt_handle_pdu(p, f);
-		
-		if ((p = strstr(buf, "COPS: "))
-			&& (p = strchr(p, '"'))
-			&& (e = strchr(++p, '"'))) {
-			*e = 0;
-			net_status = str_append(net_status, " Operator:\"%s\"", p);
+		md->reinit = 1;
+		ev_timer_set(md->conn_timer, 0);
+	}
+}
+
+void pin_set_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	
+	if (c->result == AT_ERROR) {
+		hlog(LOG_CRIT, "%s: Module said \"ERROR\" for AT+CPIN=%s, wrong PIN?", md->device, pin);
+		pin_fatal(md);
+	} else if (c->result == AT_OK) {
+		hlog(LOG_INFO, "%s: SIM PIN code inserted", md->device);
+		pin_done(md);
+	} else {
+		hlog(LOG_CRIT, "%s: Module timed out after AT+CPIN=%s, possibly network registration is taking a long time or fails?", md->device, pin);
+		modem_trouble(md, OP_RECONNECT, retry_sleep, "Non-fatal error while sending PIN");
+	}
+}
+
+void cops_reset_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	
+	if (c->result != AT_OK) {
+		modem_trouble(md, OP_RECONNECT, retry_sleep, "Non-fatal error while enabling network registration");
+		return;
+	}
+	
+	if (md->cops_reset) {
+		/* give it a while to deregister */
+		ev_timer_set(md->conn_timer, 10000);
+	} else {
+		hlog(LOG_INFO, "%s: Attempt to enable network registration has been made.", md->device);
+		md->pin_reset = 0;
+		ev_timer_set(md->conn_timer, 5000);
+	}
+}
+
+void pin_check_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	char cmd[64];
+	
+	if (c->result == AT_ERROR) {
+		hlog(LOG_CRIT, "%s: Module said \"ERROR\" for AT+CPIN?, no SIM?", md->device);
+		pin_fatal(md);
+		return;
+	}
+	if (c->result != AT_OK) {
+		hlog(LOG_CRIT, "%s: Module did not respond with an OK to AT+CPIN?", md->device);
+		modem_trouble(md, OP_RECONNECT, retry_sleep, "Non-fatal error while sending PIN");
+		return;
+	}
+	
+	if (strstr(c->resp, "CPIN: SIM PIN")) {
+		hlog(LOG_DEBUG, "%s: Sending SIM PIN", md->device);
+		snprintf(cmd, sizeof(cmd), "AT+CPIN=%s", pin);
+		at_send(md->at, cmd, register_timeout, pin_set_cb, NULL);
+	} else if (strstr(c->resp, "CPIN: READY")) {
+		hlog(LOG_INFO, "%s: Module has the required PIN codes", md->device);
+		if (md->pin_reset) {
+			hlog(LOG_INFO, "%s: Trying to enable network registration with AT+COPS=2, AT+COPS=0", md->device);
+			md->cops_reset = 1;
+			at_send(md->at, "AT+COPS=2", cmd_timeout, cops_reset_cb, NULL);
+		} else
+			pin_done(md);
+	} else {
+		hlog(LOG_CRIT, "%s: Module is not READY and does not want SIM PIN, maybe wants PUK?", md->device);
+		pin_fatal(md);
+	}
+}
+
+void send_pin(struct modem *md, int reset_if_ready)
+{
+	hlog(LOG_DEBUG, "%s: Checking if the module has the PIN code", md->device);
+	md->pin_reset = reset_if_ready;
+	at_send(md->at, "AT+CPIN?", cmd_timeout, pin_check_cb, NULL);
+}
+
+/*
+ *	Check for network registration, and keep checking until registered
+ */
+
+void registration_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	
+	if (md->init_fail) {
+		modem_trouble(md, OP_RECONNECT, retry_sleep, "Non-fatal error while initializing module");
+		return;
+	}
+	md->reinit = 0;
+	
+	if (c->result != AT_OK) {
+		hlog(LOG_ERR, "%s: No OK response to AT+CREG? !", md->device);
+		modem_trouble(md, OP_RECONNECT, retry_sleep, "Non-fatal error while waiting for registration");
+		return;
+	}
+	
+	if (strstr(c->resp, "CREG: 1,0")) {
+		hlog(LOG_INFO, "%s: Module not trying to register, checking if PIN is needed", md->device);
+		send_pin(md, 1);
+		return;
+	} else if (strstr(c->resp, "CREG: 1,2")) {
+		hlog(LOG_INFO, "%s: Module is searching for a network to register on", md->device);
+		state_change(md, STATE_DOWN_NONETWORK, "Module is searching for a network to register on");
+	} else if (strstr(c->resp, "CREG: 1,1")) {
+		hlog(LOG_INFO, "%s: Module registered, home network", md->device);
+		modem_up(md);
+		return;
+	} else if (strstr(c->resp, "CREG: 1,5")) {
+		hlog(LOG_INFO, "%s: Module registered, roaming", md->device);
+		modem_up(md);
+		return;
+	} else {
+		hlog(LOG_INFO, "%s: Not registered, waiting", md->device);
+		state_change(md, STATE_DOWN_NONETWORK, "Module is not registered to a network, waiting");
+	}
+	
+	ev_timer_set(md->conn_timer, 5000);
+}
+
+/*
+ *	Initialize the module for SMS traffic. The commands do not depend
+ *	on each other, so they are all queued at once.
+ */
+
+static struct init_cmd {
+	char *cmd;
+	char *desc;
+	int optional;		/* error is ignored */
+} init_cmds[] = {
+	{ "AT+CMEE=2", "Enabling extended error reporting", 0 },
+	{ "AT+CREG=1", "Enabling unsolicited registration status messages", 0 },
+	{ "AT+CMGF=0", "Selecting SMS message format: PDU", 0 },
+	{ "AT+CSMS=1", "Enabling GSM 07.05 Phase 2+ mode", 1 },
+	{ "AT+CNMI=1,2,0,0", "Enabling unsolicited SMS message indications", 0 },
+	{ NULL, NULL, 0 }
+};
+
+void init_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	struct init_cmd *ic = arg;
+	
+	if (c->result != AT_OK && !ic->optional)
+		md->init_fail = 1;
+}
+
+void modem_registration(struct modem *md)
+{
+	struct init_cmd *ic;
+	
+	ev_timer_stop(md->poll_timer);
+	
+	if (md->reinit) {
+		md->init_fail = 0;
+		for (ic = init_cmds; (ic->cmd); ic++) {
+			hlog(LOG_DEBUG, "%s: %s", md->device, ic->desc);
+			at_send(md->at, ic->cmd, cmd_timeout, init_cb, ic);
 		}
 	}
+	
+	hlog(LOG_DEBUG, "%s: Checking if module is registered to a network", md->device);
+	at_send(md->at, "AT+CREG?", cmd_timeout, registration_cb, NULL);
+}
+
+/*
+ *	Check if the module responds to AT
+ */
+
+void ping_cb(struct at_chan *ch, struct at_cmd *c, void *arg)
+{
+	struct modem *md = ch->arg;
+	
+	if (c->result == AT_OK) {
+		send_pin(md, 0);
+		return;
+	}
+	
+	if (c->result == AT_IO)
+		hlog(LOG_ERR, "%s: Connection closed after sending ATE0", md->device);
+	else if (c->result == AT_TIMEOUT)
+		hlog(LOG_ERR, "%s: Module did not respond to ATE0 in %d ms", md->device, cmd_timeout);
+	else
+		hlog(LOG_ERR, "%s: Module did not respond to ATE0 with an OK", md->device);
+	
+	if (strchr(md->device, ':'))
+		modem_trouble(md, OP_RECONNECT, retry_sleep, "Module did not respond to ATE0 after connecting");
+	else
+		modem_trouble(md, 3, 0, "Could not talk with a serial device connected module");
+}
+
+/*
+ *	Unsolicited result codes from a module, and connection failures
+ */
+
+void module_urc(struct at_chan *ch, char *urc, char *pdu)
+{
+	struct modem *md = ch->arg;
+	char buf[IBLEN];
+	
+	if (!pdu) {
+		hlog(LOG_DEBUG, "%s: Unsolicited: %s", md->device, urc);
+		return;
+	}
+	
+	snprintf(buf, sizeof(buf), "%s\n%s\n", urc, pdu);
+	handle_mt_buffer(buf, md);
+}
+
+void module_failed(struct at_chan *ch)
+{
+	struct modem *md = ch->arg;
+	
+	hlog(LOG_ERR, "%s: I/O error on module, reconnecting", md->device);
+	modem_trouble(md, OP_RECONNECT, 1, "Module connection failed");
+}
+
+/* Connect to a module and start initializing it */
+
+void modem_connect(struct modem *md)
+{
+	state_change(md, STATE_DOWN_CONNECTING, "Connecting to module at %s", md->device);
+	md->fd = open_device(md->device);
+	if (md->fd == -1) {
+		modem_fail(md, 2, "Fatal error while opening device");
+		return;
+	}
+	if (md->fd == -2) {
+		md->fd = -1;
+		hlog(LOG_INFO, "%s: Temporary error while opening device, sleeping %d seconds", md->device, retry_sleep);
+		ev_timer_set(md->conn_timer, retry_sleep * 1000);
+		return;
+	}
+	
+	md->op_status = OP_RUNNING;
+	md->at = at_open(md->fd, md->device, module_urc, module_failed, md);
+	
+	state_change(md, STATE_DOWN_HANDSHAKING, "Connecting, initializing module");
+	hlog(LOG_INFO, "%s: Connected, initializing module ...", md->device);
+	hlog(LOG_DEBUG, "%s: Checking if the module is responding ...", md->device);
+	hwrite(md->fd, "\r\n");
+	at_send(md->at, "ATE0", cmd_timeout, ping_cb, NULL);
+}
+
+/*
+ *	Handle what a module needs after an event: reconnect, register
+ *	again or give up
+ */
+
+void modem_service(struct modem *md)
+{
+	int op = md->op_status;
+	
+	if (op == OP_RUNNING)
+		return;
+	
+	md->op_status = OP_RUNNING;
+	
+	if (op == OP_RECONNECT) {
+		modem_retry(md, md->op_delay, md->op_reason);
+	} else if (op == OP_REREGISTER) {
+		ev_timer_stop(md->poll_timer);
+		state_change(md, STATE_DOWN_NONETWORK, "%s, checking network registration", md->op_reason);
+		md->reinit = 1;
+		ev_timer_set(md->conn_timer, md->op_delay * 1000);
+	} else
+		modem_fail(md, op, md->op_reason);
+}
+
+/*
+ *	Event callbacks
+ */
+
+void conn_timer_cb(struct ev_timer *t, void *arg)
+{
+	struct modem *md = arg;
+	
+	if (!md->at) {
+		modem_connect(md);
+	} else if (md->cops_reset) {
+		md->cops_reset = 0;
+		at_send(md->at, "AT+COPS=0", cmd_timeout, cops_reset_cb, NULL);
+	} else
+		modem_registration(md);
+}
+
+void poll_timer_cb(struct ev_timer *t, void *arg)
+{
+	struct modem *md = arg;
+	
+	ev_timer_set(md->poll_timer, poll_time * 1000);
+	
+	/* a MO in progress polls again when it's done */
+	if (!md->at || md->state == STATE_UP_SENDING_MO || md->state == STATE_UP_POLLING)
+		return;
+	
+	poll_module(md);
+}
+
+void retry_timer_cb(struct ev_timer *t, void *arg)
+{
+	/* when no module is available, the next one to come up reschedules */
+	if (send_retries() == 0 && !pick_modem())
+		return;
+	
+	schedule_retries();
+}
+
+void spool_timer_cb(struct ev_timer *t, void *arg)
+{
+	struct modem *md;
+	
+	/* when no module is available, the next one to come up rescans */
+	if (!(md = pick_modem()))
+		return;
+	
+	/* a MO which was sent kicks the next scan */
+	if (check_spool(md) <= 0 && spool_watch_fd < 0)
+		ev_timer_set(spool_timer, spool_scantime);
+}
+
+/*
+ *	Watch the spool directory for new files, so that they can be
+ *	picked up right away instead of scanning the directory periodically
+ */
+
+void spool_watch_cb(int fd, void *arg)
+{
+#ifdef __linux__
+	char evbuf[4096];
+	struct inotify_event *ie;
+	char *p;
+	int l;
+	int found = 0;
+	
+	while ((l = read(fd, evbuf, sizeof(evbuf))) > 0) {
+		for (p = evbuf; p < evbuf + l; p += sizeof(*ie) + ie->len) {
+			ie = (struct inotify_event *)p;
+			if (ie->mask & IN_Q_OVERFLOW) {
+				/* events were lost, the directory needs a look */
+				hlog(LOG_NOTICE, "Spool directory watch overflowed, rescanning");
+				spool_rescan = 1;
+				found = 1;
+			} else if (ie->len && select_spoolf(ie->name)) {
+				spool_pending_add(spool_pending_new(ie->name, time(NULL)));
+				found = 1;
+			}
+		}
+	}
+	
+	if (found)
+		ev_timer_set(spool_timer, 0);
 #endif
-	return 0;
+}
+
+int spool_watch_init(void)
+{
+#ifdef __linux__
+	if ((spool_watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0) {
+		hlog(LOG_ERR, "inotify_init1 failed: %s", strerror(errno));
+	} else if (inotify_add_watch(spool_watch_fd, spool_dir, IN_MOVED_TO|IN_CLOSE_WRITE) < 0) {
+		hlog(LOG_ERR, "Could not watch spool directory %s: %s", spool_dir, strerror(errno));
+		close(spool_watch_fd);
+		spool_watch_fd = -1;
+	} else if (ev_add_fd(spool_watch_fd, spool_watch_cb, NULL)) {
+		close(spool_watch_fd);
+		spool_watch_fd = -1;
+	} else {
+		hlog(LOG_DEBUG, "Watching spool directory %s for new files", spool_dir);
+		return 0;
+	}
+#endif
+	hlog(LOG_INFO, "Scanning spool directory %s every %d ms", spool_dir, spool_scantime);
+	return -1;
 }
 
 /*
@@ -1838,13 +3431,14 @@ int poll_signal(int f)
 
 int main(int argc, char **argv)
 {
-	int f = -1, i;
-	char buf[IBLEN];
-	char *p;
-	time_t t, next_poll = 0;
+	struct modem *md;
+	struct timespec deadline, now;
+	char *fname;
+	int i, alive, busy;
 	
+	/* no input, but keep fd 0 taken so that handlers don't get a socket as stdin */
 	close(0);
-	signal(SIGCHLD, SIG_IGN);
+	open("/dev/null", O_RDONLY);
 	signal(SIGALRM, &sig_handler);
 	signal(SIGINT, &sig_handler);
 	signal(SIGTERM, &sig_handler);
@@ -1856,8 +3450,10 @@ int main(int argc, char **argv)
 	
 	parse_cmdline(argc, argv);
 	
-	open_log(logname);
-	state_change(STATE_DOWN_INIT, PROGNAME " " VERSION " starting up ...");
+	if (open_log(logname))
+		return 1;
+	for (md = modems; (md); md = md->next)
+		state_change(md, STATE_DOWN_INIT, PROGNAME " " VERSION " starting up ...");
 	
 	if (fork_a_daemon) {
 		i = fork();
@@ -1876,202 +3472,105 @@ int main(int argc, char **argv)
 	
 	if (pidfile)
 		writepid(pidfile);
+	
+	/* mapped after the fork, for the pid in it to be the daemon's */
+	for (md = modems; (md); md = md->next) {
+		fname = hmalloc(strlen(md->statefile) + 4 + 1);
+		sprintf(fname, "%s.map", md->statefile);
+		md->statemap = statemap_open(fname);
+		hfree(fname);
+		publish_state(md, 0);
+	}
+	
+	log_async_start();
 		
-	hlog(LOG_NOTICE, PROGNAME " " VERSION " starting up ...");
+	hlog(LOG_NOTICE, PROGNAME " " VERSION " starting up with %d module%s ...", modem_count, (modem_count == 1) ? "" : "s");
+	
+	if (ev_init())
+		return 1;
+	retry_timer = ev_timer_new(retry_timer_cb, NULL);
+	spool_timer = ev_timer_new(spool_timer_cb, NULL);
+	spool_watch_init();
+	handler_init(outhandler);
+	concat_init(mt_deliver);
+	mt_recover_parts();
+	journaling = (journal_open() >= 0);
+	if (metrics_addr)
+		metrics_init(write_metrics);
+	
+	for (md = modems; (md); md = md->next) {
+		md->conn_timer = ev_timer_new(conn_timer_cb, md);
+		md->poll_timer = ev_timer_new(poll_timer_cb, md);
+		md->state_timer = ev_timer_new(state_timer_cb, md);
+		ev_timer_set(md->conn_timer, 0);
+	}
 	
 	while (!shutting_down) {
-		if (f >= 0) {
-			close(f);
-			f = -1;
-			sleep(1);
-		}
-		state_change(STATE_DOWN_CONNECTING, "Connecting to module at %s", device);
-		f = open_device(device);
-		if (f == -1) {
-			state_change(STATE_DOWN_FAILQUIT, "Fatal error while opening device %s, giving up", device);
-			hlog(LOG_CRIT, "Fatal error while opening device %s, giving up", device);
-			return 2;
-		}
-		if (f == -2) {
-			hlog(LOG_INFO, "Temporary error while opening device, sleeping %d seconds", retry_sleep);
-			sleep(retry_sleep);
-			continue;
+		alive = 0;
+		for (md = modems; (md); md = md->next) {
+			modem_service(md);
+			if (md->state != STATE_DOWN_FAILQUIT)
+				alive++;
 		}
 		
-		state_change(STATE_DOWN_HANDSHAKING, "Connecting, initializing module");
-		hlog(LOG_INFO, "Connected, initializing module ...");
-		if (ping_module(f)) {
-			close(f);
-			f = -1;
-			if (host) {
-				state_change(STATE_DOWN_RETRYSLEEP, "Module did not respond to ATE=0 after connecting, sleeping %d seconds before retry", retry_sleep);
-				hlog(LOG_INFO, "Sleeping %d seconds before retry", retry_sleep);
-				sleep(retry_sleep);
-				continue;
-			} else {
-				state_change(STATE_DOWN_FAILQUIT, "Could not talk with a serial device connected module, giving up");
-				hlog(LOG_CRIT, "Could not talk with a serial device connected module, giving up");
-				return 3;
-			}
-		}
-		
-		i = send_pin(f, 0);
-		if (i > 0) {
-			close(f);
-			f = -1;
-			state_change(STATE_DOWN_FAILQUIT, "Fatal error while sending PIN code, giving up");
-			hlog(LOG_CRIT, "Fatal error while sending PIN code, giving up");
-			return 4;
-		}
-		if (i < 0) {
-			close(f);
-			f = -1;
-			state_change(STATE_DOWN_RETRYSLEEP, "Non-fatal error while sending PIN, sleeping %d seconds before retry", retry_sleep);
-			hlog(LOG_INFO, "Non-fatal error while sending PIN, sleeping %d seconds before retry", retry_sleep);
-			sleep(retry_sleep);
-			continue;
-		}
+		if (!alive)
+			return exit_code;
 		
-		i = wait_registration(f);
-		if (i > 0) {
-			close(f);
-			f = -1;
-			state_change(STATE_DOWN_FAILQUIT, "Fatal error while waiting for registration, giving up");
-			hlog(LOG_CRIT, "Fatal error while waiting for registration, giving up");
-			return 5;
-		}
-		if (i < 0) {
-			state_change(STATE_DOWN_RETRYSLEEP, "Non-fatal error while waiting for registration, sleeping %d seconds before retry", retry_sleep);
-			hlog(LOG_INFO, "Non-fatal error while waiting for registration, sleeping %d seconds before retry", retry_sleep);
-			close(f);
-			f = -1;
-			sleep(retry_sleep);
-			continue;
-		}
-		
-		state_change(STATE_UP_SLEEPING, "Connected, entering operational mode");
-		hlog(LOG_NOTICE, PROGNAME " " VERSION " connected, entering operational mode.");
-		
-		while (!shutting_down) {
-			if (running_state >= STATE_UP) {
-				/* if there are any retries to send, do so */
-				send_retries(f, mo_queue);
-				
-				/* check for MO, and poll immediately if MO was sent */
-				if (check_spool(f))
-					next_poll = 0;
-			}
-			
-			time(&t);
-			if (t > next_poll) {
-				if (running_state >= STATE_UP)
-					state_change(STATE_UP_POLLING, "Polling module");
-				/* check for MT */
-				next_poll = t + poll_time;
-				hlog(LOG_DEBUG, "Polling module");
-				
-				/* poll the device for queued messages every poll_time */
-				if (hwrite(f, "AT+CMGL=4\r\n") < 1) {
-					hlog(LOG_ERR, "I/O error on module, reconnecting");
-					break;
-				}
-				
-				if (readuntil(f, buf, IBLEN, expect_ok, expect_errors, cmd_timeout) < 1) {
-					hlog(LOG_ERR, "No response to AT+CMGL, reconnecting");
-					break;
-				}
-				if (string_in(buf, expect_errors)) {
-					hlog(LOG_ERR, "Module responded with an ERROR for AT+CMGL, sleeping 20s and checking registration");
-					sleep(20);
-					i = wait_registration(f);
-					if (i == 4) {
-						state_change(STATE_DOWN_FAILQUIT, "Fatal error while checking for registration, giving up");
-						return 5;
-					} else if (i) {
-						state_change(STATE_DOWN_RETRYSLEEP, "Error while checking for registration, reconnecting");
-						break;
-					}
-				} else {
-					/* check for queued or unsolicited messages in buffer */
-					p = buf;
-					while ((p = strstr(p, "CMT:")))
-						p = mt_handle_pdu(p, f);
-					p = buf;
-					while ((p = strstr(p, "CMGL:")))
-						p = mt_handle_pdu(p, f);
-					if (strstr(buf, "CMGL:")) {
-						/* If we got any messages using CMGL, we might not be receiving
-						 * unsolicited messages any more. Ack just to be sure.
-						 */
-						hwrite(f, "AT+CNMA=1\r\n");
-						readuntil(f, buf, IBLEN, expect_ok, expect_errors, cmd_timeout);
-						/*
-						hlog(LOG_DEBUG, "Enabling unsolicited SMS message indications");
-						if ((i = issue_cmd(f, "AT+CNMI=1,2,0,0", "reinit")) < 0)
-							break;
-						*/
-					}
-				}
-#ifndef DISABLED_FOR_SOME_REASON
-				if (poll_signal(f) == 0) {
-					if ((i = issue_cmd(f, "AT+CNMI=1,2,0,0", "poll")) < 0) {
-						hlog(LOG_ERR, "Could not enable unsolicited SMS message indications");
-						break;
-					}
-					state_change(STATE_UP_SLEEPING, "Waiting for something to happen");
-				} else
-					state_change(STATE_DOWN_NONETWORK, "No GSM network connection");
-#endif
-				state_change(STATE_UP_SLEEPING, "Waiting for something to happen");
-			}
-			
-			i = readuntil(f, buf, IBLEN, expect_mt, expect_errors, 500);
-			if (i > 0) {
-				p = buf + i;
-				i = readuntil(f, p, buf + IBLEN - p, expect_linefeed, expect_errors, cmd_timeout);
-				if (i < 0) {
-					hlog(LOG_ERR, "I/O error on module, reconnecting");
-					break;
-				}
-				p += i;
-				i = readuntil(f, p, buf + IBLEN - p, expect_linefeed, expect_errors, cmd_timeout);
-				if (i < 0) {
-					hlog(LOG_ERR, "I/O error on module, reconnecting");
-					break;
-				}
-				p = buf;
-				while ((p = strstr(p, "CMT:")))
-					p = mt_handle_pdu(p, f);
-				p = buf;
-				while ((p = strstr(p, "CBM:")))
-					p = mt_handle_pdu(p, f);
-				p = buf;
-				while ((p = strstr(p, "CDS:")))
-					p = mt_handle_pdu(p, f);
-			} else if (i < 0) {
-				hlog(LOG_ERR, "I/O error on module, reconnecting");
-				break;
-			}
-		}
+		ev_run(-1);
 	}
 	
-	/* shutting down */
-	state_change(STATE_DOWN_SHUTTINGDOWN, "Shutting down");
-	if (f >= 0) {
-		hlog(LOG_DEBUG, "Disabling unsolicited SMS message indications");
-		issue_cmd(f, "AT+CNMI=0,0,0,0", "shutdown");
+	/* shutting down: disable unsolicited messages, waiting a while for that */
+	for (md = modems; (md); md = md->next) {
+		state_change(md, STATE_DOWN_SHUTTINGDOWN, "Shutting down");
+		ev_timer_stop(md->poll_timer);
+		ev_timer_stop(md->conn_timer);
+		if (md->at && md->op_status == OP_RUNNING) {
+			hlog(LOG_DEBUG, "%s: Disabling unsolicited SMS message indications", md->device);
+			at_send(md->at, "AT+CNMI=0,0,0,0", cmd_timeout, NULL, NULL);
+		}
 	}
+	ev_timer_stop(retry_timer);
+	ev_timer_stop(spool_timer);
+	spool_pending_clear();
+	
+	/* messages received so far are synced and acknowledged */
+	mt_commit();
+	
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += cmd_timeout / 1000 + 1;
+	do {
+		busy = 0;
+		for (md = modems; (md); md = md->next)
+			if (md->at && !md->at->failed && at_pending(md->at))
+				busy++;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (busy && now.tv_sec < deadline.tv_sec && ev_run(1000) >= 0);
+	
+	for (md = modems; (md); md = md->next)
+		modem_close(md);
 	
-	close(f);
-	f = -1;
+	/* incomplete messages stay in their part files for the next start */
+	mt_commit();
+	if (stats_concat_sets)
+		hlog(LOG_NOTICE, "%ld incomplete concatenated messages left in the spool for the next start", stats_concat_sets);
+	handler_shutdown();
+	metrics_shutdown();
+	
+	journal_close();
 	
 	log_stats();
 	
-	if (stats_mo_queue_len)
-		hlog(LOG_ERR, "Lost %d queued messages!", stats_mo_queue_len);
+	if (stats_mo_queue_len && journaling)
+		hlog(LOG_NOTICE, "%ld queued messages left in the journal for the next start", stats_mo_queue_len);
+	else if (stats_mo_queue_len)
+		hlog(LOG_ERR, "Lost %ld queued messages!", stats_mo_queue_len);
 	hlog(LOG_CRIT, "Shut down.");
 	
-	state_change(STATE_DOWN_SHUTDOWN, "Shut down.");
+	for (md = modems; (md); md = md->next) {
+		state_change(md, STATE_DOWN_SHUTDOWN, "Shut down.");
+		if (md->statemap)
+			statemap_close(md->statemap);
+	}
+	
 	return 0;
 }
-
@@ -35,8 +35,10 @@
 #include "hmalloc.h"
 #include "log.h"
 #include "charset.h"
+#include "septet.h"
 
-struct message *mo_queue = NULL;	/* Outbound message queue */
+struct message **mo_queue = NULL;	/* Outbound message queue, a heap */
+static long mo_queue_size = 0;		/* allocated slots in mo_queue */
 
 long stats_mo_queue_len = 0;	/* MO: gauge: message queue length */
 long stats_mo_queued = 0;	/* MO: messages queued */
@@ -66,6 +68,8 @@ struct message *alloc_message(void)
 
 void free_message(struct message *m)
 {
+	int i;
+	
 	if (m->msgid)
 		hfree(m->msgid);
 	if (m->smsc)
@@ -82,39 +86,120 @@ void free_message(struct message *m)
 		hfree(m->content);
 	if (m->spoolfile)
 		hfree(m->spoolfile);
+	if (m->part_ofs)
+		hfree(m->part_ofs);
+	if (m->part_files) {
+		for (i = 0; m->part_files[i]; i++)
+			hfree(m->part_files[i]);
+		hfree(m->part_files);
+	}
 	hfree(m);
 }
 
+/*
+ *	The MO queue is a binary heap ordered by the next delivery attempt,
+ *	so that the first message to go is always on top. Messages being
+ *	sent right now sink to the bottom until they are done.
+ */
+
+static int mo_queue_before(struct message *a, struct message *b)
+{
+	if (a->sending != b->sending)
+		return b->sending;
+	
+	return a->next_try < b->next_try;
+}
+
+static void mo_queue_place(struct message *m, int i)
+{
+	mo_queue[i] = m;
+	m->qidx = i + 1;
+}
+
+static void mo_queue_sift(int i)
+{
+	struct message *m = mo_queue[i];
+	int c;
+	
+	/* up towards the top... */
+	while (i > 0 && mo_queue_before(m, mo_queue[(i - 1) / 2])) {
+		mo_queue_place(mo_queue[(i - 1) / 2], i);
+		i = (i - 1) / 2;
+	}
+	
+	/* ...or down towards the bottom */
+	while ((c = i * 2 + 1) < stats_mo_queue_len) {
+		if (c + 1 < stats_mo_queue_len && mo_queue_before(mo_queue[c + 1], mo_queue[c]))
+			c++;
+		if (!mo_queue_before(mo_queue[c], m))
+			break;
+		mo_queue_place(mo_queue[c], i);
+		i = c;
+	}
+	
+	mo_queue_place(m, i);
+}
+
 /*
  *	Queue and unqueue a message
  */
 
 void queue_message(struct message *m)
 {
-	if ((m->next) || (m->prevp))
+	if (m->qidx) {
 		hlog(LOG_CRIT, "queue_message() called on an already-queued message! BUG!");
-		
-	m->next = mo_queue;
-	if (m->next)
-		m->next->prevp = &m->next;
-	mo_queue = m;
-	m->prevp = &mo_queue;
+		return;
+	}
+	
+	if (stats_mo_queue_len == mo_queue_size) {
+		mo_queue_size = (mo_queue_size) ? mo_queue_size * 2 : 64;
+		mo_queue = hrealloc(mo_queue, mo_queue_size * sizeof(*mo_queue));
+	}
+	
+	mo_queue_place(m, stats_mo_queue_len++);
+	mo_queue_sift(m->qidx - 1);
 	
 	stats_mo_queued++;
-	stats_mo_queue_len++;
 }
 
 void unqueue_message(struct message *m)
 {
-	if (!m->prevp)
-		hlog(LOG_CRIT, "unqueue_message() called on a non-queued message, no m->prevp! BUG!");
-	else
-		*m->prevp = m->next;
-		
-	if (m->next)
-		m->next->prevp = m->prevp;
-		
-	stats_mo_queue_len--;
+	int i = m->qidx - 1;
+	
+	if (!m->qidx) {
+		hlog(LOG_CRIT, "unqueue_message() called on a non-queued message, no m->qidx! BUG!");
+		return;
+	}
+	
+	m->qidx = 0;
+	if (i != --stats_mo_queue_len) {
+		mo_queue_place(mo_queue[stats_mo_queue_len], i);
+		mo_queue_sift(i);
+	}
+}
+
+/*
+ *	The retry time or sending state of a queued message changed,
+ *	move it to the right place in the queue
+ */
+
+void requeue_message(struct message *m)
+{
+	if (m->qidx)
+		mo_queue_sift(m->qidx - 1);
+}
+
+/*
+ *	Return the message which should be attempted next, or NULL if the
+ *	queue is empty or everything in it is being sent right now
+ */
+
+struct message *mo_queue_first(void)
+{
+	if (!stats_mo_queue_len || mo_queue[0]->sending)
+		return NULL;
+	
+	return mo_queue[0];
 }
 
 /*
@@ -207,54 +292,93 @@ int hexstring2bin(char *src, int len, char *dst, int dstlen)
 }
 
 /*
- *	Convert GSM TS 03.38 7-bit default alphabet encoding to ASCII
+ *	Convert GSM TS 03.38 7-bit default alphabet encoding to ASCII,
+ *	skipping the first septets (taken by a user data header)
  */
  
-int binary2ascii(char *bin, int binlen, char *ascii, int dstlen, int stopatnull)
+#define SEPTET_BUF 1024
+
+int binary2ascii(char *bin, int binlen, char *ascii, int dstlen, int stopatnull, int skip)
 {
-	int l;
+	unsigned char septets[SEPTET_BUF];
+	int l, n, o;
 	unsigned char c;
-	int bit, bitpos = 0;
-	int bytepos, byteofs;
 	int extended = 0, ext_characters = 0;
 	
-	for (l = 0; l < binlen && l < dstlen; l++) {
-		c = 0;
-		for (bit = 0; bit < 7; bit++) {
-			bytepos = bitpos / 8;
-			byteofs = bitpos % 8;
-			if (bin[bytepos] & (1 << byteofs))
-				c = c | 128;
-			bitpos++;
-			c = (c >> 1) & 127;
-		}
-		if (c == 0 && stopatnull) {
-			ascii[l-ext_characters] = 0;
+	n = (binlen < dstlen - 1 + skip) ? binlen : dstlen - 1 + skip;
+	if (n > SEPTET_BUF)
+		n = SEPTET_BUF;
+	if (n > 0)
+		septet_unpack((unsigned char *)bin, n, septets);
+	if (skip > n)
+		skip = n;
+	
+	for (l = skip; l < n; l++) {
+		c = septets[l];
+		o = l - skip - ext_characters;
+		if (c == 0 && stopatnull)
 			break;
-		}
 		if (convert_charset) {
 			/* SMS => ISO-Latin-1 character conversion */
 			if (extended) {
 				/* second byte of an extended character */
-				ascii[l-ext_characters] = ext_convert(c, CS_SMS, CS_ISO);
+				ascii[o] = ext_convert(c, CS_SMS, CS_ISO);
 				extended = 0;
 			} else {
-				ascii[l-ext_characters] = convert(c, CS_SMS, CS_ISO);
+				ascii[o] = convert(c, CS_SMS, CS_ISO);
 				// If this is an ESC character, then an extended character code follows
-				if (ascii[l-ext_characters] == 0x1B) { 
+				if (ascii[o] == 0x1B) { 
 					ext_characters++;
 					extended = 1;
 				}
 			}
 		} else if (c == 0)
-			ascii[l-ext_characters] = 183;
+			ascii[o] = 183;
 		else
-			ascii[l-ext_characters] = c;
+			ascii[o] = c;
 	}
 	
-	ascii[l] = 0;
+	ascii[l - skip - ext_characters] = 0;
+	
+	return l - skip;
+}
+
+/*
+ *	Find a concatenated message element in a user data header, which
+ *	starts with its length octet. Returns the offset of the element,
+ *	and fills in the reference, the number of parts and the sequence
+ *	number, or returns -1 if there is none.
+ */
+
+int udh_concat(unsigned char *udh, int len, int *ref, int *ref16, int *parts, int *seq)
+{
+	int i, iel;
+	
+	if (len < 1 || udh[0] + 1 > len)
+		return -1;
+	len = udh[0] + 1;
+	
+	for (i = 1; i + 1 < len; i += 2 + iel) {
+		iel = udh[i + 1];
+		if (i + 2 + iel > len)
+			break;
+		if (udh[i] == 0x00 && iel == 3) {
+			*ref = udh[i + 2];
+			*ref16 = 0;
+			*parts = udh[i + 3];
+			*seq = udh[i + 4];
+			return i;
+		}
+		if (udh[i] == 0x08 && iel == 4) {
+			*ref = udh[i + 2] << 8 | udh[i + 3];
+			*ref16 = 1;
+			*parts = udh[i + 4];
+			*seq = udh[i + 5];
+			return i;
+		}
+	}
 	
-	return l;
+	return -1;
 }
 
 /*
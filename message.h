@@ -4,6 +4,8 @@
 
 #include <time.h>
 
+#include "timeline.h"
+
 struct message {
 	char *msgid;		/* Message identifier */
 	time_t received;	/* Received for processing by daemon */
@@ -26,9 +28,24 @@ struct message {
 	int tries;		/* number of sending attempts made */
 	int retry_time;		/* current retry delay */
 	time_t next_try;	/* time of next attempt */
+	int sending;		/* being transmitted by a module right now */
+	
+	int parts;		/* number of concatenated parts, 1 if not split */
+	int parts_sent;		/* MO: parts delivered so far */
+	int *part_ofs;		/* MO: offset of each part in content, and the end */
+	int concat_ref;		/* concatenation reference number */
+	int concat_ref16;	/* the reference is 16 bits instead of 8 */
+	int part_seq;		/* MT: sequence number of this part, from 1 */
+	int parts_got;		/* MT: parts received of a reassembled message */
+	char **part_files;	/* MT: spool files of the parts of a reassembled message, NULL terminated */
+	
+	long jid;		/* MO: journal key, 0 if not in the journal */
+	struct message *jnext;	/* MO: journaled messages */
+	struct message **jprevp;
+	
+	int qidx;		/* MO queue: position in the queue from 1, 0 if not queued */
 	
-	struct message *next;	/* message queue: next message */
-	struct message **prevp;	/* message queue: location of *next in the previous message */
+	struct timespec tl[TL_STAMPS];	/* when it got where, TL_* */
 };
 
 #define TON_UNKNOWN		0
@@ -54,7 +71,7 @@ extern char *alphabets[];
 extern char *messageclasses[];
 extern char *messagewaitclasses[];
 
-extern struct message *mo_queue;	/* Outbound message queue */
+extern struct message **mo_queue;	/* Outbound message queue, a heap */
 
 extern long stats_mo_queue_len;		/* MO: gauge: message queue length */
 extern long stats_mo_queued;		/* MO: messages queued */
@@ -66,11 +83,14 @@ extern struct message *alloc_message(void);
 extern void free_message(struct message *m);
 extern void queue_message(struct message *m);
 extern void unqueue_message(struct message *m);
+extern void requeue_message(struct message *m);
+extern struct message *mo_queue_first(void);
 extern char *npis(int npi); /* Return a string representation of a NPI */
 extern int octet2bin(char *octet); /* Convert an hex string octet value to 8-bit binary value */
 extern void bin2hexstring(char *binary, int length, char *pdu);
 extern int hexstring2bin(char *src, int len, char *dst, int dstlen);
-extern int binary2ascii(char *bin, int binlen, char *ascii, int dstlen, int stopatnull);
+extern int binary2ascii(char *bin, int binlen, char *ascii, int dstlen, int stopatnull, int skip);
+extern int udh_concat(unsigned char *udh, int len, int *ref, int *ref16, int *parts, int *seq);
 extern int ascii2escaped(char *src, int len, char *dst, int dstlen);
 extern void swapchars(char *string);
 extern char *genmsgid(char *prefix);
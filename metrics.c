@@ -0,0 +1,384 @@
+
+/*
+ *	metrics.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Metrics endpoint: a small HTTP server in the event loop, answering
+ *	every request with the counters, gauges and histograms of the
+ *	daemon in the Prometheus text format. It listens on a loopback TCP
+ *	port, or on a Unix socket:
+ *
+ *		curl http://127.0.0.1:9120/metrics
+ *		curl --unix-socket /var/run/m20d.metrics http://localhost/metrics
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* for accept4() */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "metrics.h"
+#include "event.h"
+#include "hmalloc.h"
+#include "log.h"
+
+#define MAX_CLIENTS	8	/* connections at a time, more are turned away */
+#define REQ_LEN		2048	/* bytes of request header read at most */
+#define REQ_TIMEOUT	5000	/* ms to wait for the request, and for the answer to be taken */
+
+char *metrics_addr = NULL;
+
+long stats_metrics_requests = 0;
+
+struct mclient {
+	int fd;
+	char buf[REQ_LEN];
+	int len;
+	char *out;			/* answer being written */
+	size_t out_len;
+	size_t out_done;
+	struct ev_timer *timer;
+	struct mclient *next;
+};
+
+static int listen_fd = -1;
+static int unix_socket = 0;		/* metrics_addr is a path */
+static metrics_cb render;
+static struct mclient *clients = NULL;
+static int nclients = 0;
+
+static void client_close(struct mclient *c)
+{
+	struct mclient **prevp;
+
+	for (prevp = &clients; (*prevp); prevp = &(*prevp)->next)
+		if (*prevp == c) {
+			*prevp = c->next;
+			break;
+		}
+	nclients--;
+
+	ev_del_fd(c->fd);
+	close(c->fd);
+	ev_timer_free(c->timer);
+	if (c->out)
+		free(c->out);
+	hfree(c);
+}
+
+/*
+ *	Write out as much of the answer as the socket takes, and close the
+ *	connection when it is all gone
+ */
+
+static void client_write_cb(int fd, void *arg)
+{
+	struct mclient *c = arg;
+	ssize_t l;
+
+	while (c->out_done < c->out_len) {
+		l = write(fd, c->out + c->out_done, c->out_len - c->out_done);
+		if (l < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (l <= 0) {
+			hlog(LOG_DEBUG, "Metrics: could not write answer: %s", strerror(errno));
+			break;
+		}
+		c->out_done += l;
+	}
+
+	client_close(c);
+}
+
+/*
+ *	Answer a request. The answer is rendered in full and written out
+ *	from the event loop as the socket has room, so that a client which
+ *	does not read can not hold up the modules.
+ */
+
+static void client_answer(struct mclient *c)
+{
+	char *body = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if (!strncmp(c->buf, "GET ", 4)) {
+		if (!(f = open_memstream(&body, &len))) {
+			hlog(LOG_ERR, "Metrics: open_memstream failed: %s", strerror(errno));
+			client_close(c);
+			return;
+		}
+		stats_metrics_requests++;
+		render(f);
+		fclose(f);
+	}
+
+	if (!(f = open_memstream(&c->out, &c->out_len))) {
+		hlog(LOG_ERR, "Metrics: open_memstream failed: %s", strerror(errno));
+		free(body);
+		client_close(c);
+		return;
+	}
+	if (body) {
+		fprintf(f, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %ld\r\nConnection: close\r\n\r\n", (long)len);
+		fwrite(body, len, 1, f);
+		free(body);
+	} else
+		fprintf(f, "HTTP/1.0 405 Method Not Allowed\r\n"
+			"Allow: GET\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	fclose(f);
+
+	c->out_done = 0;
+	ev_timer_set(c->timer, REQ_TIMEOUT);
+	if (ev_mod_fd(c->fd, client_write_cb, 1))
+		client_close(c);
+	else
+		client_write_cb(c->fd, c);
+}
+
+/*
+ *	Read the request, answer when the header is complete
+ */
+
+static void client_read_cb(int fd, void *arg)
+{
+	struct mclient *c = arg;
+	int l;
+
+	l = read(fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+	if (l < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (l <= 0) {
+		client_close(c);
+		return;
+	}
+
+	c->len += l;
+	c->buf[c->len] = 0;
+	if (strstr(c->buf, "\r\n\r\n") || strstr(c->buf, "\n\n") || c->len == sizeof(c->buf) - 1)
+		client_answer(c);
+}
+
+static void client_timer_cb(struct ev_timer *t, void *arg)
+{
+	client_close(arg);
+}
+
+static void accept_cb(int fd, void *arg)
+{
+	struct mclient *c;
+	int cfd;
+
+	if ((cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK)) < 0)
+		return;
+
+	if (nclients >= MAX_CLIENTS) {
+		hlog(LOG_DEBUG, "Metrics: too many connections, turning one away");
+		close(cfd);
+		return;
+	}
+
+	c = hmalloc(sizeof(*c));
+	c->fd = cfd;
+	c->len = 0;
+	c->buf[0] = 0;
+	c->out = NULL;
+	if (ev_add_fd(cfd, client_read_cb, c)) {
+		close(cfd);
+		hfree(c);
+		return;
+	}
+	c->timer = ev_timer_new(client_timer_cb, c);
+	ev_timer_set(c->timer, REQ_TIMEOUT);
+	c->next = clients;
+	clients = c;
+	nclients++;
+}
+
+/*
+ *	Start listening
+ */
+
+int metrics_init(metrics_cb cb)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	int one = 1;
+	int port;
+
+	render = cb;
+	unix_socket = (metrics_addr[0] == '/');
+
+	if (unix_socket) {
+		if (strlen(metrics_addr) >= sizeof(sun.sun_path)) {
+			hlog(LOG_ERR, "Metrics socket path %s is too long", metrics_addr);
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, metrics_addr);
+		/* left behind by an earlier run */
+		unlink(metrics_addr);
+		if ((listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0)) < 0
+		    || bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			goto fail;
+	} else {
+		if ((port = atoi(metrics_addr)) < 1 || port > 65535) {
+			hlog(LOG_ERR, "Metrics port %s is out of bounds (1-65535)", metrics_addr);
+			return -1;
+		}
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(port);
+		if ((listen_fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0)) < 0)
+			goto fail;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+			goto fail;
+	}
+
+	if (listen(listen_fd, MAX_CLIENTS) < 0)
+		goto fail;
+	if (ev_add_fd(listen_fd, accept_cb, NULL)) {
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+
+	hlog(LOG_INFO, "Serving metrics on %s%s", (unix_socket) ? "" : "127.0.0.1:", metrics_addr);
+	return 0;
+
+fail:
+	hlog(LOG_ERR, "Could not listen for metrics on %s: %s", metrics_addr, strerror(errno));
+	if (listen_fd >= 0)
+		close(listen_fd);
+	listen_fd = -1;
+	return -1;
+}
+
+void metrics_shutdown(void)
+{
+	while (clients)
+		client_close(clients);
+
+	if (listen_fd < 0)
+		return;
+
+	ev_del_fd(listen_fd);
+	close(listen_fd);
+	listen_fd = -1;
+	if (unix_socket && unlink(metrics_addr))
+		hlog(LOG_ERR, "Could not unlink metrics socket %s: %s", metrics_addr, strerror(errno));
+}
+
+/*
+ *	The text format
+ */
+
+void metrics_family(FILE *f, char *name, char *help, char *type)
+{
+	fprintf(f, "# HELP m20d_%s %s\n# TYPE m20d_%s %s\n", name, help, name, type);
+}
+
+/* a label value, with \ " and line feeds escaped */
+static void metrics_label(FILE *f, char *label, char *value)
+{
+	fprintf(f, "%s=\"", label);
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			fputc('\\', f);
+		if (*value == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*value, f);
+	}
+	fputc('"', f);
+}
+
+void metrics_value(FILE *f, char *name, char *label, char *value, double v)
+{
+	fprintf(f, "m20d_%s", name);
+	if (label) {
+		fputc('{', f);
+		metrics_label(f, label, value);
+		fputc('}', f);
+	}
+	fprintf(f, " %.17g\n", v);
+}
+
+void metrics_counter(FILE *f, char *name, char *help, long v)
+{
+	metrics_family(f, name, help, "counter");
+	metrics_value(f, name, NULL, NULL, v);
+}
+
+void metrics_gauge(FILE *f, char *name, char *help, double v)
+{
+	metrics_family(f, name, help, "gauge");
+	metrics_value(f, name, NULL, NULL, v);
+}
+
+/* the buckets of the text format count everything up to their bound */
+void metrics_hist(FILE *f, char *name, char *label, char *value, struct tl_hist *h)
+{
+	long n = 0;
+	int i;
+
+	for (i = 0; i < TL_HIST_BUCKETS; i++) {
+		n += h->bucket[i];
+		fprintf(f, "m20d_%s_bucket{", name);
+		if (label) {
+			metrics_label(f, label, value);
+			fputc(',', f);
+		}
+		if (tl_hist_limits[i] < 0)
+			fprintf(f, "le=\"+Inf\"} %ld\n", n);
+		else
+			fprintf(f, "le=\"%g\"} %ld\n", tl_hist_limits[i] / 1000.0, n);
+	}
+
+	fprintf(f, "m20d_%s_sum", name);
+	if (label) {
+		fputc('{', f);
+		metrics_label(f, label, value);
+		fputc('}', f);
+	}
+	fprintf(f, " %.6f\n", h->sum / 1000);
+
+	fprintf(f, "m20d_%s_count", name);
+	if (label) {
+		fputc('{', f);
+		metrics_label(f, label, value);
+		fputc('}', f);
+	}
+	fprintf(f, " %ld\n", h->count);
+}
@@ -0,0 +1,42 @@
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#include "timeline.h"
+
+/*
+ *	Metrics in the Prometheus text format, served over HTTP on a
+ *	loopback TCP port or on a Unix socket. Every request is answered
+ *	with what the callback writes out, and the connection is closed.
+ *	The numbers are the ones the daemon keeps anyway, read in the event
+ *	loop between other work, so keeping them costs nothing extra.
+ */
+
+typedef void (*metrics_cb)(FILE *f);
+
+extern char *metrics_addr;		/* port on 127.0.0.1, or path of a Unix socket, NULL: none */
+
+extern long stats_metrics_requests;	/* requests answered */
+
+/* Start listening, returns -1 if that could not be done */
+extern int metrics_init(metrics_cb cb);
+
+/* Stop listening, remove the Unix socket */
+extern void metrics_shutdown(void);
+
+/* Write a counter or a gauge, with its HELP and TYPE lines */
+extern void metrics_counter(FILE *f, char *name, char *help, long v);
+extern void metrics_gauge(FILE *f, char *name, char *help, double v);
+
+/* Write the HELP and TYPE lines of a metric family, and then a series
+ * of it with a label (NULL: none)
+ */
+extern void metrics_family(FILE *f, char *name, char *help, char *type);
+extern void metrics_value(FILE *f, char *name, char *label, char *value, double v);
+
+/* Write a series of a histogram family, in seconds */
+extern void metrics_hist(FILE *f, char *name, char *label, char *value, struct tl_hist *h);
+
+#endif
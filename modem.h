@@ -0,0 +1,82 @@
+
+#ifndef MODEM_H
+#define MODEM_H
+
+#include "event.h"
+#include "atcmd.h"
+#include "statemap.h"
+
+/*
+ *	running state
+ */
+
+#define STATE_UNDEFINED		0
+#define STATE_DOWN_INIT		1
+#define STATE_DOWN_CONNECTING	2
+#define STATE_DOWN_HANDSHAKING	3
+#define STATE_DOWN_NONETWORK	4
+#define STATE_DOWN_RETRYSLEEP	5
+#define STATE_DOWN_SHUTTINGDOWN	6
+#define STATE_DOWN_SHUTDOWN	7
+#define STATE_DOWN_FAILQUIT	8
+#define STATE_UP		9
+#define STATE_UP_SLEEPING	9
+#define STATE_UP_SENDING_MO	10
+#define STATE_UP_POLLING	11
+#define STATE_MAX		12
+
+/*
+ *	what a module needs after an operation
+ */
+
+#define OP_RUNNING	0	/* nothing, keep going */
+#define OP_RECONNECT	-1	/* reconnect to the module */
+#define OP_REREGISTER	-2	/* initialize again and wait for network registration */
+				/* > 0: give up on the module, with this exit code */
+
+/*
+ *	A GSM module, with the connection to it and its running state
+ */
+
+struct modem {
+	int id;				/* running number from 0 */
+	char *device;			/* device file name or host:port */
+	char *statefile;		/* state file name */
+	int fd;				/* connection to the module, -1 if none */
+	struct at_chan *at;		/* AT command channel, NULL if not connected */
+
+	int state;			/* running state */
+	char *last_message;		/* message given at the last state change */
+	char *net_status;		/* network status from the last poll */
+	int op_status;			/* OP_*, set when something needs to be done */
+	int op_delay;			/* seconds to wait before doing it */
+	const char *op_reason;		/* why it needs to be done */
+	int reinit;			/* initialize the module before checking registration */
+	int init_fail;			/* an initialization command failed */
+	int pin_reset;			/* checking the PIN of a module which does not register */
+	int cops_reset;			/* AT+COPS=2 given, AT+COPS=0 due next */
+	int poll_fail;			/* AT^MONI failed during this poll */
+	int no_cmms;			/* module does not support AT+CMMS */
+	int no_cmgd_bulk;		/* module does not support AT+CMGD=<index>,<delflag> */
+	long mo_seq;			/* sequence number of the last MO given to this module */
+	int draining;			/* sending a MO backlog back to back */
+	struct timespec drain_start;	/* when that started */
+	long drain_sent;		/* MO messages delivered since */
+
+	struct ev_timer *conn_timer;	/* connection attempts and registration checks */
+	struct ev_timer *poll_timer;	/* next poll */
+	struct ev_timer *state_timer;	/* coalesced state file rewrite */
+	struct statemap *statemap;	/* mapped state, NULL if none */
+	struct timespec state_written;	/* when the state file was last written */
+
+	long stats_mt;			/* received MT messages */
+	long stats_mo_ok;		/* MO: successfully delivered */
+	long stats_mo_try_fail;		/* MO: delivery attempts failed */
+
+	struct modem *next;
+};
+
+extern struct modem *modems;		/* all modules */
+
+#endif
+
@@ -0,0 +1,144 @@
+
+/*
+ *	septet.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	GSM 7-bit septet packing and unpacking, 8 septets <=> 7 octets
+ *	at a time in a 64-bit word. With BMI2 (gcc -mbmi2) the bits are
+ *	moved with a single pext / pdep per word.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdint.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+#include "septet.h"
+
+#define SEPTET_MASK	0x7f7f7f7f7f7f7f7fULL
+
+/*
+ *	Load and store 8 and 7 bytes as little-endian words. The compiler
+ *	turns these to plain loads and stores where it can.
+ */
+
+static inline uint64_t load8(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+		| (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t load7(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+		| (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48;
+}
+
+static inline void store7(unsigned char *p, uint64_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+	p[4] = v >> 32; p[5] = v >> 40; p[6] = v >> 48;
+}
+
+static inline void store8(unsigned char *p, uint64_t v)
+{
+	store7(p, v);
+	p[7] = v >> 56;
+}
+
+/*
+ *	8 septets in the low 7 bits of each byte <=> 56 bits
+ */
+
+static inline uint64_t pack_word(uint64_t s)
+{
+#ifdef __BMI2__
+	return _pext_u64(s, SEPTET_MASK);
+#else
+	s &= SEPTET_MASK;
+	/* close the gaps: pairs, then quads, then the two halves */
+	s = (s & 0x007f007f007f007fULL) | ((s & 0x7f007f007f007f00ULL) >> 1);
+	s = (s & 0x00003fff00003fffULL) | ((s & 0x3fff00003fff0000ULL) >> 2);
+	s = (s & 0x000000000fffffffULL) | ((s & 0x0fffffff00000000ULL) >> 4);
+	return s;
+#endif
+}
+
+static inline uint64_t unpack_word(uint64_t v)
+{
+#ifdef __BMI2__
+	return _pdep_u64(v, SEPTET_MASK);
+#else
+	v = (v & 0x000000000fffffffULL) | ((v & 0x00fffffff0000000ULL) << 4);
+	v = (v & 0x00003fff00003fffULL) | ((v & 0x0fffc0000fffc000ULL) << 2);
+	v = (v & 0x007f007f007f007fULL) | ((v & 0x3f803f803f803f80ULL) << 1);
+	return v;
+#endif
+}
+
+/*
+ *	Pack septets
+ */
+
+int septet_pack(const unsigned char *septets, int n, unsigned char *out)
+{
+	unsigned char tail[8];
+	int octets = SEPTET_OCTETS(n);
+	int i, j;
+
+	for (i = 0; i + 8 <= n; i += 8, septets += 8, out += 7)
+		store7(out, pack_word(load8(septets)));
+
+	if (i < n) {
+		/* the last partial word */
+		for (j = 0; j < 8; j++)
+			tail[j] = (i + j < n) ? septets[j] : 0;
+		store7(tail, pack_word(load8(tail)));
+		for (j = 0; j < octets - i / 8 * 7; j++)
+			out[j] = tail[j];
+	}
+
+	return octets;
+}
+
+/*
+ *	Unpack septets
+ */
+
+int septet_unpack(const unsigned char *in, int n, unsigned char *septets)
+{
+	unsigned char tail[8];
+	int octets = SEPTET_OCTETS(n);
+	int i, j;
+
+	for (i = 0; i + 8 <= n; i += 8, in += 7, septets += 8)
+		store8(septets, unpack_word(load7(in)));
+
+	if (i < n) {
+		for (j = 0; j < 7; j++)
+			tail[j] = (j < octets - i / 8 * 7) ? in[j] : 0;
+		store8(tail, unpack_word(load7(tail)));
+		for (j = 0; j < n - i; j++)
+			septets[j] = tail[j];
+	}
+
+	return n;
+}
+
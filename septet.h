@@ -0,0 +1,27 @@
+
+#ifndef SEPTET_H
+#define SEPTET_H
+
+/*
+ *	GSM 03.38 default alphabet septet packing: n 7-bit characters
+ *	take (7 * n + 7) / 8 octets, the first character in the low bits
+ *	of the first octet.
+ */
+
+/* number of octets n septets take */
+#define SEPTET_OCTETS(n)	((7 * (n) + 7) / 8)
+
+/* number of septets a user data header of n octets takes, fill bits included */
+#define UDH_SEPTETS(n)		(((n) * 8 + 6) / 7)
+
+/* Pack n septets (the high bit of each is ignored) to out, which
+ * must have room for SEPTET_OCTETS(n) octets. Returns the number of
+ * octets written.
+ */
+extern int septet_pack(const unsigned char *septets, int n, unsigned char *out);
+
+/* Unpack n septets from SEPTET_OCTETS(n) octets of in. Returns n. */
+extern int septet_unpack(const unsigned char *in, int n, unsigned char *septets);
+
+#endif
+
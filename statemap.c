@@ -0,0 +1,103 @@
+
+/*
+ *	statemap.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	The state of a module in a shared memory mapped file, guarded by
+ *	a sequence lock, so that monitoring tools can read it at any time
+ *	without the daemon rewriting a file for every state change.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "statemap.h"
+#include "log.h"
+
+/*
+ *	Create the file and map it. Readers which have the old file
+ *	mapped keep seeing it, so it is written anew in place rather than
+ *	replaced.
+ */
+
+struct statemap *statemap_open(char *fname)
+{
+	struct statemap *m;
+	int fd;
+
+	fd = open(fname, O_CREAT|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0) {
+		hlog(LOG_ERR, "Could not open state map %s: %s", fname, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, sizeof(*m))) {
+		hlog(LOG_ERR, "Could not size state map %s: %s", fname, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	m = mmap(NULL, sizeof(*m), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		hlog(LOG_ERR, "Could not map state map %s: %s", fname, strerror(errno));
+		return NULL;
+	}
+
+	statemap_begin(m);
+	/* everything after seq, left over from an earlier run */
+	memset(&m->pid, 0, sizeof(*m) - offsetof(struct statemap, pid));
+	m->magic = STATEMAP_MAGIC;
+	m->version = STATEMAP_VERSION;
+	m->pid = getpid();
+	statemap_end(m);
+
+	return m;
+}
+
+void statemap_close(struct statemap *m)
+{
+	munmap(m, sizeof(*m));
+}
+
+/*
+ *	The sequence lock. There is only one writer, the daemon.
+ */
+
+void statemap_begin(struct statemap *m)
+{
+	uint32_t seq = atomic_load_explicit(&m->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&m->seq, seq | 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+void statemap_end(struct statemap *m)
+{
+	uint32_t seq = atomic_load_explicit(&m->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&m->seq, (seq | 1) + 1, memory_order_release);
+}
@@ -0,0 +1,76 @@
+
+#ifndef STATEMAP_H
+#define STATEMAP_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/*
+ *	The state of a module, published in a shared memory mapped file
+ *	next to the state file (<state file>.map) for monitoring tools to
+ *	read without the daemon writing a file for them. The daemon
+ *	updates it on every state change; the text state file is only
+ *	rewritten right away when the module goes up or down or stops,
+ *	and otherwise at most once every state_interval seconds.
+ *
+ *	The struct is guarded by a sequence lock: seq is odd while the
+ *	daemon is updating it. A reader copies the struct, and takes the
+ *	copy if seq was even and did not change meanwhile, which is what
+ *	statemap_read() does. Strings are NUL terminated, numbers are in
+ *	the byte order of the host.
+ */
+
+#define STATEMAP_MAGIC		0x5330324dU	/* "M20S" on little-endian hosts */
+#define STATEMAP_VERSION	1
+
+struct statemap {
+	uint32_t magic;
+	uint32_t version;
+	_Atomic uint32_t seq;		/* odd while being updated */
+	uint32_t pid;			/* of the daemon */
+	int32_t state;			/* STATE_* */
+	uint32_t pad;
+	int64_t updated;		/* time_t of the last change */
+	int64_t changes;		/* state changes made */
+	int64_t spool_backlog;		/* MO spool files waiting */
+	int64_t spool_oldest_age;	/* seconds */
+	int64_t mo_queue_len;		/* MO messages waiting for a retry */
+	int64_t mt;			/* MT messages received by the module */
+	int64_t mo_ok;			/* MO messages delivered by it */
+	int64_t mo_try_fail;		/* MO attempts failed on it */
+	char state_name[32];
+	char device[128];
+	char message[256];		/* given at the last state change */
+	char network[128];		/* network status from the last poll */
+};
+
+/* Create and map the file, NULL on failure */
+extern struct statemap *statemap_open(char *fname);
+extern void statemap_close(struct statemap *m);
+
+/* Around an update, by the daemon */
+extern void statemap_begin(struct statemap *m);
+extern void statemap_end(struct statemap *m);
+
+/* Take a consistent copy, returns -1 if the daemon kept updating it */
+static inline int statemap_read(struct statemap *m, struct statemap *copy)
+{
+	uint32_t s1, s2;
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		s1 = atomic_load_explicit(&m->seq, memory_order_acquire);
+		if (s1 & 1)
+			continue;
+		memcpy((void *)copy, (void *)m, sizeof(*copy));
+		atomic_thread_fence(memory_order_acquire);
+		s2 = atomic_load_explicit(&m->seq, memory_order_relaxed);
+		if (s1 == s2)
+			return 0;
+	}
+
+	return -1;
+}
+
+#endif
@@ -0,0 +1,113 @@
+
+/*
+ *	timeline.c
+ *
+ *	m20d - driver for Siemens M20 GSM modules
+ *	by Heikki Hannikainen
+ *
+ *	Per-message latency timeline: the time a message spends in each
+ *	stage, from the timestamps it has collected on the way, logged
+ *	for the message and counted in a histogram for each stage.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "timeline.h"
+#include "log.h"
+
+struct tl_stage tl_stages[TS_STAGES] = {
+	{ "mo_spool",	TL_SEEN,	TL_PARSED },
+	{ "mo_queue",	TL_QUEUED,	TL_TRY },
+	{ "mo_encode",	TL_TRY,		TL_PDU },
+	{ "mo_cmgs",	TL_PDU,		TL_CMGS },
+	{ "mo_prompt",	TL_CMGS,	TL_PROMPT },
+	{ "mo_submit",	TL_PROMPT,	TL_RESULT },
+	{ "mo_total",	TL_SEEN,	TL_RESULT },
+	{ "mt_parse",	TL_SEEN,	TL_PARSED },
+	{ "mt_spool",	TL_PARSED,	TL_SPOOLED },
+	{ "mt_commit",	TL_SPOOLED,	TL_COMMITTED },
+	{ "mt_wait",	TL_COMMITTED,	TL_SPAWNED },
+	{ "mt_handler",	TL_SPAWNED,	TL_EXITED },
+	{ "mt_total",	TL_SEEN,	TL_EXITED }
+};
+
+/* upper bounds of the histogram buckets, ms, the last one has none */
+int tl_hist_limits[TL_HIST_BUCKETS] = { 1, 10, 100, 1000, 10000, -1 };
+
+void tl_stamp(struct timespec *tl, int n)
+{
+	clock_gettime(CLOCK_MONOTONIC, &tl[n]);
+}
+
+void tl_clear(struct timespec *tl, int first, int last)
+{
+	memset(&tl[first], 0, (last - first + 1) * sizeof(*tl));
+}
+
+void tl_hist_add(struct tl_hist *h, double ms)
+{
+	int n;
+
+	for (n = 0; n < TL_HIST_BUCKETS - 1 && ms > tl_hist_limits[n]; n++)
+		;
+	h->bucket[n]++;
+	h->count++;
+	h->sum += ms;
+	if (ms > h->max)
+		h->max = ms;
+}
+
+static int tl_isset(struct timespec *t)
+{
+	return t->tv_sec || t->tv_nsec;
+}
+
+void tl_report(char *msgid, char *what, struct timespec *tl, int first, int last)
+{
+	struct tl_stage *s;
+	struct timespec *a, *b;
+	char line[LOG_LEN];
+	double ms;
+	int i, l = 0;
+	int on = hlog_on(LOG_INFO);
+
+	if (on)
+		l = snprintf(line, sizeof(line), "[%s] TIMELINE %s", msgid, what);
+
+	for (i = first; i <= last; i++) {
+		s = &tl_stages[i];
+		a = &tl[s->from];
+		b = &tl[s->to];
+		if (!tl_isset(a) || !tl_isset(b))
+			continue;
+
+		ms = (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+		if (ms < 0)
+			ms = 0;
+		tl_hist_add(&s->h, ms);
+
+		/* the group is in the line already, the stage name follows it */
+		if (on && l < sizeof(line))
+			l += snprintf(line + l, sizeof(line) - l, " %s:%.3f", s->name + 3, ms);
+	}
+
+	if (on)
+		hlog(LOG_INFO, "%s", line);
+}
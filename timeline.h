@@ -0,0 +1,82 @@
+
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <time.h>
+
+/*
+ *	Where the time of a message goes. A message carries a
+ *	CLOCK_MONOTONIC timestamp for each point it has reached. When a
+ *	MO try or a MT message is done, the time between the points is
+ *	logged as one TIMELINE line of stage:ms fields, and added to a
+ *	histogram for each stage. A stage with either end missing (a
+ *	message recovered from the journal, a try which got no prompt)
+ *	is left out.
+ */
+
+/* timestamps */
+#define TL_SEEN		0	/* MO: spool file noticed, MT: PDU received */
+#define TL_PARSED	1	/* MO: spool file read, MT: PDU decoded */
+#define TL_QUEUED	2	/* MO: waiting for a module, from here */
+#define TL_TRY		3	/* MO: try or part started */
+#define TL_PDU		4	/* MO: PDU built */
+#define TL_CMGS		5	/* MO: AT+CMGS written */
+#define TL_PROMPT	6	/* MO: prompt received, PDU written */
+#define TL_RESULT	7	/* MO: final result of AT+CMGS */
+#define TL_SPOOLED	8	/* MT: spool file written */
+#define TL_COMMITTED	9	/* MT: spool synced, given to the handler */
+#define TL_SPAWNED	10	/* MT: a handler took it */
+#define TL_EXITED	11	/* MT: the handler is done with it */
+#define TL_STAMPS	12
+
+/* stages, the time from one timestamp to another */
+#define TS_MO_SPOOL	0	/* spool file noticed, to read */
+#define TS_MO_QUEUE	1	/* waiting for a module */
+#define TS_MO_ENCODE	2	/* building the PDU */
+#define TS_MO_CMGS	3	/* AT+CMGS waiting behind other commands */
+#define TS_MO_PROMPT	4	/* waiting for the prompt */
+#define TS_MO_SUBMIT	5	/* network submission, PDU to OK */
+#define TS_MO_TOTAL	6	/* spool file noticed, to the last OK */
+#define TS_MT_PARSE	7	/* decoding the PDU */
+#define TS_MT_SPOOL	8	/* reassembly and writing the spool file */
+#define TS_MT_COMMIT	9	/* waiting for the spool sync */
+#define TS_MT_WAIT	10	/* waiting for a handler */
+#define TS_MT_HANDLER	11	/* handler running */
+#define TS_MT_TOTAL	12	/* PDU received, to the handler done */
+#define TS_STAGES	13
+
+#define TL_HIST_BUCKETS	6
+
+/* a latency histogram, also used for the AT command round trips */
+struct tl_hist {
+	long bucket[TL_HIST_BUCKETS];	/* durations by bucket */
+	long count;
+	double sum;			/* ms */
+	double max;			/* longest, ms */
+};
+
+struct tl_stage {
+	char *name;
+	int from, to;			/* TL_* */
+	struct tl_hist h;
+};
+
+extern struct tl_stage tl_stages[TS_STAGES];
+extern int tl_hist_limits[TL_HIST_BUCKETS];	/* bucket upper bounds, ms, -1: none */
+
+/* Count a duration in a histogram */
+extern void tl_hist_add(struct tl_hist *h, double ms);
+
+/* Take the time for timestamp n */
+extern void tl_stamp(struct timespec *tl, int n);
+
+/* Forget timestamps first ... last */
+extern void tl_clear(struct timespec *tl, int first, int last);
+
+/* Log stages first ... last of a message as a TIMELINE line, with
+ * what (e.g. "MO try:1") in front of them, and count them in the
+ * histograms
+ */
+extern void tl_report(char *msgid, char *what, struct timespec *tl, int first, int last);
+
+#endif